@@ -0,0 +1,153 @@
+/*
+ * AVR Library: stackless coroutines
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _LIB_CORO_H_
+#define _LIB_CORO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sched.h"
+#include "timekeeping.h"
+
+/*
+ * a coroutine is a module poll function whose body is enclosed between
+ * CORO_BEGIN() and CORO_END() and that can wait in the middle of it with
+ * CORO_WAIT_UNTIL() / CORO_WAIT_FOR() - the next poll resumes right at the
+ * wait it returned from, instead of dispatching on an explicit state
+ *
+ * it is stackless: local variables don't survive a wait (keep everything
+ * needed across waits in the module data), waits can only be done in the
+ * coroutine function itself (not in functions it calls) and there can be
+ * at most one wait per source line
+ *
+ * the coroutine scheduler timer is armed by waits, so the main loop sleep
+ * computation (sched_get_next_poll_time()) covers it like any other module
+ *
+ * caller-allocated, don't access its members directly
+ */
+typedef struct {
+	bool running;
+	/* where to resume on the next poll, NULL to start from the beginning */
+	void *resume;
+
+	sched_timer sched_timer;
+} coro;
+
+#define _CORO_CONCAT_DO(a, b) a ## b
+#define _CORO_CONCAT(a, b) _CORO_CONCAT_DO(a, b)
+#define _CORO_LABEL _CORO_CONCAT(coro_resume_, __LINE__)
+
+/*
+ * init a coroutine: must be called before any other function on this
+ * coroutine, must be called with interrupts disabled
+ *
+ * pending_flag is the pending work flag of the module polling this coroutine
+ */
+static inline void coro_init(coro *co, uint8_t pending_flag)
+{
+	co->running = false;
+	co->resume = NULL;
+
+	sched_timer_register(&co->sched_timer, pending_flag);
+}
+
+/* returns whether a coroutine was started and hasn't reached its end yet */
+static inline bool coro_is_running(const coro *co)
+{
+	return co->running;
+}
+
+/*
+ * (re)start a coroutine from the beginning on the next poll
+ * (which is scheduled right away)
+ */
+static inline void coro_start(coro *co)
+{
+	co->running = true;
+	co->resume = NULL;
+
+	sched_timer_set_now(&co->sched_timer);
+}
+
+/*
+ * schedule a poll of a coroutine right away, should be called when
+ * a condition it may be waiting for in CORO_WAIT_FOR() changes
+ */
+static inline void coro_wake(coro *co)
+{
+	sched_timer_set_now(&co->sched_timer);
+}
+
+static inline bool coro_deadline_passed(const timestamp *deadline)
+{
+	timestamp now;
+
+	timekeeping_now_timestamp(&now);
+
+	return !timestamp_temporal_cmp(&now, deadline, <);
+}
+
+/*
+ * must be the first statement of a coroutine function (which has to return
+ * void), returns right away if the coroutine isn't running
+ */
+#define CORO_BEGIN(co)						\
+	do {							\
+		if (!(co)->running)				\
+			return;				\
+								\
+		if ((co)->resume != NULL)			\
+			goto *(co)->resume;			\
+	} while (0)
+
+/* finish a coroutine (can be used anywhere in its body) */
+#define CORO_EXIT(co)							\
+	do {								\
+		(co)->running = false;					\
+		(co)->resume = NULL;					\
+		sched_timer_clear(&(co)->sched_timer);			\
+		return;						\
+	} while (0)
+
+/* must be the last statement of a coroutine function */
+#define CORO_END(co) CORO_EXIT(co)
+
+/*
+ * wait until deadline (a const timestamp *) has passed,
+ * it is evaluated again on each poll so it must stay valid across the wait
+ */
+#define CORO_WAIT_UNTIL(co, deadline)					\
+	do {								\
+		(co)->resume = &&_CORO_LABEL;				\
+	_CORO_LABEL:							\
+		if (!coro_deadline_passed(deadline)) {			\
+			sched_timer_set(&(co)->sched_timer, (deadline));\
+			return;					\
+		}							\
+	} while (0)
+
+/*
+ * wait until cond is true, it is only evaluated again after the coroutine
+ * gets woken up by coro_wake()
+ */
+#define CORO_WAIT_FOR(co, cond)					\
+	do {								\
+		(co)->resume = &&_CORO_LABEL;				\
+	_CORO_LABEL:							\
+		/* clear before checking so no wakeup is lost */	\
+		sched_timer_clear(&(co)->sched_timer);			\
+		if (!(cond))						\
+			return;					\
+	} while (0)
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * AVR Library: critical section profiler
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <avr/cpufunc.h>
+#include <avr/pgmspace.h>
+
+#include "critprof.h"
+#include "debug.h"
+#include "sched.h"
+#include "timekeeping.h"
+
+#ifdef ENABLE_CRITPROF
+
+/* how often (in ms) the stats are dumped (and then reset) */
+#ifndef CRITPROF_DUMP_PERIOD
+#define CRITPROF_DUMP_PERIOD ((uint32_t)60 * 1000)
+#endif
+
+/* call sites that were entered at least once, newest first */
+static critprof_site *critprof_sites;
+
+static timestamp critprof_next_dump;
+static sched_timer critprof_sched_timer;
+
+void critprof_exit(critprof_site *site, uint16_t start)
+{
+	uint16_t cycles = cycles_now_atomic() - start;
+
+	if (!site->registered) {
+		site->next = critprof_sites;
+		critprof_sites = site;
+		site->registered = true;
+	}
+
+	if (site->count < UINT32_MAX)
+		site->count++;
+
+	if (cycles > site->cycles_max)
+		site->cycles_max = cycles;
+
+	if (UINT32_MAX - site->cycles_total >= cycles)
+		site->cycles_total += cycles;
+	else
+		site->cycles_total = UINT32_MAX;
+}
+
+static void critprof_dump(void)
+{
+	critprof_site *site;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_MemoryBarrier();
+		site = critprof_sites;
+		_MemoryBarrier();
+	}
+
+	dprintf_P(PSTR("critprof: site, count, max cycles, total cycles\n"));
+
+	while (site != NULL) {
+		critprof_site site_copy;
+
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			_MemoryBarrier();
+
+			site_copy = *site;
+
+			site->count = 0;
+			site->cycles_max = 0;
+			site->cycles_total = 0;
+
+			_MemoryBarrier();
+		}
+
+		if (site_copy.count > 0)
+			dprintf_P(PSTR("critprof: %s:%"PRIu16", %"PRIu32", %"PRIu16", %"PRIu32"\n"),
+				  site_copy.func, site_copy.line,
+				  site_copy.count, site_copy.cycles_max,
+				  site_copy.cycles_total);
+
+		site = site_copy.next;
+	}
+}
+
+static void critprof_sched_update(void)
+{
+	sched_timer_set(&critprof_sched_timer, &critprof_next_dump);
+}
+
+void critprof_poll(void)
+{
+	const timestamp_interval dump_period =
+		TIMESTAMPI_FROM_MS(CRITPROF_DUMP_PERIOD);
+
+	timestamp now;
+	timekeeping_now_timestamp(&now);
+	if (timestamp_temporal_cmp(&now, &critprof_next_dump, <))
+		return;
+
+	critprof_dump();
+
+	timestamp_add(&now, &dump_period, &critprof_next_dump);
+	critprof_sched_update();
+}
+
+void critprof_setup(void)
+{
+	const timestamp_interval dump_period =
+		TIMESTAMPI_FROM_MS(CRITPROF_DUMP_PERIOD);
+
+	critprof_sites = NULL;
+
+	timestamp now;
+	timekeeping_now_timestamp(&now);
+	timestamp_add(&now, &dump_period, &critprof_next_dump);
+
+	sched_timer_register(&critprof_sched_timer, PENDING_CRITPROF);
+	critprof_sched_update();
+}
+
+#else
+
+void critprof_poll(void)
+{
+}
+
+void critprof_setup(void)
+{
+}
+
+#endif
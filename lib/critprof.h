@@ -0,0 +1,101 @@
+/*
+ * AVR Library: critical section profiler
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _LIB_CRITPROF_H_
+#define _LIB_CRITPROF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <util/atomic.h>
+
+#include "cycles.h"
+
+/*
+ * define to record, for every critical section call site, how many times it
+ * was entered and the max / total CPU cycles spent in it with interrupts
+ * disabled, the results are periodically dumped over the debug port
+ *
+ * the cycles are sampled from the cycle counter, so sections longer than
+ * 65535 cycles (~8.9 ms at 7.3728 MHz) won't be measured correctly
+ *
+ * time spent in interrupt handlers themselves isn't accounted
+ */
+/* #define ENABLE_CRITPROF */
+
+/* a critical section call site, don't access its members directly */
+typedef struct critprof_site {
+	struct critprof_site *next;
+
+	const char *func;
+	uint16_t line;
+	bool registered;
+
+	uint32_t count;
+	uint16_t cycles_max;
+	uint32_t cycles_total;
+} critprof_site;
+
+#ifdef ENABLE_CRITPROF
+/* returns the cycle counter value to be later passed to critprof_exit() */
+static inline uint16_t critprof_enter(void)
+{
+	return cycles_now_atomic();
+}
+
+/* must be called with interrupts (still) disabled */
+void critprof_exit(critprof_site *site, uint16_t start);
+
+/* returns a (static) call site record for the place this is used at */
+#define CRITPROF_SITE()						\
+	({							\
+		static critprof_site critprof_site_var = {	\
+			.func = __func__,			\
+			.line = __LINE__			\
+		};						\
+								\
+		&critprof_site_var;				\
+	})
+#else
+static inline uint16_t critprof_enter(void)
+{
+	return 0;
+}
+
+static inline void critprof_exit(critprof_site *site, uint16_t start)
+{
+}
+
+#define CRITPROF_SITE() ((critprof_site *)NULL)
+#endif
+
+/*
+ * like ATOMIC_BLOCK(type), but profiled when ENABLE_CRITPROF is defined
+ *
+ * leaving the block by return or break skips the accounting
+ */
+#define CRITPROF_ATOMIC_BLOCK(type)					\
+	ATOMIC_BLOCK(type)						\
+	for (uint16_t critprof_start = critprof_enter(),		\
+		     critprof_once = 1; critprof_once;			\
+	     critprof_once = 0,						\
+		     critprof_exit(CRITPROF_SITE(), critprof_start))
+
+/* dumps the stats periodically */
+void critprof_poll(void);
+
+/*
+ * setup the profiler: must be called after sched_setup() and cycles_setup(),
+ * must be called with interrupts disabled
+ */
+void critprof_setup(void);
+
+#endif
@@ -0,0 +1,28 @@
+/*
+ * AVR Library: CPU cycle counter
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <avr/power.h>
+
+#include "cycles.h"
+
+void cycles_setup(void)
+{
+	power_timer1_enable();
+
+	TCCR1B = 0;
+	TIMSK1 = 0;
+	TCCR1A = 0;
+	TCNT1 = 0;
+	TIFR1 = _BV(ICF1) | _BV(OCF1B) | _BV(OCF1A) | _BV(TOV1);
+
+	/* normal mode, no prescaling */
+	TCCR1B = _BV(CS10);
+}
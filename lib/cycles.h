@@ -0,0 +1,58 @@
+/*
+ * AVR Library: CPU cycle counter
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _LIB_CYCLES_H_
+#define _LIB_CYCLES_H_
+
+#include <stdint.h>
+#include <avr/cpufunc.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+/*
+ * the counter is timer 1 running freely at the CPU clock, so it wraps
+ * around every 65536 cycles (~8.9 ms at 7.3728 MHz) - only intervals shorter
+ * than that can be measured with it
+ */
+
+/* returns the current counter value, needs interrupts disabled */
+static inline uint16_t cycles_now_atomic(void)
+{
+	return TCNT1;
+}
+
+/*
+ * returns the current counter value
+ *
+ * the counter read is done with interrupts disabled since an ISR reading
+ * it would overwrite the shared high byte temp register in the middle
+ * of our read
+ */
+static inline uint16_t cycles_now(void)
+{
+	uint16_t val;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_MemoryBarrier();
+		val = cycles_now_atomic();
+		_MemoryBarrier();
+	}
+
+	return val;
+}
+
+/*
+ * setup the cycle counter: must be called before any other cycles function,
+ * must be called with interrupts disabled, takes over timer 1
+ */
+void cycles_setup(void);
+
+#endif
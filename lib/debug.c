@@ -13,6 +13,7 @@
 #include <avr/pgmspace.h>
 #include <util/atomic.h>
 
+#include "critprof.h"
 #include "debug.h"
 
 #ifdef ENABLE_DEBUG_LOG
@@ -86,7 +87,7 @@ bool debug_buf_is_empty(void)
 {
 	bool ret;
 
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
 		_MemoryBarrier();
 		ret = debug_buf_is_empty_atomic();
 		_MemoryBarrier();
@@ -97,7 +98,7 @@ bool debug_buf_is_empty(void)
 
 void debug_put(uint8_t in)
 {
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
 		_MemoryBarrier();
 
 		debug_put_atomic(in);
@@ -117,7 +118,7 @@ static int debug_putc(char c, FILE *stream)
 
 void debug_put_str(uint8_t *in, uint8_t len)
 {
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
 		_MemoryBarrier();
 
 		for (uint8_t ctr = 0; ctr < len; ctr++)
@@ -131,7 +132,7 @@ void debug_put_str(uint8_t *in, uint8_t len)
 
 void debug_put_str_P(PGM_P *in, uint8_t len)
 {
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
 		_MemoryBarrier();
 
 		for (uint8_t ctr = 0; ctr < len; ctr++)
@@ -147,7 +148,7 @@ bool debug_buf_get(uint8_t *out)
 {
 	bool ret;
 
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
 		_MemoryBarrier();
 
 		if (!debug_buf_is_empty_atomic()) {
@@ -10,26 +10,94 @@
  */
 
 #include <stddef.h>
-#include <stdlib.h>
+#include <string.h>
 #include <avr/cpufunc.h>
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <avr/power.h>
 #include <avr/wdt.h>
 #include <util/atomic.h>
+#include <util/delay.h>
 #include <util/twi.h>
 
+#include "critprof.h"
 #include "debug.h"
 #include "i2c.h"
+#include "i2cqueue.h"
 #include "misc.h"
+#include "pending.h"
+#include "sched.h"
 
-/* bus clock in Hz */
+/* bus clocks in Hz: I2C_SPEED_STANDARD, I2C_SPEED_FAST and I2C_SPEED_SLOW */
 #ifndef I2C_BUS_CLOCK
 #define I2C_BUS_CLOCK ((uint32_t)100 * 1000)
 #endif
+#define I2C_BUS_CLOCK_FAST ((uint32_t)400 * 1000)
+#define I2C_BUS_CLOCK_SLOW ((uint32_t)50 * 1000)
+
+_Static_assert(F_CPU > 16 * I2C_BUS_CLOCK_FAST,
+	       "CPU clock too low for I2C Fast-mode");
+
+_Static_assert(F_CPU / TIMEKEEPING_DIV <= UINT32_MAX / 256,
+	       "timer clock too high for the I2C timeout math");
+
+/* how many failed transactions in a row make a device speed lower */
+#define I2C_SPEED_DOWNGRADE_FAILURES 3
+
+/*
+ * how many successful transactions in a row make a lowered device speed go
+ * one step back up (towards the one set by i2c_set_device_speed())
+ */
+#define I2C_SPEED_UPGRADE_SUCCESSES 32
+
+/*
+ * how many devices can have their speed set and statistics kept
+ * (transactions with devices above that still work)
+ */
+#ifndef I2C_DEVICES_MAX
+#define I2C_DEVICES_MAX 8
+#endif
+
+/*
+ * how many transactions can be queued at the same time
+ * (the queue has no dynamic allocations)
+ */
+#ifndef I2C_TRANSACTIONS_MAX
+#define I2C_TRANSACTIONS_MAX 4
+#endif
 
 #define I2C_RESET_POLL_PERIOD 5
-#define I2C_TRANS_TIMEOUT 5000
+
+/*
+ * a transaction times out after twice the time its bytes take on the bus
+ * at its speed plus this allowance (in ms) for devices stretching the clock
+ * and for the interrupt latency
+ */
+#ifndef I2C_CLOCK_STRETCH_ALLOWANCE
+#define I2C_CLOCK_STRETCH_ALLOWANCE 20
+#endif
+
+/*
+ * a transaction that made no progress for this long (in ms) is stuck,
+ * unless a device holds SCL low (then it is given up to its timeout)
+ *
+ * even at I2C_SPEED_SLOW there are less than 200 µs between TWI interrupts
+ */
+#define I2C_STUCK_CHECK_PERIOD 10
+
+/* bus clear clock half period in µs (about 50 kHz) */
+#define I2C_BUS_CLEAR_HALF_PERIOD 10
+#define I2C_BUS_CLEAR_CLOCKS 9
+
+/* the TWI pins */
+#ifndef I2C_PORT
+#define I2C_PORT PORTC
+#define I2C_DDR DDRC
+#define I2C_PIN PINC
+#define I2C_SCL_BIT 0
+#define I2C_SDA_BIT 1
+#endif
 
 #ifdef I2C_DEBUG_LOG_DISABLE
 #undef dprintf
@@ -45,195 +113,1272 @@ typedef enum { I2C_IDLE, I2C_RESET,
 	       I2C_REPEATED_START_DO, I2C_REPEATED_START_TX,
 	       I2C_READ_FIRST, I2C_READ,
 	       I2C_TRANS_OK_STOP_DO, I2C_TRANS_OK_STOP_TX,
-	       I2C_TRANS_FAILED_RESET } i2c_states;
+	       I2C_PROBE_NACK_STOP_DO,
+	       I2C_TRANS_FAILED_RESET, I2C_BUS_CLEAR } i2c_states;
 
 typedef struct _i2c_transaction_list {
+	i2cqueue_entry queue;
+
+	/* the free and done lists */
 	struct _i2c_transaction_list *next;
 
-	uint8_t addr;
-	const uint8_t *wrbuf;
-	uint8_t wrlen;
-	uint8_t *rdbuf;
-	uint8_t rdlen;
+	const i2c_segment *segs;
+	uint8_t segs_num;
+
+	/* the segment in progress: its index, buffer position and bytes left */
+	uint8_t seg_cur;
+	uint8_t *buf;
+	uint8_t len;
+
+	i2c_completion_fun fun;
+	void *data;
+
+	uint8_t rdlen_actual;
+	bool success;
+
+	/* i2c_speeds */ uint8_t speed;
+	timestamp_interval timeout;
+
+	/* a bus scan probe, not counted in the device statistics */
+	bool probe;
+
+	/* segments of a transaction queued by i2c_transaction() */
+	i2c_segment segs_simple[2];
+} i2c_transaction_list;
+
+/* i2c_queue_pop_atomic() casts the queue entry back */
+_Static_assert(offsetof(i2c_transaction_list, queue) == 0,
+	       "the queue entry has to be the first transaction member");
+
+typedef enum { I2C_ERROR_ADDR_NACK, I2C_ERROR_DATA_NACK, I2C_ERROR_BUS,
+	       I2C_ERROR_ARB_LOST, I2C_ERROR_TIMEOUT } i2c_errors;
+
+typedef struct {
+	/* i2c_speeds */ uint8_t speed;
+	/* i2c_speeds */ uint8_t speed_set;
+	uint8_t failures;
+	uint8_t successes;
+
+	/* the latencies are in timer counts here, without the average */
+	i2c_device_stats stats;
+	uint32_t latency_sum;
+} i2c_device;
+
+/*
+ * the byte level part of a transaction (from the START to the STOP) is driven
+ * by TWI_vect, the main loop starts transactions, watches for timeouts and
+ * resets the bus with interrupts disabled (i2c_poll_atomic()), then delivers
+ * their completions and clears a held SDA line with interrupts enabled
+ * (i2c_poll())
+ */
+static /* i2c_states */ uint8_t i2c_state;
+static timestamp i2c_next_reset_idle_poll;
+
+static timestamp i2c_transaction_deadline;
+
+/* TWI interrupts seen, compared at i2c_stuck_check time */
+static uint8_t i2c_progress;
+static uint8_t i2c_progress_checked;
+static timestamp i2c_stuck_check;
+
+static i2c_recovery_stats i2c_recovery_stats_data;
+
+/* the transaction at the queue head has finished, completion not called yet */
+static bool i2c_trans_finished;
+static bool i2c_trans_success;
+static /* i2c_errors */ uint8_t i2c_trans_error;
+
+/* the START and the STOP time of the transaction in progress */
+static timestamp i2c_trans_start;
+static timestamp i2c_trans_end;
+
+/* the last device a transaction was done with, for a stuck STOP */
+static uint8_t i2c_last_addr;
+
+static i2c_transaction_list i2c_transaction_pool[I2C_TRANSACTIONS_MAX];
+static i2c_transaction_list *i2c_transaction_free_head;
+
+/* the transaction in progress (or done, not moved to the done list yet) */
+static i2c_transaction_list *i2c_transaction_cur;
+
+/*
+ * finished transactions, in the order they have finished, waiting for
+ * i2c_poll() to call their completions (and free them)
+ *
+ * only touched from the main loop, so needs no interrupt protection
+ */
+static i2c_transaction_list *i2c_done_head;
+static i2c_transaction_list *i2c_done_tail;
+
+/* transactions waiting to be started */
+static i2cqueue i2c_queue;
+
+static sched_timer i2c_sched_timer;
+
+static i2c_device i2c_devices[I2C_DEVICES_MAX];
+static uint8_t i2c_devices_num;
+
+/* the bus scan, one probe at a time, and the result of the last one */
+static bool i2c_scan_running;
+static uint8_t i2c_scan_first, i2c_scan_last;
+static uint16_t i2c_scan_found_mask;
+static uint8_t i2c_scan_result_first, i2c_scan_result_last;
+static uint16_t i2c_scan_result_mask;
+static i2c_segment i2c_scan_seg;
+
+/* TWBR and TWSR prescaler bits for each speed */
+static uint8_t i2c_speed_twbr[I2C_SPEEDS_NUM];
+static uint8_t i2c_speed_twps[I2C_SPEEDS_NUM];
+static /* i2c_speeds */ uint8_t i2c_speed_cur;
+
+/*
+ * timer counts a bus bit takes at each speed (as a 24.8 fixed point number,
+ * rounded up) and the transaction timeout allowance in timer counts, so
+ * i2c_segments_timeout() gets by with 32-bit math
+ */
+static uint32_t i2c_speed_bit_counts[I2C_SPEEDS_NUM];
+static uint32_t i2c_timeout_allowance_counts;
+
+/*
+ * the state machine runs from TWI_vect too, so its state changes and
+ * unexpected bus statuses are only recorded there, i2c_poll() logs them
+ */
+#define I2C_TRACE_LEN 32
+
+/* TW_STATUS has its low bits masked, so this isn't a valid one */
+#define I2C_TRACE_NO_STATUS 0xff
+
+typedef struct {
+	/* i2c_states */ uint8_t state;
+	uint8_t status;
+} i2c_trace_entry;
+
+static i2c_trace_entry i2c_trace[I2C_TRACE_LEN];
+static uint8_t i2c_trace_head, i2c_trace_num;
+static uint8_t i2c_trace_lost;
+
+static const char i2c_state_name_idle[] PROGMEM = "I2C_IDLE";
+static const char i2c_state_name_reset[] PROGMEM = "I2C_RESET";
+static const char i2c_state_name_start_do[] PROGMEM = "I2C_START_DO";
+static const char i2c_state_name_start_tx[] PROGMEM = "I2C_START_TX";
+static const char i2c_state_name_addr[] PROGMEM = "I2C_ADDR";
+static const char i2c_state_name_write_first[] PROGMEM = "I2C_WRITE_FIRST";
+static const char i2c_state_name_write[] PROGMEM = "I2C_WRITE";
+static const char i2c_state_name_repeated_start_do[] PROGMEM =
+	"I2C_REPEATED_START_DO";
+static const char i2c_state_name_repeated_start_tx[] PROGMEM =
+	"I2C_REPEATED_START_TX";
+static const char i2c_state_name_read_first[] PROGMEM = "I2C_READ_FIRST";
+static const char i2c_state_name_read[] PROGMEM = "I2C_READ";
+static const char i2c_state_name_trans_ok_stop_do[] PROGMEM =
+	"I2C_TRANS_OK_STOP_DO";
+static const char i2c_state_name_trans_ok_stop_tx[] PROGMEM =
+	"I2C_TRANS_OK_STOP_TX";
+static const char i2c_state_name_probe_nack_stop_do[] PROGMEM =
+	"I2C_PROBE_NACK_STOP_DO";
+static const char i2c_state_name_trans_failed_reset[] PROGMEM =
+	"I2C_TRANS_FAILED_RESET";
+static const char i2c_state_name_bus_clear[] PROGMEM = "I2C_BUS_CLEAR";
+
+static PGM_P const i2c_state_names[] PROGMEM = {
+	[I2C_IDLE] = i2c_state_name_idle,
+	[I2C_RESET] = i2c_state_name_reset,
+	[I2C_START_DO] = i2c_state_name_start_do,
+	[I2C_START_TX] = i2c_state_name_start_tx,
+	[I2C_ADDR] = i2c_state_name_addr,
+	[I2C_WRITE_FIRST] = i2c_state_name_write_first,
+	[I2C_WRITE] = i2c_state_name_write,
+	[I2C_REPEATED_START_DO] = i2c_state_name_repeated_start_do,
+	[I2C_REPEATED_START_TX] = i2c_state_name_repeated_start_tx,
+	[I2C_READ_FIRST] = i2c_state_name_read_first,
+	[I2C_READ] = i2c_state_name_read,
+	[I2C_TRANS_OK_STOP_DO] = i2c_state_name_trans_ok_stop_do,
+	[I2C_TRANS_OK_STOP_TX] = i2c_state_name_trans_ok_stop_tx,
+	[I2C_PROBE_NACK_STOP_DO] = i2c_state_name_probe_nack_stop_do,
+	[I2C_TRANS_FAILED_RESET] = i2c_state_name_trans_failed_reset,
+	[I2C_BUS_CLEAR] = i2c_state_name_bus_clear
+};
+
+static bool i2c_trace_enabled(void)
+{
+	return
+#ifdef I2C_DEBUG_LOG_DISABLE
+		false
+#else
+		debug_enabled()
+#endif
+		;
+}
+
+/*
+ * records the current state, with status if it isn't I2C_TRACE_NO_STATUS
+ *
+ * mostly called from TWI_vect, so the critical section isn't profiled
+ */
+static void i2c_trace_add(uint8_t status)
+{
+	if (!i2c_trace_enabled())
+		return;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_MemoryBarrier();
+
+		if (i2c_trace_num < I2C_TRACE_LEN) {
+			i2c_trace_entry *entry =
+				&i2c_trace[(i2c_trace_head + i2c_trace_num) %
+					   I2C_TRACE_LEN];
+
+			entry->state = i2c_state;
+			entry->status = status;
+			i2c_trace_num++;
+		} else if (i2c_trace_lost < UINT8_MAX)
+			i2c_trace_lost++;
+
+		_MemoryBarrier();
+	}
+}
+
+/* logs the recorded state changes, with interrupts enabled */
+static void i2c_trace_print(void)
+{
+	if (!i2c_trace_enabled())
+		return;
+
+	uint8_t lost = 0;
+
+	while (1) {
+		i2c_trace_entry entry;
+		bool have_entry;
+
+		CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			_MemoryBarrier();
+
+			have_entry = i2c_trace_num > 0;
+			if (have_entry) {
+				entry = i2c_trace[i2c_trace_head];
+				i2c_trace_head = (i2c_trace_head + 1) %
+					I2C_TRACE_LEN;
+				i2c_trace_num--;
+			} else {
+				lost = i2c_trace_lost;
+				i2c_trace_lost = 0;
+			}
+
+			_MemoryBarrier();
+		}
+
+		if (!have_entry)
+			break;
+
+		if (entry.status != I2C_TRACE_NO_STATUS) {
+			dprintf_P(PSTR_M("i2c: STATUS %x\n"),
+				  (unsigned)entry.status);
+			continue;
+		}
+
+		PGM_P name =
+			(PGM_P)pgm_read_word(&i2c_state_names[entry.state]);
+		dprintf_P(PSTR_M("%S: *%S\n"), PSTR_M("i2c"), name);
+	}
+
+	if (lost > 0)
+		dprintf_P(PSTR("i2c: %u state changes not logged\n"),
+			  (unsigned)lost);
+}
+
+#define I2C_SETSTATE(state_new)					\
+	do								\
+		if (i2c_state != state_new) {				\
+			i2c_set_state_do(state_new);			\
+			i2c_trace_add(I2C_TRACE_NO_STATUS);		\
+		}							\
+	while (0)
+
+static void i2c_twcr_set_bits_atomic(uint8_t bits)
+{
+	uint8_t val = TWCR;
+	val &= ~_BV(TWINT);
+	val |= bits;
+	TWCR = val;
+}
+
+static void i2c_twcr_clear_bits_atomic(uint8_t bits)
+{
+	uint8_t val = TWCR;
+	val &= ~_BV(TWINT);
+	val &= ~bits;
+	TWCR = val;
+}
+
+static void i2c_twcr_set_cmd_bits_atomic(uint8_t bits)
+{
+	uint8_t val = TWCR;
+	val &= ~(_BV(TWINT) | _BV(TWEA) | _BV(TWSTA) | _BV(TWSTO));
+	val |= bits;
+	TWCR = val;
+}
+
+static void i2c_twcr_set_bits(uint8_t bits)
+{
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_MemoryBarrier();
+		i2c_twcr_set_bits_atomic(bits);
+		_MemoryBarrier();
+	}
+}
+
+static void i2c_twcr_clear_bits(uint8_t bits)
+{
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_MemoryBarrier();
+		i2c_twcr_clear_bits_atomic(bits);
+		_MemoryBarrier();
+	}
+}
+
+static bool i2c_is_reset_idle_poll_state(void)
+{
+	return i2c_state == I2C_RESET || i2c_state == I2C_TRANS_OK_STOP_TX;
+}
+
+static bool i2c_is_transaction_wait_deadline_state(void)
+{
+	return i2c_state == I2C_START_TX ||
+		i2c_state == I2C_REPEATED_START_TX || i2c_state == I2C_ADDR ||
+		i2c_state == I2C_WRITE || i2c_state == I2C_READ ||
+		i2c_state == I2C_TRANS_OK_STOP_TX;
+}
+
+/* states the engine handles right away, without waiting for TWINT */
+static bool i2c_is_engine_step_state(void)
+{
+	return i2c_state == I2C_START_DO ||
+		i2c_state == I2C_REPEATED_START_DO ||
+		i2c_state == I2C_WRITE_FIRST || i2c_state == I2C_READ_FIRST ||
+		i2c_state == I2C_TRANS_OK_STOP_DO ||
+		i2c_state == I2C_PROBE_NACK_STOP_DO;
+}
+
+static void i2c_sched_update(void)
+{
+	if (i2c_trans_finished || i2c_done_head != NULL ||
+	    i2c_state == I2C_TRANS_FAILED_RESET || i2c_state == I2C_BUS_CLEAR)
+		sched_timer_set_now(&i2c_sched_timer);
+	else if (i2c_is_reset_idle_poll_state())
+		sched_timer_set(&i2c_sched_timer, &i2c_next_reset_idle_poll);
+	/* assume that reset poll period is much shorter than tx deadline */
+	else if (i2c_is_transaction_wait_deadline_state())
+		/* never after the transaction deadline */
+		sched_timer_set(&i2c_sched_timer, &i2c_stuck_check);
+	else
+		sched_timer_clear(&i2c_sched_timer);
+}
+
+static void i2c_stuck_check_arm(void)
+{
+	const timestamp_interval stuck_check_period =
+		TIMESTAMPI_FROM_MS(I2C_STUCK_CHECK_PERIOD);
+
+	timestamp now;
+	timekeeping_now_timestamp(&now);
+	timestamp_add(&now, &stuck_check_period, &i2c_stuck_check);
+
+	if (timestamp_temporal_cmp(&i2c_transaction_deadline,
+				   &i2c_stuck_check, <))
+		i2c_stuck_check = i2c_transaction_deadline;
+
+	i2c_progress_checked = i2c_progress;
+}
+
+static void i2c_set_state_do(i2c_states state_new)
+{
+	bool was_reset_idle_poll_state = i2c_is_reset_idle_poll_state();
+
+	i2c_state = state_new;
+
+	if (i2c_state == I2C_TRANS_OK_STOP_DO ||
+	    i2c_state == I2C_PROBE_NACK_STOP_DO ||
+	    i2c_state == I2C_TRANS_FAILED_RESET) {
+		/* can be in TWI_vect, the main loop calls the completion */
+		i2c_trans_finished = true;
+		i2c_trans_success = i2c_state == I2C_TRANS_OK_STOP_DO;
+
+		if (i2c_trans_success)
+			timekeeping_now_timestamp(&i2c_trans_end);
+	} else if (i2c_state == I2C_START_DO) {
+		timekeeping_now_timestamp(&i2c_trans_start);
+		timestamp_add(&i2c_trans_start, &i2c_transaction_cur->timeout,
+			      &i2c_transaction_deadline);
+
+		i2c_stuck_check_arm();
+	} else if (i2c_state == I2C_TRANS_OK_STOP_TX)
+		i2c_stuck_check_arm();
+
+	if (!was_reset_idle_poll_state && i2c_is_reset_idle_poll_state())
+		timekeeping_now_timestamp(&i2c_next_reset_idle_poll);
+}
+
+static const i2c_segment *i2c_transaction_seg(const i2c_transaction_list *tr)
+{
+	return &tr->segs[tr->seg_cur];
+}
+
+static void i2c_transaction_seg_load(i2c_transaction_list *tr)
+{
+	const i2c_segment *seg = i2c_transaction_seg(tr);
+
+	tr->buf = seg->buf;
+	tr->len = seg->len;
+}
+
+/* moves to the next segment, returns false if there are no more segments */
+static bool i2c_transaction_seg_next(i2c_transaction_list *tr)
+{
+	if (tr->seg_cur + 1 >= tr->segs_num)
+		return false;
+
+	tr->seg_cur++;
+	i2c_transaction_seg_load(tr);
+
+	return true;
+}
+
+static void i2c_stat_inc(uint16_t *stat)
+{
+	if (*stat < UINT16_MAX)
+		(*stat)++;
+}
+
+/* whether segment idx is the first one with its address */
+static bool i2c_segments_addr_is_first(const i2c_segment *segs, uint8_t idx)
+{
+	for (uint8_t ctr = 0; ctr < idx; ctr++)
+		if (segs[ctr].addr == segs[idx].addr)
+			return false;
+
+	return true;
+}
+
+static i2c_device *i2c_device_find(uint8_t addr)
+{
+	for (uint8_t ctr = 0; ctr < i2c_devices_num; ctr++)
+		if (i2c_devices[ctr].stats.addr == addr)
+			return &i2c_devices[ctr];
+
+	return NULL;
+}
+
+/* returns NULL if there is no room for another device */
+static i2c_device *i2c_device_get(uint8_t addr)
+{
+	i2c_device *dev = i2c_device_find(addr);
+	if (dev != NULL)
+		return dev;
+
+	if (i2c_devices_num >= I2C_DEVICES_MAX)
+		return NULL;
+
+	dev = &i2c_devices[i2c_devices_num++];
+	memset(dev, 0, sizeof(*dev));
+	dev->stats.addr = addr;
+	dev->speed = dev->speed_set = I2C_SPEED_STANDARD;
+	dev->stats.latency_min = UINT16_MAX;
+
+	return dev;
+}
+
+static void i2c_device_account_success(uint8_t addr, uint16_t latency)
+{
+	i2c_device *dev = i2c_device_get(addr);
+	if (dev == NULL)
+		return;
+
+	dev->failures = 0;
+
+	if (dev->speed < dev->speed_set &&
+	    ++dev->successes >= I2C_SPEED_UPGRADE_SUCCESSES) {
+		dev->successes = 0;
+		dev->speed++;
+
+		dprintf_P(PSTR("i2c: device %x speed raised to %u\n"),
+			  (unsigned)addr, (unsigned)dev->speed);
+	}
+
+	if (dev->stats.ok == UINT16_MAX)
+		return;
+
+	dev->stats.ok++;
+
+	dev->latency_sum += latency;
+	if (latency < dev->stats.latency_min)
+		dev->stats.latency_min = latency;
+	if (latency > dev->stats.latency_max)
+		dev->stats.latency_max = latency;
+}
+
+/*
+ * a noisy bus (or a device that can't keep up) tends to fail at
+ * a higher speed first, so step down after a few failures in a row
+ *
+ * an address NACK doesn't count, that is just a missing (unplugged) device
+ * and a lower speed wouldn't help it
+ */
+static void i2c_device_account_failure(uint8_t addr, uint8_t error)
+{
+	i2c_device *dev = i2c_device_get(addr);
+	if (dev == NULL)
+		return;
+
+	if (error == I2C_ERROR_ADDR_NACK)
+		i2c_stat_inc(&dev->stats.addr_nacks);
+	else if (error == I2C_ERROR_DATA_NACK)
+		i2c_stat_inc(&dev->stats.data_nacks);
+	else if (error == I2C_ERROR_ARB_LOST)
+		i2c_stat_inc(&dev->stats.arb_losses);
+	else if (error == I2C_ERROR_TIMEOUT)
+		i2c_stat_inc(&dev->stats.timeouts);
+	else /* I2C_ERROR_BUS */
+		i2c_stat_inc(&dev->stats.bus_errors);
+
+	if (error == I2C_ERROR_ADDR_NACK)
+		return;
+
+	dev->successes = 0;
+
+	if (++dev->failures < I2C_SPEED_DOWNGRADE_FAILURES)
+		return;
+
+	dev->failures = 0;
+
+	if (dev->speed == I2C_SPEED_SLOW)
+		return;
+
+	if (dev->speed == I2C_SPEED_FAST)
+		dev->speed = I2C_SPEED_STANDARD;
+	else
+		dev->speed = I2C_SPEED_SLOW;
+
+	dprintf_P(PSTR("i2c: device %x speed lowered to %u\n"),
+		  (unsigned)addr, (unsigned)dev->speed);
+}
+
+static void i2c_device_account_reset(uint8_t addr)
+{
+	i2c_device *dev = i2c_device_get(addr);
+	if (dev == NULL)
+		return;
+
+	i2c_stat_inc(&dev->stats.resets);
+}
+
+static uint8_t i2c_device_speed(uint8_t addr)
+{
+	/* a device is only added to the table by its first transaction end */
+	i2c_device *dev = i2c_device_find(addr);
+	if (dev == NULL)
+		return I2C_SPEED_STANDARD;
+
+	return dev->speed;
+}
+
+/*
+ * each segment is a (repeated) START, the address byte and its data bytes
+ * (with their ACK bits), then there is a STOP at the end
+ */
+static void i2c_segments_timeout(const i2c_segment *segs, uint8_t segs_num,
+				 uint8_t speed, timestamp_interval *timeout)
+{
+	uint32_t bits = 1;
+
+	for (uint8_t ctr = 0; ctr < segs_num; ctr++)
+		bits += 1 + 9 * ((uint16_t)segs[ctr].len + 1);
+
+	uint32_t counts = (2 * bits * i2c_speed_bit_counts[speed] + 255) >> 8;
+	counts += i2c_timeout_allowance_counts;
+
+	const timestamp_interval interval = TIMESTAMPI_FROM_COUNTS(counts);
+	*timeout = interval;
+}
+
+/* a transaction runs at the speed of its slowest device */
+static uint8_t i2c_segments_speed(const i2c_segment *segs, uint8_t segs_num)
+{
+	uint8_t speed = I2C_SPEED_FAST;
+
+	for (uint8_t ctr = 0; ctr < segs_num; ctr++) {
+		uint8_t seg_speed = i2c_device_speed(segs[ctr].addr);
+
+		if (seg_speed < speed)
+			speed = seg_speed;
+	}
+
+	return speed;
+}
+
+bool i2c_set_device_speed(uint8_t addr, i2c_speeds speed)
+{
+	i2c_device *dev = i2c_device_get(addr);
+	if (dev == NULL)
+		return false;
+
+	dev->speed = dev->speed_set = speed;
+	dev->failures = 0;
+	dev->successes = 0;
+
+	return true;
+}
+
+i2c_speeds i2c_get_device_speed(uint8_t addr)
+{
+	i2c_device *dev = i2c_device_find(addr);
+	if (dev == NULL)
+		return I2C_SPEED_STANDARD;
+
+	return dev->speed;
+}
+
+/*
+ * µs per timer count, as a 16.16 fixed point number (rounded), so the
+ * conversion needs no 64-bit math or division at runtime
+ */
+#define I2C_COUNT_US_SHIFT 16
+#define I2C_COUNT_US_SCALE						\
+	((uint32_t)((((uint64_t)TIMEKEEPING_DIV * 1000000 <<		\
+		      I2C_COUNT_US_SHIFT) + F_CPU / 2) / F_CPU))
+
+/* counts above this saturate, below it the product fits in 32 bits */
+#define I2C_COUNT_US_MAX_COUNTS						\
+	(((uint32_t)UINT16_MAX << I2C_COUNT_US_SHIFT) / I2C_COUNT_US_SCALE)
+
+static uint16_t i2c_counts_to_us(uint32_t counts)
+{
+	if (counts > I2C_COUNT_US_MAX_COUNTS)
+		return UINT16_MAX;
+
+	return (counts * I2C_COUNT_US_SCALE) >> I2C_COUNT_US_SHIFT;
+}
+
+bool i2c_get_device_stats(uint8_t idx, i2c_device_stats *stats)
+{
+	if (idx >= i2c_devices_num)
+		return false;
+
+	const i2c_device *dev = &i2c_devices[idx];
+
+	*stats = dev->stats;
+
+	if (stats->ok == 0) {
+		stats->latency_min = stats->latency_avg =
+			stats->latency_max = 0;
+		return true;
+	}
+
+	stats->latency_min = i2c_counts_to_us(dev->stats.latency_min);
+	stats->latency_avg = i2c_counts_to_us(dev->latency_sum /
+					      dev->stats.ok);
+	stats->latency_max = i2c_counts_to_us(dev->stats.latency_max);
+
+	return true;
+}
+
+/* the bus is idle between transactions, so the clock can be switched then */
+static void i2c_speed_apply_atomic(uint8_t speed)
+{
+	if (speed == i2c_speed_cur)
+		return;
+
+	TWBR = i2c_speed_twbr[speed];
+	TWSR = (TWSR & ~(_BV(TWPS0) | _BV(TWPS1))) | i2c_speed_twps[speed];
+
+	i2c_speed_cur = speed;
+}
+
+static void i2c_transaction_account(const i2c_transaction_list *tr)
+{
+	if (i2c_trans_success) {
+		timestamp_interval latency_interval;
+		timestamp_diff(&i2c_trans_end, &i2c_trans_start,
+			       &latency_interval);
+
+		uint32_t latency = timestampi_to_counts(&latency_interval);
+		if (latency > UINT16_MAX)
+			latency = UINT16_MAX;
+
+		for (uint8_t ctr = 0; ctr < tr->segs_num; ctr++)
+			if (i2c_segments_addr_is_first(tr->segs, ctr))
+				i2c_device_account_success(tr->segs[ctr].addr,
+							   latency);
+	} else {
+		/* the segment it failed at */
+		uint8_t addr = i2c_transaction_seg(tr)->addr;
+
+		i2c_device_account_failure(addr, i2c_trans_error);
+		i2c_device_account_reset(addr);
+	}
+
+	i2c_last_addr = tr->segs[tr->segs_num - 1].addr;
+}
+
+/*
+ * moves the finished transaction to the done list, the accounting is done
+ * here since it needs the timestamps of the transaction in progress
+ */
+static void i2c_transaction_finish_atomic(void)
+{
+	i2c_transaction_list *tr = i2c_transaction_cur;
+
+	if (!tr->probe)
+		i2c_transaction_account(tr);
+
+	tr->success = i2c_trans_success;
+
+	i2c_transaction_cur = NULL;
+	i2c_trans_finished = false;
+
+	tr->next = NULL;
+	if (i2c_done_tail != NULL)
+		i2c_done_tail->next = tr;
+	else
+		i2c_done_head = tr;
+	i2c_done_tail = tr;
+}
+
+static void i2c_transaction_complete(void)
+{
+	i2c_transaction_list *tr = i2c_done_head;
+	i2c_completion_fun fun = tr->fun;
+	void *data = tr->data;
+	bool success = tr->success;
+	uint8_t rdlen_actual = tr->rdlen_actual;
+
+	i2c_done_head = tr->next;
+	if (i2c_done_head == NULL)
+		i2c_done_tail = NULL;
+
+	/* free before the completion so it can queue a new one */
+	tr->next = i2c_transaction_free_head;
+	i2c_transaction_free_head = tr;
+
+	if (fun != NULL)
+		fun(data, success, rdlen_actual);
+}
+
+/* returns NULL if nothing is queued */
+static i2c_transaction_list *i2c_queue_pop_atomic(void)
+{
+	timestamp now;
+
+	timekeeping_now_timestamp_atomic(&now);
+
+	return (i2c_transaction_list *)i2cqueue_pop(&i2c_queue, &now);
+}
+
+static void i2c_reset(void)
+{
+	i2c_recovery_stats_data.twi_resets++;
+
+	i2c_twcr_clear_bits(_BV(TWEA) | _BV(TWSTA) | _BV(TWSTO) | _BV(TWEN) |
+			    _BV(TWIE));
+	i2c_twcr_set_bits(_BV(TWINT) | _BV(TWEN));
+
+	I2C_SETSTATE(I2C_RESET);
+}
+
+static uint8_t i2c_status_to_error(uint8_t status)
+{
+	if (status == TW_MT_SLA_NACK || status == TW_MR_SLA_NACK)
+		return I2C_ERROR_ADDR_NACK;
+	else if (status == TW_MT_DATA_NACK)
+		return I2C_ERROR_DATA_NACK;
+	else if (status == TW_MT_ARB_LOST)
+		return I2C_ERROR_ARB_LOST;
+
+	/* a TW_BUS_ERROR or an unexpected status */
+	return I2C_ERROR_BUS;
+}
+
+static void i2c_trans_fail_atomic(uint8_t error)
+{
+	/* TWINT stays set, so TWI_vect would fire again and again */
+	i2c_twcr_clear_bits_atomic(_BV(TWIE));
+
+	i2c_trans_error = error;
+
+	I2C_SETSTATE(I2C_TRANS_FAILED_RESET);
+}
+
+static void i2c_trans_fail_status_atomic(uint8_t status)
+{
+	i2c_trans_fail_atomic(i2c_status_to_error(status));
+}
+
+static void i2c_engine_step_atomic(void)
+{
+	if (i2c_state == I2C_START_DO ||
+	    i2c_state == I2C_REPEATED_START_DO) {
+		if (i2c_state == I2C_START_DO)
+			i2c_speed_apply_atomic(i2c_transaction_cur->speed);
+
+		i2c_twcr_set_cmd_bits_atomic(_BV(TWINT) | _BV(TWSTA) |
+					     _BV(TWIE));
+
+		if (i2c_state == I2C_START_DO)
+			I2C_SETSTATE(I2C_START_TX);
+		else /* I2C_REPEATED_START_DO */
+			I2C_SETSTATE(I2C_REPEATED_START_TX);
+	} else if (i2c_state == I2C_START_TX ||
+		   i2c_state == I2C_REPEATED_START_TX) {
+		if (bit_is_clear(TWCR, TWINT))
+			return;
+
+		uint8_t status = TW_STATUS;
+		if (status != TW_START && status != TW_REP_START) {
+			i2c_trace_add(status);
+			i2c_trans_fail_status_atomic(status);
+			return;
+		}
+
+		const i2c_segment *seg =
+			i2c_transaction_seg(i2c_transaction_cur);
+
+		uint8_t data = seg->addr << 1;
+		if (seg->read)
+			data |= TW_READ;
+		else
+			data |= TW_WRITE;
+
+		TWDR = data;
+
+		i2c_twcr_set_cmd_bits_atomic(_BV(TWINT) | _BV(TWIE));
+
+		I2C_SETSTATE(I2C_ADDR);
+	} else if (i2c_state == I2C_ADDR) {
+		if (bit_is_clear(TWCR, TWINT))
+			return;
+
+		bool read = i2c_transaction_seg(i2c_transaction_cur)->read;
+
+		uint8_t status = TW_STATUS;
+		if (i2c_transaction_cur->probe &&
+		    (status == TW_MT_SLA_NACK || status == TW_MR_SLA_NACK)) {
+			/*
+			 * just nothing at this address, the bus is fine so
+			 * end the probe with a STOP instead of a TWI reset
+			 */
+			i2c_trans_error = I2C_ERROR_ADDR_NACK;
+			I2C_SETSTATE(I2C_PROBE_NACK_STOP_DO);
+			return;
+		}
+
+		if (status != (read ? TW_MR_SLA_ACK : TW_MT_SLA_ACK)) {
+			i2c_trace_add(status);
+			i2c_trans_fail_status_atomic(status);
+			return;
+		}
+
+		if (read)
+			I2C_SETSTATE(I2C_READ_FIRST);
+		else
+			I2C_SETSTATE(I2C_WRITE_FIRST);
+	} else if (i2c_state == I2C_WRITE_FIRST ||
+		   i2c_state == I2C_WRITE) {
+		if (i2c_state == I2C_WRITE) {
+			if (bit_is_clear(TWCR, TWINT))
+				return;
+
+			uint8_t status = TW_STATUS;
+			if (status != TW_MT_DATA_ACK &&
+			    (status != TW_MT_DATA_NACK ||
+			     i2c_transaction_cur->len != 0)) {
+				i2c_trace_add(status);
+				i2c_trans_fail_status_atomic(status);
+				return;
+			}
+		}
+
+		if (i2c_transaction_cur->len == 0) {
+			if (i2c_transaction_seg_next(i2c_transaction_cur))
+				I2C_SETSTATE(I2C_REPEATED_START_DO);
+			else
+				I2C_SETSTATE(I2C_TRANS_OK_STOP_DO);
+		} else {
+			TWDR = *i2c_transaction_cur->buf;
+			i2c_transaction_cur->buf++;
+			i2c_transaction_cur->len--;
+
+			i2c_twcr_set_cmd_bits_atomic(_BV(TWINT) | _BV(TWIE));
+
+			I2C_SETSTATE(I2C_WRITE);
+		}
+	} else if (i2c_state == I2C_READ_FIRST ||
+		   i2c_state == I2C_READ) {
+		if (i2c_state == I2C_READ) {
+			if (bit_is_clear(TWCR, TWINT))
+				return;
+
+			uint8_t status = TW_STATUS;
+			if (status != TW_MR_DATA_ACK &&
+			    status != TW_MR_DATA_NACK) {
+				i2c_trace_add(status);
+				i2c_trans_fail_status_atomic(status);
+				return;
+			}
+
+			*i2c_transaction_cur->buf = TWDR;
+			i2c_transaction_cur->buf++;
+			i2c_transaction_cur->len--;
+			i2c_transaction_cur->rdlen_actual++;
+		}
+
+		if (i2c_transaction_cur->len > 0) {
+			/* NACK the last byte of a segment */
+			uint8_t ackbit =
+				i2c_transaction_cur->len > 1 ?
+				_BV(TWEA) : 0;
+
+			i2c_twcr_set_cmd_bits_atomic(_BV(TWINT) | ackbit |
+						     _BV(TWIE));
+
+			I2C_SETSTATE(I2C_READ);
+		} else if (i2c_transaction_seg_next(i2c_transaction_cur))
+			I2C_SETSTATE(I2C_REPEATED_START_DO);
+		else
+			I2C_SETSTATE(I2C_TRANS_OK_STOP_DO);
+	} else if (i2c_state == I2C_TRANS_OK_STOP_DO ||
+		   i2c_state == I2C_PROBE_NACK_STOP_DO) {
+		/* there won't be any TWINT after a STOP */
+		i2c_twcr_set_cmd_bits_atomic(_BV(TWINT) | _BV(TWSTO));
+
+		I2C_SETSTATE(I2C_TRANS_OK_STOP_TX);
+	} else
+		/* not a transfer state (for example, after a timeout) */
+		i2c_twcr_clear_bits_atomic(_BV(TWIE));
+}
+
+/* advance the transaction as far as possible without waiting */
+static void i2c_engine_atomic(void)
+{
+	do
+		i2c_engine_step_atomic();
+	while (i2c_is_engine_step_state());
+}
+
+/* returns false if there is no queued transaction to start */
+static bool i2c_transaction_start_next_atomic(void)
+{
+	i2c_transaction_cur = i2c_queue_pop_atomic();
+	if (i2c_transaction_cur == NULL)
+		return false;
+
+	I2C_SETSTATE(I2C_START_DO);
+	i2c_engine_atomic();
+
+	return true;
+}
+
+ISR(TWI_vect)
+{
+	i2c_progress++;
+
+	i2c_engine_atomic();
+
+	/* the main loop only needs to know when the transaction is done */
+	if (i2c_trans_finished)
+		pending_set(PENDING_I2C);
+}
+
+static bool i2c_segments_are_valid(const i2c_segment *segs, uint8_t segs_num)
+{
+	if (segs == NULL || segs_num == 0)
+		return false;
+
+	for (uint8_t ctr = 0; ctr < segs_num; ctr++) {
+		/* a read has to be at least one byte long */
+		if (segs[ctr].read && segs[ctr].len == 0)
+			return false;
+
+		if (segs[ctr].len > 0 && segs[ctr].buf == NULL)
+			return false;
+	}
+
+	return true;
+}
+
+static i2c_transaction_list *i2c_transaction_alloc(void)
+{
+	i2c_transaction_list *nelem;
+
+	nelem = i2c_transaction_free_head;
+	if (nelem == NULL)
+		return NULL;
+
+	i2c_transaction_free_head = nelem->next;
+
+	nelem->probe = false;
+
+	return nelem;
+}
+
+static void i2c_transaction_queue(i2c_transaction_list *nelem,
+				  const i2c_segment *segs, uint8_t segs_num,
+				  i2c_priorities prio,
+				  const timestamp *deadline,
+				  i2c_completion_fun completion,
+				  void *comp_data)
+{
+
+	nelem->segs = segs;
+	nelem->segs_num = segs_num;
+	nelem->seg_cur = 0;
+	i2c_transaction_seg_load(nelem);
+
+	nelem->fun = completion;
+	nelem->data = comp_data;
+
+	nelem->rdlen_actual = 0;
+
+	nelem->speed = i2c_segments_speed(segs, segs_num);
+	i2c_segments_timeout(segs, segs_num, nelem->speed, &nelem->timeout);
+
+	i2cqueue_insert(&i2c_queue, &nelem->queue, prio, deadline);
+
+	/*
+	 * TWI_vect only looks at the transaction in progress, but it changes
+	 * the state
+	 */
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_MemoryBarrier();
+
+		if (i2c_state == I2C_IDLE) {
+			i2c_transaction_start_next_atomic();
+			i2c_sched_update();
+		}
+
+		_MemoryBarrier();
+	}
+}
+
+bool i2c_transaction(uint8_t addr,
+		     const uint8_t *wrbuf, uint8_t wrlen,
+		     uint8_t *rdbuf, uint8_t rdlen,
+		     i2c_completion_fun completion, void *comp_data)
+{
+	if (wrlen == 0 && rdlen == 0)
+		return false;
+
+	if (wrlen > 0 && wrbuf == NULL)
+		return false;
+
+	if (rdlen > 0 && rdbuf == NULL)
+		return false;
+
+	i2c_transaction_list *nelem = i2c_transaction_alloc();
+	if (nelem == NULL)
+		return false;
+
+	uint8_t segs_num = 0;
+
+	if (wrlen > 0) {
+		i2c_segment *seg = &nelem->segs_simple[segs_num++];
 
-	i2c_completion_fun fun;
-	void *data;
+		seg->addr = addr;
+		seg->read = false;
+		/* not written to */
+		seg->buf = (uint8_t *)wrbuf;
+		seg->len = wrlen;
+	}
 
-	uint8_t rdlen_actual;
-} i2c_transaction_list;
+	if (rdlen > 0) {
+		i2c_segment *seg = &nelem->segs_simple[segs_num++];
 
-static /* i2c_states */ uint8_t i2c_state;
-static bool i2c_state_changed;
-static timestamp i2c_next_reset_idle_poll;
+		seg->addr = addr;
+		seg->read = true;
+		seg->buf = rdbuf;
+		seg->len = rdlen;
+	}
 
-static timestamp i2c_transaction_deadline;
-static i2c_transaction_list *i2c_transaction_list_head;
+	i2c_transaction_queue(nelem, nelem->segs_simple, segs_num,
+			      I2C_PRIO_NORMAL, NULL, completion, comp_data);
 
-#define I2C_SETSTATE(state_new)					\
-	do								\
-		if (i2c_state != state_new) {				\
-			dprintf_P(PSTR_M("%S: *%S\n"), PSTR_M("i2c"),	\
-				  PSTR_M(#state_new));			\
-			i2c_state_changed = true;			\
-			i2c_set_state_do(state_new);			\
-		}							\
-	while (0)
+	return true;
+}
 
-static void i2c_twcr_set_bits_atomic(uint8_t bits)
+bool i2c_transaction_segments_prio(const i2c_segment *segs, uint8_t segs_num,
+				   i2c_priorities prio,
+				   const timestamp *deadline,
+				   i2c_completion_fun completion,
+				   void *comp_data)
 {
-	uint8_t val = TWCR;
-	val &= ~_BV(TWINT);
-	val |= bits;
-	TWCR = val;
+	if (prio >= I2C_PRIOS_NUM)
+		return false;
+
+	if (!i2c_segments_are_valid(segs, segs_num))
+		return false;
+
+	i2c_transaction_list *nelem = i2c_transaction_alloc();
+	if (nelem == NULL)
+		return false;
+
+	i2c_transaction_queue(nelem, segs, segs_num, prio, deadline,
+			      completion, comp_data);
+
+	return true;
 }
 
-static void i2c_twcr_clear_bits_atomic(uint8_t bits)
+bool i2c_transaction_segments(const i2c_segment *segs, uint8_t segs_num,
+			      i2c_completion_fun completion, void *comp_data)
 {
-	uint8_t val = TWCR;
-	val &= ~_BV(TWINT);
-	val &= ~bits;
-	TWCR = val;
+	return i2c_transaction_segments_prio(segs, segs_num,
+					     I2C_PRIO_NORMAL, NULL,
+					     completion, comp_data);
 }
 
-static void i2c_twcr_set_cmd_bits_atomic(uint8_t bits)
+static bool i2c_scan_probe(void);
+
+static void i2c_scan_finish(void)
 {
-	uint8_t val = TWCR;
-	val &= ~(_BV(TWINT) | _BV(TWEA) | _BV(TWSTA) | _BV(TWSTO));
-	val |= bits;
-	TWCR = val;
+	i2c_scan_running = false;
+
+	i2c_scan_result_first = i2c_scan_first;
+	i2c_scan_result_last = i2c_scan_last;
+	i2c_scan_result_mask = i2c_scan_found_mask;
 }
 
-static void i2c_twcr_set_bits(uint8_t bits)
+static void i2c_scan_complete(void *data, bool success, uint8_t rdlen_actual)
 {
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		_MemoryBarrier();
-		i2c_twcr_set_bits_atomic(bits);
-		_MemoryBarrier();
+	uint8_t addr = i2c_scan_seg.addr;
+
+	if (success) {
+		dprintf_P(PSTR("i2c: scan found %x\n"), (unsigned)addr);
+
+		i2c_scan_found_mask |= (uint16_t)1 << (addr - i2c_scan_first);
 	}
-}
 
-static void i2c_twcr_clear_bits(uint8_t bits)
-{
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		_MemoryBarrier();
-		i2c_twcr_clear_bits_atomic(bits);
-		_MemoryBarrier();
+	if (addr == i2c_scan_last) {
+		i2c_scan_finish();
+		return;
 	}
-}
 
-static void i2c_twcr_set_cmd_bits(uint8_t bits)
-{
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		_MemoryBarrier();
-		i2c_twcr_set_cmd_bits_atomic(bits);
-		_MemoryBarrier();
+	i2c_scan_seg.addr++;
+	if (!i2c_scan_probe()) {
+		dprintf_P(PSTR("i2c: scan aborted at %x\n"),
+			  (unsigned)i2c_scan_seg.addr);
+
+		i2c_scan_finish();
 	}
 }
 
-static bool i2c_is_reset_idle_poll_state(void)
+/* an address-only write, in the lowest class */
+static bool i2c_scan_probe(void)
 {
-	return i2c_state == I2C_RESET || i2c_state == I2C_TRANS_OK_STOP_TX;
-}
+	i2c_transaction_list *nelem = i2c_transaction_alloc();
+	if (nelem == NULL)
+		return false;
 
-static bool i2c_is_transaction_wait_deadline_state(void)
-{
-	return i2c_state == I2C_START_TX ||
-		i2c_state == I2C_REPEATED_START_TX || i2c_state == I2C_ADDR ||
-		i2c_state == I2C_WRITE || i2c_state == I2C_READ ||
-		i2c_state == I2C_TRANS_OK_STOP_TX;
-}
+	nelem->probe = true;
 
-static void i2c_set_state_do(i2c_states state_new)
-{
-	bool was_reset_idle_poll_state = i2c_is_reset_idle_poll_state();
+	i2c_transaction_queue(nelem, &i2c_scan_seg, 1, I2C_PRIO_LOW, NULL,
+			      i2c_scan_complete, NULL);
 
-	i2c_state = state_new;
+	return true;
+}
 
-	if (i2c_state == I2C_TRANS_OK_STOP_DO ||
-	    i2c_state == I2C_TRANS_FAILED_RESET) {
-		i2c_transaction_list *tr = i2c_transaction_list_head;
-		i2c_transaction_list *tr_next = tr->next;
+bool i2c_scan_start(uint8_t first, uint8_t last)
+{
+	if (i2c_scan_running)
+		return false;
 
-		if (tr->fun != NULL)
-			tr->fun(tr->data, i2c_state == I2C_TRANS_OK_STOP_DO,
-				tr->rdlen_actual);
+	if (first > last || last - first >= I2C_SCAN_ADDRS_MAX ||
+	    last > 0x7f)
+		return false;
 
-		free(tr);
-		i2c_transaction_list_head = tr_next;
-	} else if (i2c_state == I2C_START_DO) {
-		const timestamp_interval transaction_timeout =
-			TIMESTAMPI_FROM_MS(I2C_TRANS_TIMEOUT);
+	i2c_scan_first = first;
+	i2c_scan_last = last;
+	i2c_scan_found_mask = 0;
 
-		timestamp now;
-		timekeeping_now_timestamp(&now);
-		timestamp_add(&now, &transaction_timeout,
-			      &i2c_transaction_deadline);
-	}
+	i2c_scan_seg.addr = first;
+	i2c_scan_seg.read = false;
+	i2c_scan_seg.len = 0;
+	i2c_scan_seg.buf = NULL;
 
-	if (!was_reset_idle_poll_state && i2c_is_reset_idle_poll_state())
-		timekeeping_now_timestamp(&i2c_next_reset_idle_poll);
-}
+	if (!i2c_scan_probe())
+		return false;
 
-static void i2c_reset(void)
-{
-	i2c_twcr_clear_bits(_BV(TWEA) | _BV(TWSTA) | _BV(TWSTO) | _BV(TWEN) |
-			    _BV(TWIE));
-	i2c_twcr_set_bits(_BV(TWINT) | _BV(TWEN));
+	i2c_scan_running = true;
 
-	I2C_SETSTATE(I2C_RESET);
+	return true;
 }
 
-ISR(TWI_vect)
+bool i2c_scan_is_running(void)
 {
-	i2c_twcr_clear_bits_atomic(_BV(TWIE));
+	return i2c_scan_running;
 }
 
-bool i2c_transaction(uint8_t addr,
-		     const uint8_t *wrbuf, uint8_t wrlen,
-		     uint8_t *rdbuf, uint8_t rdlen,
-		     i2c_completion_fun completion, void *comp_data)
+bool i2c_scan_found(uint8_t addr)
 {
-	if (wrlen == 0 && rdlen == 0)
+	if (addr < i2c_scan_result_first || addr > i2c_scan_result_last)
 		return false;
 
-	if (wrlen > 0 && wrbuf == NULL)
-		return false;
+	return i2c_scan_result_mask &
+		((uint16_t)1 << (addr - i2c_scan_result_first));
+}
 
-	if (rdlen > 0 && rdbuf == NULL)
-		return false;
+void i2c_get_queue_stats(i2c_priorities prio, i2c_queue_stats *stats)
+{
+	i2cqueue_get_stats(&i2c_queue, prio, stats);
+}
 
-	i2c_transaction_list *nelem;
+/* returns the SCL and SDA pin bits that are high */
+static uint8_t i2c_bus_lines(void)
+{
+	return I2C_PIN & (_BV(I2C_SCL_BIT) | _BV(I2C_SDA_BIT));
+}
 
-	nelem = malloc(sizeof(i2c_transaction_list));
-	if (nelem == NULL)
-		return false;
+static void i2c_bus_line_drive_low(uint8_t bit, bool low)
+{
+	if (low)
+		I2C_DDR |= _BV(bit);
+	else
+		I2C_DDR &= ~_BV(bit);
 
-	nelem->next = NULL;
+	_delay_us(I2C_BUS_CLEAR_HALF_PERIOD);
+}
 
-	nelem->addr = addr;
-	nelem->wrbuf = wrbuf;
-	nelem->wrlen = wrlen;
-	nelem->rdbuf = rdbuf;
-	nelem->rdlen = rdlen;
-	nelem->fun = completion;
-	nelem->data = comp_data;
+/*
+ * a device that lost some clocks in the middle of a byte it was sending
+ * (for example because of noise) holds SDA low until it gets the rest of
+ * them, clock it out (bit-banged, the TWI can't do it) then do a STOP
+ *
+ * this takes about 220 µs, so it runs with interrupts enabled, from
+ * i2c_poll() - the TWI has to be disabled already (so TWI_vect can't run),
+ * returns whether the bus lines are free now
+ */
+static bool i2c_bus_clear(void)
+{
+	i2c_recovery_stats_data.bus_clears++;
 
-	nelem->rdlen_actual = 0;
+	/* open drain: the pins are only switched between input and low */
+	I2C_PORT &= ~(_BV(I2C_SCL_BIT) | _BV(I2C_SDA_BIT));
 
-	if (i2c_transaction_list_head == NULL)
-		i2c_transaction_list_head = nelem;
-	else {
-		i2c_transaction_list *elem = i2c_transaction_list_head;
-		while (elem->next != NULL)
-			elem = elem->next;
+	for (uint8_t ctr = 0; ctr < I2C_BUS_CLEAR_CLOCKS; ctr++) {
+		if (i2c_bus_lines() & _BV(I2C_SDA_BIT))
+			break;
 
-		elem->next = nelem;
+		i2c_bus_line_drive_low(I2C_SCL_BIT, true);
+		i2c_bus_line_drive_low(I2C_SCL_BIT, false);
 	}
 
-	if (i2c_state == I2C_IDLE)
-		I2C_SETSTATE(I2C_START_DO);
+	/* STOP: SDA rising while SCL is high */
+	i2c_bus_line_drive_low(I2C_SCL_BIT, true);
+	i2c_bus_line_drive_low(I2C_SDA_BIT, true);
+	i2c_bus_line_drive_low(I2C_SCL_BIT, false);
+	i2c_bus_line_drive_low(I2C_SDA_BIT, false);
 
-	return true;
+	bool ok = i2c_bus_lines() == (_BV(I2C_SCL_BIT) | _BV(I2C_SDA_BIT));
+	if (!ok)
+		i2c_recovery_stats_data.bus_clear_failures++;
+
+	return ok;
 }
 
 /*
@@ -243,193 +1388,139 @@ bool i2c_transaction(uint8_t addr,
  * it seems the only way to unstuck it is to disable and then reenable
  * (TWEN bit) the whole module - this action resets it back into a normal
  * operation
+ *
+ * a device can also get stuck holding SDA low, which needs a bus clear
+ * first
+ *
+ * both are detected when there was no progress for I2C_STUCK_CHECK_PERIOD,
+ * instead of waiting for the whole transaction timeout
  */
-static bool i2c_transaction_maybe_timedout(void)
+static bool i2c_transaction_maybe_stuck(void)
 {
 	timestamp now;
 	timekeeping_now_timestamp(&now);
 
-	if (timestamp_temporal_cmp(&now, &i2c_transaction_deadline, <))
+	if (timestamp_temporal_cmp(&now, &i2c_stuck_check, <))
+		return false;
+
+	bool timedout = !timestamp_temporal_cmp(&now,
+						&i2c_transaction_deadline, <);
+	uint8_t lines = i2c_bus_lines();
+
+	if (!timedout &&
+	    (i2c_progress != i2c_progress_checked ||
+	     !(lines & _BV(I2C_SCL_BIT)))) {
+		/* still moving or a device is stretching the clock */
+		i2c_stuck_check_arm();
 		return false;
+	}
+
+	if (timedout) {
+		i2c_recovery_stats_data.timeouts++;
+
+		dprintf_P(PSTR_M("i2c: transaction timed out "
+				 "(STATUS %x, CR %x, lines %x)\n"),
+			  (unsigned)TW_STATUS, (unsigned)TWCR,
+			  (unsigned)lines);
+	} else {
+		i2c_recovery_stats_data.stalls++;
+
+		dprintf_P(PSTR_M("i2c: transaction stuck "
+				 "(STATUS %x, CR %x, lines %x)\n"),
+			  (unsigned)TW_STATUS, (unsigned)TWCR,
+			  (unsigned)lines);
+	}
 
-	dprintf_P(PSTR_M("i2c: transaction timed out (STATUS %x, CR %x)\n"),
-		  (unsigned)TW_STATUS, (unsigned)TWCR);
+	bool sda_held = (lines & _BV(I2C_SCL_BIT)) &&
+		!(lines & _BV(I2C_SDA_BIT));
 
 	if (i2c_state != I2C_TRANS_OK_STOP_TX)
-		I2C_SETSTATE(I2C_TRANS_FAILED_RESET);
+		i2c_trans_fail_atomic(I2C_ERROR_TIMEOUT);
 	else
+		i2c_device_account_reset(i2c_last_addr);
+
+	if (sda_held) {
+		/* i2c_poll() clears the bus, then resets the TWI */
+		i2c_twcr_clear_bits_atomic(_BV(TWEA) | _BV(TWSTA) |
+					   _BV(TWSTO) | _BV(TWEN) |
+					   _BV(TWIE));
+
+		I2C_SETSTATE(I2C_BUS_CLEAR);
+	} else if (i2c_state == I2C_TRANS_OK_STOP_TX)
 		i2c_reset();
 
 	return true;
 }
 
-void i2c_poll_atomic(void)
+static void i2c_poll_atomic_do(void)
 {
 	const timestamp_interval reset_idle_poll_period =
 		TIMESTAMPI_FROM_MS(I2C_RESET_POLL_PERIOD);
 
-	i2c_state_changed = false;
+	if (i2c_trans_finished)
+		i2c_transaction_finish_atomic();
 
 	if (i2c_is_reset_idle_poll_state()) {
 		if (bit_is_set(TWCR, TWSTO)) {
 			timestamp now;
-			timekeeping_now_timestamp(&now);
+			timekeeping_now_timestamp_atomic(&now);
 			timestamp_add(&now, &reset_idle_poll_period,
 				      &i2c_next_reset_idle_poll);
 
 			if (i2c_state == I2C_TRANS_OK_STOP_TX)
-				i2c_transaction_maybe_timedout();
+				i2c_transaction_maybe_stuck();
 
 			return;
 		}
 
-		if (i2c_transaction_list_head != NULL)
-			I2C_SETSTATE(I2C_START_DO);
-		else
+		if (!i2c_transaction_start_next_atomic())
 			I2C_SETSTATE(I2C_IDLE);
-	} else if (i2c_state == I2C_START_DO ||
-		   i2c_state == I2C_REPEATED_START_DO) {
-		i2c_twcr_set_cmd_bits(_BV(TWINT) | _BV(TWSTA) | _BV(TWIE));
-
-		if (i2c_state == I2C_START_DO)
-			I2C_SETSTATE(I2C_START_TX);
-		else /* I2C_REPEATED_START_DO */
-			I2C_SETSTATE(I2C_REPEATED_START_TX);
-	} else if (i2c_state == I2C_START_TX ||
-		   i2c_state == I2C_REPEATED_START_TX) {
-		if (bit_is_clear(TWCR, TWINT)) {
-			i2c_transaction_maybe_timedout();
-
-			return;
-		}
-
-		uint8_t status = TW_STATUS;
-		if (status != TW_START && status != TW_REP_START) {
-			dprintf_P(PSTR_M("i2c: STATUS %x\n"),
-				  (unsigned)status);
-			I2C_SETSTATE(I2C_TRANS_FAILED_RESET);
-			return;
-		}
-
-		uint8_t data = i2c_transaction_list_head->addr << 1;
-		if (i2c_transaction_list_head->wrlen == 0)
-			data |= TW_READ;
-		else
-			data |= TW_WRITE;
-
-		TWDR = data;
-
-		i2c_twcr_set_cmd_bits(_BV(TWINT) | _BV(TWIE));
-
-		I2C_SETSTATE(I2C_ADDR);
-	} else if (i2c_state == I2C_ADDR) {
-		if (bit_is_clear(TWCR, TWINT)) {
-			i2c_transaction_maybe_timedout();
-
-			return;
-		}
-
-		uint8_t status = TW_STATUS;
-		if ((status != TW_MT_SLA_ACK ||
-		     i2c_transaction_list_head->wrlen == 0) &&
-		    status != TW_MR_SLA_ACK) {
-			dprintf_P(PSTR_M("i2c: STATUS %x\n"),
-				  (unsigned)status);
-			I2C_SETSTATE(I2C_TRANS_FAILED_RESET);
-			return;
-		}
-
-		if (status == TW_MT_SLA_ACK)
-			I2C_SETSTATE(I2C_WRITE_FIRST);
-		else
-			I2C_SETSTATE(I2C_READ_FIRST);
-	} else if (i2c_state == I2C_WRITE_FIRST ||
-		   i2c_state == I2C_WRITE) {
-		if (i2c_state == I2C_WRITE) {
-			if (bit_is_clear(TWCR, TWINT)) {
-				i2c_transaction_maybe_timedout();
-
-				return;
-			}
-
-			uint8_t status = TW_STATUS;
-			if (status != TW_MT_DATA_ACK &&
-			    (status != TW_MT_DATA_NACK ||
-			     i2c_transaction_list_head->wrlen != 0)) {
-				dprintf_P(PSTR_M("i2c: STATUS %x\n"),
-					  (unsigned)status);
-				I2C_SETSTATE(I2C_TRANS_FAILED_RESET);
-				return;
-			}
-		}
-
-		if (i2c_transaction_list_head->wrlen == 0) {
-			if (i2c_transaction_list_head->rdlen > 0)
-				I2C_SETSTATE(I2C_REPEATED_START_DO);
-			else
-				I2C_SETSTATE(I2C_TRANS_OK_STOP_DO);
-		} else {
-			TWDR = *i2c_transaction_list_head->wrbuf;
-			i2c_transaction_list_head->wrbuf++;
-			i2c_transaction_list_head->wrlen--;
-
-			i2c_twcr_set_cmd_bits(_BV(TWINT) | _BV(TWIE));
-
-			I2C_SETSTATE(I2C_WRITE);
-		}
-	} else if (i2c_state == I2C_READ_FIRST ||
-		   i2c_state == I2C_READ) {
-		if (i2c_state == I2C_READ) {
-			if (bit_is_clear(TWCR, TWINT)) {
-				i2c_transaction_maybe_timedout();
-
-				return;
-			}
-
-			uint8_t status = TW_STATUS;
-			if (status != TW_MR_DATA_ACK &&
-			    status != TW_MR_DATA_NACK) {
-				dprintf_P(PSTR_M("i2c: STATUS %x\n"),
-					  (unsigned)status);
-				I2C_SETSTATE(I2C_TRANS_FAILED_RESET);
-				return;
-			}
-
-			*i2c_transaction_list_head->rdbuf = TWDR;
-			i2c_transaction_list_head->rdbuf++;
-			i2c_transaction_list_head->rdlen--;
-			i2c_transaction_list_head->rdlen_actual++;
-		}
-
-		if (i2c_transaction_list_head->rdlen > 0) {
-			uint8_t ackbit =
-				i2c_transaction_list_head->rdlen > 1 ?
-				_BV(TWEA) : 0;
-
-			i2c_twcr_set_cmd_bits(_BV(TWINT) | ackbit | _BV(TWIE));
+	} else if (i2c_state == I2C_TRANS_FAILED_RESET)
+		i2c_reset();
+	else if (i2c_is_transaction_wait_deadline_state())
+		/* TWI_vect does the rest */
+		i2c_transaction_maybe_stuck();
+}
 
-			I2C_SETSTATE(I2C_READ);
-		} else
-			I2C_SETSTATE(I2C_TRANS_OK_STOP_DO);
-	} else if (i2c_state == I2C_TRANS_OK_STOP_DO) {
-		i2c_twcr_set_cmd_bits(_BV(TWINT) | _BV(TWSTO));
+void i2c_poll_atomic(void)
+{
+	i2c_poll_atomic_do();
+	i2c_sched_update();
+}
 
-		I2C_SETSTATE(I2C_TRANS_OK_STOP_TX);
-	} else if (i2c_state == I2C_TRANS_FAILED_RESET)
+void i2c_poll(void)
+{
+	i2c_trace_print();
+
+	/*
+	 * transactions queued by these completions finish only later and
+	 * i2c_poll_atomic(), called next, updates the scheduler timer
+	 */
+	while (i2c_done_head != NULL)
+		i2c_transaction_complete();
+
+	/*
+	 * only the main loop enters and leaves this state and the TWI is
+	 * disabled in it, so nothing else touches the bus lines or the state
+	 */
+	if (i2c_state == I2C_BUS_CLEAR) {
+		i2c_bus_clear();
 		i2c_reset();
+	}
 }
 
-void i2c_get_next_poll_time(timestamp *next_poll)
+void i2c_get_recovery_stats(i2c_recovery_stats *stats)
 {
-	if (i2c_state_changed)
-		timekeeping_now_timestamp(next_poll);
-	else if (i2c_is_reset_idle_poll_state())
-		*next_poll = i2c_next_reset_idle_poll;
-	/* assume that reset poll period is much shorter than tx deadline */
-	else if (i2c_is_transaction_wait_deadline_state())
-		*next_poll = i2c_transaction_deadline;
-	else
-		timekeeping_timestamp_max_future(next_poll);
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_MemoryBarrier();
+		*stats = i2c_recovery_stats_data;
+		_MemoryBarrier();
+	}
+}
+
+bool i2c_is_idle_atomic(void)
+{
+	return i2c_state == I2C_IDLE;
 }
 
 static uint32_t i2c_speed_settings_2_clock(uint8_t twbr, uint8_t prescaler)
@@ -502,25 +1593,71 @@ void i2c_setup(void)
 				   _BV(TWEN) | _BV(TWIE));
 
 	do {
-		uint8_t twbr;
-		uint8_t prescaler;
-		i2c_get_speed_settings(I2C_BUS_CLOCK, &twbr, &prescaler);
-
-		TWBR = twbr;
-
-		/* prescaler = 1 */
-		TWSR &= ~(_BV(TWPS0) | _BV(TWPS1));
-		if (prescaler == 4)
-			TWSR |= _BV(TWPS0);
-		else if (prescaler == 16)
-			TWSR |= _BV(TWPS1);
-		else if (prescaler == 64)
-			TWSR |= _BV(TWPS0) | _BV(TWPS1);
+		const uint32_t counts_per_s =
+			timekeeping_counts_per_tick() * TIMEKEEPING_HZ;
+
+		const uint32_t clocks[I2C_SPEEDS_NUM] = {
+			[I2C_SPEED_SLOW] = I2C_BUS_CLOCK_SLOW,
+			[I2C_SPEED_STANDARD] = I2C_BUS_CLOCK,
+			[I2C_SPEED_FAST] = I2C_BUS_CLOCK_FAST
+		};
+
+		for (uint8_t ctr = 0; ctr < I2C_SPEEDS_NUM; ctr++) {
+			uint8_t twbr;
+			uint8_t prescaler;
+			i2c_get_speed_settings(clocks[ctr], &twbr, &prescaler);
+
+			i2c_speed_twbr[ctr] = twbr;
+
+			i2c_speed_bit_counts[ctr] =
+				(counts_per_s * 256 + clocks[ctr] - 1) /
+				clocks[ctr];
+
+			/* prescaler = 1 */
+			i2c_speed_twps[ctr] = 0;
+			if (prescaler == 4)
+				i2c_speed_twps[ctr] = _BV(TWPS0);
+			else if (prescaler == 16)
+				i2c_speed_twps[ctr] = _BV(TWPS1);
+			else if (prescaler == 64)
+				i2c_speed_twps[ctr] = _BV(TWPS0) | _BV(TWPS1);
+		}
+
+		i2c_timeout_allowance_counts =
+			(uint32_t)I2C_CLOCK_STRETCH_ALLOWANCE * counts_per_s /
+			1000;
 	} while (0);
 
+	/* force the first apply */
+	i2c_speed_cur = I2C_SPEEDS_NUM;
+	i2c_speed_apply_atomic(I2C_SPEED_STANDARD);
+
+	i2c_devices_num = 0;
+
+	i2c_scan_running = false;
+	/* an empty range */
+	i2c_scan_result_first = 1;
+	i2c_scan_result_last = 0;
+	i2c_scan_result_mask = 0;
+
 	wdt_reset();
 	i2c_twcr_set_bits_atomic(_BV(TWEN));
 
 	i2c_state = I2C_IDLE;
-	i2c_state_changed = false;
+	i2c_trans_finished = false;
+
+	i2c_progress = i2c_progress_checked = 0;
+	memset(&i2c_recovery_stats_data, 0, sizeof(i2c_recovery_stats_data));
+
+	i2c_transaction_cur = NULL;
+	i2c_done_head = i2c_done_tail = NULL;
+
+	i2cqueue_init(&i2c_queue);
+	i2c_transaction_free_head = NULL;
+	for (uint8_t ctr = 0; ctr < I2C_TRANSACTIONS_MAX; ctr++) {
+		i2c_transaction_pool[ctr].next = i2c_transaction_free_head;
+		i2c_transaction_free_head = &i2c_transaction_pool[ctr];
+	}
+
+	sched_timer_register(&i2c_sched_timer, PENDING_I2C);
 }
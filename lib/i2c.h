@@ -17,6 +17,91 @@
 
 #include "timekeeping.h"
 
+/*
+ * bus speeds: I2C_SPEED_STANDARD is 100 kHz (by default), I2C_SPEED_FAST is
+ * the 400 kHz Fast-mode, I2C_SPEED_SLOW is a 50 kHz fallback for troublesome
+ * devices
+ */
+typedef enum { I2C_SPEED_SLOW, I2C_SPEED_STANDARD, I2C_SPEED_FAST,
+	       I2C_SPEEDS_NUM } i2c_speeds;
+
+/*
+ * transaction classes, a queued transaction of a higher class is started
+ * before the ones of lower classes (but a transaction in progress is never
+ * interrupted)
+ *
+ * I2C_PRIO_HIGH is meant for reads that control decisions depend on,
+ * I2C_PRIO_LOW for diagnostic traffic
+ */
+typedef enum { I2C_PRIO_HIGH, I2C_PRIO_NORMAL, I2C_PRIO_LOW,
+	       I2C_PRIOS_NUM } i2c_priorities;
+
+/*
+ * how many times in a row queued transactions of a class can be passed over
+ * by transactions of higher classes before one of them goes first
+ * (on both the TWI and the software bus)
+ */
+#ifndef I2C_STARVATION_LIMIT
+#define I2C_STARVATION_LIMIT 4
+#endif
+
+/* per-class queue statistics */
+typedef struct {
+	/* transactions queued now and at most (not counting one in progress) */
+	uint8_t depth;
+	uint8_t depth_max;
+
+	/*
+	 * how many times a transaction of this class was started before
+	 * the ones of higher classes because they were passed over too many
+	 * times in a row or because its deadline has passed
+	 */
+	uint16_t starved_picks;
+	uint16_t overdue_picks;
+} i2c_queue_stats;
+
+/* bus error recovery statistics */
+typedef struct {
+	/*
+	 * transactions that made no progress for a while / for the whole
+	 * transaction timeout (a device held the clock low)
+	 */
+	uint16_t stalls;
+	uint16_t timeouts;
+
+	/* bit-banged bus clears (SDA was held low) and failed ones */
+	uint16_t bus_clears;
+	uint16_t bus_clear_failures;
+
+	/* TWI module resets (after any failed transaction) */
+	uint16_t twi_resets;
+} i2c_recovery_stats;
+
+/*
+ * per device address statistics, the counters saturate
+ *
+ * a transaction with several devices counts as successful for each of them,
+ * a failed one only for the device it failed at
+ */
+typedef struct {
+	uint8_t addr;
+
+	uint16_t ok;
+	uint16_t addr_nacks;
+	uint16_t data_nacks;
+	uint16_t bus_errors;
+	uint16_t arb_losses;
+	/* transactions that got stuck or timed out */
+	uint16_t timeouts;
+	/* bus resets after its transactions (including a stuck STOP) */
+	uint16_t resets;
+
+	/* the START to STOP time of successful transactions in µs */
+	uint16_t latency_min;
+	uint16_t latency_avg;
+	uint16_t latency_max;
+} i2c_device_stats;
+
 /*
  * if success is true then rdlen_actual contains the length of data
  * that was actually read
@@ -35,9 +120,13 @@ typedef void (*i2c_completion_fun)(void *data, bool success,
  * there should be either a write or a read or both.
  *
  * completion is an optional completion notification callback (called with
- * comp_data provided as the first parameter).
+ * comp_data provided as the first parameter) - it is called from i2c_poll(),
+ * with interrupts enabled and never from an interrupt handler, although the
+ * transfer itself is driven by the TWI interrupt. the transaction is already
+ * freed then, so the callback can queue another one.
  *
- * if this function returns false the transaction wasn't queued and so the
+ * if this function returns false the transaction wasn't queued (for example,
+ * because I2C_TRANSACTIONS_MAX transactions are already queued) and so the
  * completion notification is not going to be called.
  */
 bool i2c_transaction(uint8_t addr,
@@ -46,28 +135,151 @@ bool i2c_transaction(uint8_t addr,
 		     i2c_completion_fun completion, void *comp_data);
 
 /*
- * should be called with interrupts disabled from time to time
- * (at least when the time returned by i2c_get_next_poll_time() comes)
+ * a part of a transaction: a write to or a read from the device at addr,
+ * each segment after the first one begins with a repeated START
+ *
+ * buf is written from (it is not modified then) or read into, a read
+ * segment has to be at least one byte long, a zero length write segment
+ * only addresses the device
  */
-void i2c_poll_atomic(void);
+typedef struct {
+	uint8_t addr;
+	bool read;
+	uint8_t len;
+	uint8_t *buf;
+} i2c_segment;
+
+/*
+ * add an i2c transaction made of segs_num segments (the whole transaction
+ * is done without releasing the bus) to the transaction queue
+ *
+ * segs and the segment buffers are caller-allocated and must stay valid
+ * until the completion notification is called, rdlen_actual given to it
+ * is the total length of data read by all read segments
+ *
+ * otherwise like i2c_transaction()
+ */
+bool i2c_transaction_segments(const i2c_segment *segs, uint8_t segs_num,
+			      i2c_completion_fun completion, void *comp_data);
+
+/*
+ * like i2c_transaction_segments(), but in the prio class and with an optional
+ * deadline (can be NULL)
+ *
+ * transactions of a class are started in the order of their deadlines
+ * (ones without a deadline last, in the queuing order), a transaction whose
+ * deadline has passed is started next, regardless of its class - it isn't
+ * dropped, though
+ *
+ * i2c_transaction() and i2c_transaction_segments() use I2C_PRIO_NORMAL
+ * without a deadline
+ */
+bool i2c_transaction_segments_prio(const i2c_segment *segs, uint8_t segs_num,
+				   i2c_priorities prio,
+				   const timestamp *deadline,
+				   i2c_completion_fun completion,
+				   void *comp_data);
+
+/*
+ * a function queuing a transaction like i2c_transaction_segments_prio(),
+ * on this or another bus (see i2csoft.h)
+ */
+typedef bool (*i2c_transaction_fun)(const i2c_segment *segs, uint8_t segs_num,
+				    i2c_priorities prio,
+				    const timestamp *deadline,
+				    i2c_completion_fun completion,
+				    void *comp_data);
+
+/* copies the queue statistics of the prio class, not for interrupt handlers */
+void i2c_get_queue_stats(i2c_priorities prio, i2c_queue_stats *stats);
 
 /*
- * returns the maximum allowed µCU sleep period (the sleep needs to have
- * interrupts enabled) with respect to the i2c subsystem
+ * set the bus speed of transactions with the device at addr (devices without
+ * a speed set use I2C_SPEED_STANDARD)
  *
- * before calling this function disable interrupts and call i2c_poll_atomic(),
- * then this function, do not enable interrupts between them
+ * after a few failed transactions in a row (address NACKs don't count) the
+ * device speed is lowered by one step (down to I2C_SPEED_SLOW), after many
+ * successful ones in a row a lowered speed is raised by one step (up to the
+ * speed set here), the new speed is used for transactions queued after that
  *
- * enabling interrupts at any time later (before the actual sleep) invalidates
- * the returned value
+ * returns false if there is no room for another device
+ * (see I2C_DEVICES_MAX)
+ */
+bool i2c_set_device_speed(uint8_t addr, i2c_speeds speed);
+
+/* returns the current bus speed of transactions with the device at addr */
+i2c_speeds i2c_get_device_speed(uint8_t addr);
+
+/*
+ * copies the statistics of the device number idx (devices are numbered in
+ * the order of their first transaction or speed setting, there are at most
+ * I2C_DEVICES_MAX of them), returns false if there is no such device
+ *
+ * not for interrupt handlers
+ */
+bool i2c_get_device_stats(uint8_t idx, i2c_device_stats *stats);
+
+/*
+ * should be called with interrupts enabled from time to time
+ * (at least when the i2c scheduler timer deadline comes or the i2c pending
+ * work flag gets set), right before i2c_poll_atomic()
+ *
+ * calls the completion notifications of finished transactions, so their work
+ * doesn't keep interrupts disabled
+ */
+void i2c_poll(void);
+
+/*
+ * should be called with interrupts disabled, right after i2c_poll()
  *
- * this function doesn't change any internal state (it is purely read-only)
+ * only does the bus work that can't race with the TWI interrupt: starts queued
+ * transactions, handles timeouts and bus resets and moves finished
+ * transactions to the list of ones whose completions i2c_poll() calls next
+ * (the i2c scheduler timer is set to right away then)
+ *
+ * the i2c scheduler timer deadline is only valid until interrupts are
+ * enabled again after calling this function (the µC sleep needs to have
+ * interrupts enabled, though)
+ */
+void i2c_poll_atomic(void);
+
+/* how many addresses a bus scan can probe */
+#define I2C_SCAN_ADDRS_MAX 16
+
+/*
+ * start a bus scan of the addresses first to last (inclusive, at most
+ * I2C_SCAN_ADDRS_MAX of them): each one is probed in turn, in the background,
+ * with an address-only write transaction in the I2C_PRIO_LOW class
+ *
+ * probes aren't counted in the device statistics
+ *
+ * returns false if a scan is already running, the range is invalid or the
+ * first probe couldn't be queued
+ */
+bool i2c_scan_start(uint8_t first, uint8_t last);
+
+/* returns whether a bus scan is running */
+bool i2c_scan_is_running(void);
+
+/*
+ * returns whether the device at addr answered the last finished bus scan
+ * (a scan that couldn't queue its next probe finishes early, addresses
+ * it didn't get to are reported as not answering)
+ */
+bool i2c_scan_found(uint8_t addr);
+
+/* copies the bus error recovery statistics */
+void i2c_get_recovery_stats(i2c_recovery_stats *stats);
+
+/*
+ * returns whether there is no i2c transaction in progress or queued
+ * (and the bus is not being reset)
  */
-void i2c_get_next_poll_time(timestamp *next_poll);
+bool i2c_is_idle_atomic(void);
 
 /*
  * setup the i2c subsystem: must be called before any other i2c function,
- * must be called with interrupts disabled
+ * must be called with interrupts disabled, uses sched functions
  */
 void i2c_setup(void);
 
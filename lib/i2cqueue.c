@@ -0,0 +1,136 @@
+/*
+ * AVR Library: I2C transaction queue (shared by the TWI and software buses)
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "i2cqueue.h"
+
+/* whether a should be started before b (of the same class) */
+static bool i2cqueue_entry_is_before(const i2cqueue_entry *a,
+				     const i2cqueue_entry *b)
+{
+	if (!a->has_deadline)
+		return false;
+
+	if (!b->has_deadline)
+		return true;
+
+	return timestamp_temporal_cmp(&a->deadline, &b->deadline, <);
+}
+
+void i2cqueue_insert(i2cqueue *queue, i2cqueue_entry *entry,
+		     i2c_priorities prio, const timestamp *deadline)
+{
+	i2c_queue_stats *stats = &queue->stats[prio];
+	i2cqueue_entry **pos = &queue->heads[prio];
+
+	entry->prio = prio;
+	entry->has_deadline = deadline != NULL;
+	if (entry->has_deadline)
+		entry->deadline = *deadline;
+
+	/* the queues are short */
+	while (*pos != NULL && !i2cqueue_entry_is_before(entry, *pos))
+		pos = &(*pos)->next;
+
+	entry->next = *pos;
+	*pos = entry;
+
+	stats->depth++;
+	if (stats->depth > stats->depth_max)
+		stats->depth_max = stats->depth;
+}
+
+/*
+ * picks the class to start an entry from: an overdue entry goes first,
+ * then a starved class, then the highest class with something queued
+ */
+static uint8_t i2cqueue_pick_prio(i2cqueue *queue, const timestamp *now)
+{
+	uint8_t pick = I2C_PRIOS_NUM;
+
+	for (uint8_t prio = 0; prio < I2C_PRIOS_NUM; prio++) {
+		i2cqueue_entry *head = queue->heads[prio];
+
+		if (head == NULL || !head->has_deadline ||
+		    timestamp_temporal_cmp(now, &head->deadline, <))
+			continue;
+
+		if (pick == I2C_PRIOS_NUM ||
+		    i2cqueue_entry_is_before(head, queue->heads[pick]))
+			pick = prio;
+	}
+
+	if (pick != I2C_PRIOS_NUM) {
+		queue->stats[pick].overdue_picks++;
+		return pick;
+	}
+
+	for (uint8_t prio = 0; prio < I2C_PRIOS_NUM; prio++) {
+		if (queue->heads[prio] == NULL)
+			continue;
+
+		if (pick == I2C_PRIOS_NUM)
+			pick = prio;
+		else if (queue->passed_over[prio] >= I2C_STARVATION_LIMIT) {
+			queue->stats[prio].starved_picks++;
+			return prio;
+		}
+	}
+
+	return pick;
+}
+
+i2cqueue_entry *i2cqueue_pop(i2cqueue *queue, const timestamp *now)
+{
+	uint8_t pick = i2cqueue_pick_prio(queue, now);
+	if (pick == I2C_PRIOS_NUM)
+		return NULL;
+
+	for (uint8_t prio = pick + 1; prio < I2C_PRIOS_NUM; prio++)
+		if (queue->heads[prio] != NULL)
+			queue->passed_over[prio]++;
+
+	queue->passed_over[pick] = 0;
+
+	i2cqueue_entry *entry = queue->heads[pick];
+	queue->heads[pick] = entry->next;
+	entry->next = NULL;
+
+	queue->stats[pick].depth--;
+
+	return entry;
+}
+
+bool i2cqueue_is_empty(const i2cqueue *queue)
+{
+	for (uint8_t prio = 0; prio < I2C_PRIOS_NUM; prio++)
+		if (queue->heads[prio] != NULL)
+			return false;
+
+	return true;
+}
+
+void i2cqueue_get_stats(const i2cqueue *queue, i2c_priorities prio,
+			i2c_queue_stats *stats)
+{
+	*stats = queue->stats[prio];
+}
+
+void i2cqueue_init(i2cqueue *queue)
+{
+	for (uint8_t prio = 0; prio < I2C_PRIOS_NUM; prio++) {
+		queue->heads[prio] = NULL;
+		queue->passed_over[prio] = 0;
+		memset(&queue->stats[prio], 0, sizeof(queue->stats[prio]));
+	}
+}
@@ -0,0 +1,76 @@
+/*
+ * AVR Library: I2C transaction queue (shared by the TWI and software buses)
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _LIB_I2CQUEUE_H_
+#define _LIB_I2CQUEUE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "i2c.h"
+#include "timekeeping.h"
+
+/*
+ * the queuing part of a transaction, caller-allocated (as the first member
+ * of the bus transaction structure, so a popped entry can be cast back to it)
+ *
+ * don't access its members directly while it is queued
+ */
+typedef struct _i2cqueue_entry {
+	struct _i2cqueue_entry *next;
+
+	/* i2c_priorities */ uint8_t prio;
+	bool has_deadline;
+	timestamp deadline;
+} i2cqueue_entry;
+
+/*
+ * the queues of transactions waiting to be started, one per class,
+ * each one ordered by the deadline (entries without one last),
+ * then by the queuing order
+ *
+ * caller-allocated, don't access its members directly
+ */
+typedef struct {
+	i2cqueue_entry *heads[I2C_PRIOS_NUM];
+
+	/* how many times in a row each class was passed over */
+	uint8_t passed_over[I2C_PRIOS_NUM];
+
+	i2c_queue_stats stats[I2C_PRIOS_NUM];
+} i2cqueue;
+
+/* setup an empty queue (with zeroed statistics) */
+void i2cqueue_init(i2cqueue *queue);
+
+/*
+ * queue an entry in the prio class with an optional deadline (can be NULL),
+ * prio must be valid
+ */
+void i2cqueue_insert(i2cqueue *queue, i2cqueue_entry *entry,
+		     i2c_priorities prio, const timestamp *deadline);
+
+/*
+ * remove and return the entry to start next at now, NULL if nothing is queued
+ *
+ * an overdue entry goes first, then the head of a class passed over
+ * I2C_STARVATION_LIMIT times in a row, then the highest class head
+ */
+i2cqueue_entry *i2cqueue_pop(i2cqueue *queue, const timestamp *now);
+
+/* returns whether nothing is queued */
+bool i2cqueue_is_empty(const i2cqueue *queue);
+
+/* copies the statistics of the prio class (prio must be valid) */
+void i2cqueue_get_stats(const i2cqueue *queue, i2c_priorities prio,
+			i2c_queue_stats *stats);
+
+#endif
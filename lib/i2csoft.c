@@ -0,0 +1,494 @@
+/*
+ * AVR Library: bit-banged (software) I2C bus
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+
+#include "debug.h"
+#include "i2cqueue.h"
+#include "i2csoft.h"
+#include "misc.h"
+#include "pending.h"
+#include "sched.h"
+
+#ifdef ENABLE_I2CSOFT
+
+/* the bus pins, unused ones by default */
+#ifndef I2CSOFT_PORT
+#define I2CSOFT_PORT PORTA
+#define I2CSOFT_DDR DDRA
+#define I2CSOFT_PIN PINA
+#define I2CSOFT_SCL_BIT 0
+#define I2CSOFT_SDA_BIT 1
+#endif
+
+/*
+ * clock half period in µs, with the bit-banging overhead the bus clock ends
+ * up somewhat below 100 kHz
+ */
+#ifndef I2CSOFT_HALF_PERIOD
+#define I2CSOFT_HALF_PERIOD 5
+#endif
+
+/* how long (in µs, at most 255) a device can stretch a single clock */
+#define I2CSOFT_STRETCH_MAX 200
+
+#define I2CSOFT_BUS_CLEAR_CLOCKS 9
+
+/*
+ * how many transactions can be queued at the same time
+ * (the queue has no dynamic allocations)
+ */
+#ifndef I2CSOFT_TRANSACTIONS_MAX
+#define I2CSOFT_TRANSACTIONS_MAX 4
+#endif
+
+#ifdef I2C_DEBUG_LOG_DISABLE
+#undef dprintf
+#undef dprintf_P
+#define dprintf(...)
+#define dprintf_P(...)
+#endif
+
+/*
+ * I2CSOFT_START does a START (or a repeated START) and sends the address of
+ * the current segment, I2CSOFT_DATA transfers its next byte
+ */
+typedef enum { I2CSOFT_IDLE, I2CSOFT_START, I2CSOFT_DATA,
+	       I2CSOFT_STOP } i2csoft_states;
+
+typedef struct _i2csoft_transaction_list {
+	i2cqueue_entry queue;
+
+	/* the free list */
+	struct _i2csoft_transaction_list *next;
+
+	const i2c_segment *segs;
+	uint8_t segs_num;
+
+	/* the segment in progress and its byte position */
+	uint8_t seg_cur;
+	uint8_t pos;
+
+	i2c_completion_fun fun;
+	void *data;
+
+	uint8_t rdlen_actual;
+} i2csoft_transaction_list;
+
+/* i2csoft_queue_pop() casts the queue entry back */
+_Static_assert(offsetof(i2csoft_transaction_list, queue) == 0,
+	       "the queue entry has to be the first transaction member");
+
+/*
+ * everything here runs in the main loop (there is no interrupt handler),
+ * so nothing needs interrupt protection
+ */
+static /* i2csoft_states */ uint8_t i2csoft_state;
+
+static i2csoft_transaction_list
+i2csoft_transaction_pool[I2CSOFT_TRANSACTIONS_MAX];
+static i2csoft_transaction_list *i2csoft_transaction_free_head;
+
+/* the transaction in progress */
+static i2csoft_transaction_list *i2csoft_transaction_cur;
+
+/* transactions waiting to be started */
+static i2cqueue i2csoft_queue;
+
+static sched_timer i2csoft_sched_timer;
+
+#define I2CSOFT_SETSTATE(state_new)					\
+	do								\
+		if (i2csoft_state != state_new) {			\
+			dprintf_P(PSTR_M("%S: *%S\n"),			\
+				  PSTR_M("i2csoft"),			\
+				  PSTR_M(#state_new));			\
+			i2csoft_state = state_new;			\
+		}							\
+	while (0)
+
+/*
+ * a line is driven low by making its pin an output (its PORT bit is always
+ * zero) and released by making it an input again
+ */
+static inline void i2csoft_line_low(uint8_t bit)
+{
+	I2CSOFT_DDR |= _BV(bit);
+}
+
+static inline void i2csoft_line_release(uint8_t bit)
+{
+	I2CSOFT_DDR &= ~_BV(bit);
+}
+
+static inline bool i2csoft_line_is_high(uint8_t bit)
+{
+	return bit_is_set(I2CSOFT_PIN, bit);
+}
+
+static void i2csoft_delay(void)
+{
+	_delay_us(I2CSOFT_HALF_PERIOD);
+}
+
+/*
+ * releases SCL and waits for it to go high (a device can hold it low),
+ * returns false if it didn't in I2CSOFT_STRETCH_MAX
+ */
+static bool i2csoft_scl_release(void)
+{
+	i2csoft_line_release(I2CSOFT_SCL_BIT);
+
+	for (uint8_t ctr = 0; !i2csoft_line_is_high(I2CSOFT_SCL_BIT); ctr++) {
+		if (ctr >= I2CSOFT_STRETCH_MAX)
+			return false;
+
+		_delay_us(1);
+	}
+
+	i2csoft_delay();
+
+	return true;
+}
+
+/* SCL is low before and after all these */
+static bool i2csoft_bit_write(bool bit)
+{
+	if (bit)
+		i2csoft_line_release(I2CSOFT_SDA_BIT);
+	else
+		i2csoft_line_low(I2CSOFT_SDA_BIT);
+
+	i2csoft_delay();
+
+	if (!i2csoft_scl_release())
+		return false;
+
+	i2csoft_line_low(I2CSOFT_SCL_BIT);
+
+	return true;
+}
+
+static bool i2csoft_bit_read(bool *bit)
+{
+	i2csoft_line_release(I2CSOFT_SDA_BIT);
+	i2csoft_delay();
+
+	if (!i2csoft_scl_release())
+		return false;
+
+	*bit = i2csoft_line_is_high(I2CSOFT_SDA_BIT);
+
+	i2csoft_line_low(I2CSOFT_SCL_BIT);
+
+	return true;
+}
+
+static bool i2csoft_byte_write(uint8_t byte, bool *ack)
+{
+	for (uint8_t mask = 0x80; mask != 0; mask >>= 1)
+		if (!i2csoft_bit_write(byte & mask))
+			return false;
+
+	bool nack;
+	if (!i2csoft_bit_read(&nack))
+		return false;
+
+	*ack = !nack;
+
+	return true;
+}
+
+static bool i2csoft_byte_read(uint8_t *byte, bool ack)
+{
+	*byte = 0;
+	for (uint8_t ctr = 0; ctr < 8; ctr++) {
+		bool bit;
+		if (!i2csoft_bit_read(&bit))
+			return false;
+
+		*byte = (*byte << 1) | bit;
+	}
+
+	return i2csoft_bit_write(!ack);
+}
+
+/*
+ * a repeated START begins with SCL low (held by us), a START needs both lines
+ * released and high
+ */
+static bool i2csoft_start(bool repeated)
+{
+	if (repeated) {
+		i2csoft_line_release(I2CSOFT_SDA_BIT);
+		i2csoft_delay();
+
+		if (!i2csoft_scl_release())
+			return false;
+	} else if (!i2csoft_line_is_high(I2CSOFT_SCL_BIT) ||
+		   !i2csoft_line_is_high(I2CSOFT_SDA_BIT))
+		return false;
+
+	i2csoft_line_low(I2CSOFT_SDA_BIT);
+	i2csoft_delay();
+	i2csoft_line_low(I2CSOFT_SCL_BIT);
+
+	return true;
+}
+
+/* releases both lines, returns false if the STOP wasn't seen on the bus */
+static bool i2csoft_stop(void)
+{
+	i2csoft_line_low(I2CSOFT_SDA_BIT);
+	i2csoft_delay();
+
+	bool ok = i2csoft_scl_release();
+
+	i2csoft_line_release(I2CSOFT_SDA_BIT);
+	i2csoft_delay();
+
+	return ok && i2csoft_line_is_high(I2CSOFT_SDA_BIT);
+}
+
+/*
+ * clocks a device holding SDA low (in the middle of a byte it thinks it is
+ * sending) until it lets go, then does a START and a STOP
+ */
+static void i2csoft_bus_clear(void)
+{
+	for (uint8_t ctr = 0; ctr < I2CSOFT_BUS_CLEAR_CLOCKS &&
+		     !i2csoft_line_is_high(I2CSOFT_SDA_BIT); ctr++) {
+		i2csoft_line_low(I2CSOFT_SCL_BIT);
+		i2csoft_delay();
+		i2csoft_scl_release();
+	}
+
+	i2csoft_line_low(I2CSOFT_SDA_BIT);
+	i2csoft_delay();
+	i2csoft_line_release(I2CSOFT_SDA_BIT);
+	i2csoft_delay();
+
+	dprintf_P(PSTR_M("i2csoft: bus clear %S\n"),
+		  i2csoft_line_is_high(I2CSOFT_SDA_BIT) ?
+		  PSTR_M("done") : PSTR_M("failed"));
+}
+
+static void i2csoft_transaction_complete(bool success)
+{
+	i2csoft_transaction_list *tr = i2csoft_transaction_cur;
+	i2c_completion_fun fun = tr->fun;
+	void *data = tr->data;
+	uint8_t rdlen_actual = tr->rdlen_actual;
+
+	i2csoft_transaction_cur = NULL;
+	I2CSOFT_SETSTATE(I2CSOFT_IDLE);
+
+	/* free before the completion so it can queue a new one */
+	tr->next = i2csoft_transaction_free_head;
+	i2csoft_transaction_free_head = tr;
+
+	if (fun != NULL)
+		fun(data, success, rdlen_actual);
+}
+
+static void i2csoft_transaction_fail(void)
+{
+	const i2csoft_transaction_list *tr = i2csoft_transaction_cur;
+
+	dprintf_P(PSTR_M("i2csoft: transaction failed at %x (lines %x)\n"),
+		  (unsigned)tr->segs[tr->seg_cur].addr, (unsigned)I2CSOFT_PIN);
+
+	if (!i2csoft_stop())
+		i2csoft_bus_clear();
+
+	i2csoft_transaction_complete(false);
+}
+
+static void i2csoft_transaction_seg_next(i2csoft_transaction_list *tr)
+{
+	tr->seg_cur++;
+	tr->pos = 0;
+
+	if (tr->seg_cur < tr->segs_num)
+		I2CSOFT_SETSTATE(I2CSOFT_START);
+	else
+		I2CSOFT_SETSTATE(I2CSOFT_STOP);
+}
+
+static void i2csoft_engine_step(void)
+{
+	i2csoft_transaction_list *tr = i2csoft_transaction_cur;
+	const i2c_segment *seg = &tr->segs[tr->seg_cur];
+
+	if (i2csoft_state == I2CSOFT_START) {
+		bool ack;
+
+		if (tr->seg_cur == 0 &&
+		    !i2csoft_line_is_high(I2CSOFT_SDA_BIT))
+			i2csoft_bus_clear();
+
+		if (!i2csoft_start(tr->seg_cur > 0) ||
+		    !i2csoft_byte_write((seg->addr << 1) | seg->read, &ack) ||
+		    !ack) {
+			i2csoft_transaction_fail();
+			return;
+		}
+
+		if (seg->len > 0)
+			I2CSOFT_SETSTATE(I2CSOFT_DATA);
+		else
+			i2csoft_transaction_seg_next(tr);
+	} else if (i2csoft_state == I2CSOFT_DATA) {
+		if (seg->read) {
+			/* the last byte of a read is NACKed */
+			if (!i2csoft_byte_read(&seg->buf[tr->pos],
+					       tr->pos + 1 < seg->len)) {
+				i2csoft_transaction_fail();
+				return;
+			}
+
+			tr->rdlen_actual++;
+		} else {
+			bool ack;
+
+			if (!i2csoft_byte_write(seg->buf[tr->pos], &ack) ||
+			    !ack) {
+				i2csoft_transaction_fail();
+				return;
+			}
+		}
+
+		tr->pos++;
+		if (tr->pos >= seg->len)
+			i2csoft_transaction_seg_next(tr);
+	} else if (i2csoft_state == I2CSOFT_STOP) {
+		if (!i2csoft_stop()) {
+			i2csoft_transaction_fail();
+			return;
+		}
+
+		i2csoft_transaction_complete(true);
+	}
+}
+
+/* returns NULL if nothing is queued */
+static i2csoft_transaction_list *i2csoft_queue_pop(void)
+{
+	timestamp now;
+
+	timekeeping_now_timestamp(&now);
+
+	return (i2csoft_transaction_list *)i2cqueue_pop(&i2csoft_queue, &now);
+}
+
+bool i2csoft_is_idle(void)
+{
+	if (i2csoft_transaction_cur != NULL)
+		return false;
+
+	return i2cqueue_is_empty(&i2csoft_queue);
+}
+
+static void i2csoft_sched_update(void)
+{
+	if (!i2csoft_is_idle())
+		sched_timer_set_now(&i2csoft_sched_timer);
+	else
+		sched_timer_clear(&i2csoft_sched_timer);
+}
+
+bool i2csoft_transaction_segments_prio(const i2c_segment *segs,
+				       uint8_t segs_num,
+				       i2c_priorities prio,
+				       const timestamp *deadline,
+				       i2c_completion_fun completion,
+				       void *comp_data)
+{
+	if (segs == NULL || segs_num == 0 || prio >= I2C_PRIOS_NUM)
+		return false;
+
+	for (uint8_t ctr = 0; ctr < segs_num; ctr++) {
+		/* a read has to be at least one byte long */
+		if (segs[ctr].read && segs[ctr].len == 0)
+			return false;
+
+		if (segs[ctr].len > 0 && segs[ctr].buf == NULL)
+			return false;
+	}
+
+	i2csoft_transaction_list *nelem = i2csoft_transaction_free_head;
+	if (nelem == NULL)
+		return false;
+
+	i2csoft_transaction_free_head = nelem->next;
+
+	nelem->segs = segs;
+	nelem->segs_num = segs_num;
+	nelem->seg_cur = 0;
+	nelem->pos = 0;
+
+	nelem->fun = completion;
+	nelem->data = comp_data;
+
+	nelem->rdlen_actual = 0;
+
+	i2cqueue_insert(&i2csoft_queue, &nelem->queue, prio, deadline);
+
+	sched_timer_set_now(&i2csoft_sched_timer);
+
+	return true;
+}
+
+bool i2csoft_transaction_segments(const i2c_segment *segs, uint8_t segs_num,
+				  i2c_completion_fun completion,
+				  void *comp_data)
+{
+	return i2csoft_transaction_segments_prio(segs, segs_num,
+						 I2C_PRIO_NORMAL, NULL,
+						 completion, comp_data);
+}
+
+void i2csoft_poll(void)
+{
+	if (i2csoft_transaction_cur == NULL) {
+		i2csoft_transaction_cur = i2csoft_queue_pop();
+		if (i2csoft_transaction_cur != NULL)
+			I2CSOFT_SETSTATE(I2CSOFT_START);
+	}
+
+	if (i2csoft_transaction_cur != NULL)
+		i2csoft_engine_step();
+
+	i2csoft_sched_update();
+}
+
+void i2csoft_setup(void)
+{
+	i2csoft_state = I2CSOFT_IDLE;
+
+	i2csoft_transaction_cur = NULL;
+
+	i2cqueue_init(&i2csoft_queue);
+
+	i2csoft_transaction_free_head = NULL;
+	for (uint8_t ctr = 0; ctr < I2CSOFT_TRANSACTIONS_MAX; ctr++) {
+		i2csoft_transaction_pool[ctr].next =
+			i2csoft_transaction_free_head;
+		i2csoft_transaction_free_head = &i2csoft_transaction_pool[ctr];
+	}
+
+	sched_timer_register(&i2csoft_sched_timer, PENDING_I2CSOFT);
+}
+
+#endif
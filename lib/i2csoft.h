@@ -0,0 +1,79 @@
+/*
+ * AVR Library: bit-banged (software) I2C bus
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _LIB_I2CSOFT_H_
+#define _LIB_I2CSOFT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "i2c.h"
+#include "timekeeping.h"
+
+/*
+ * a second I2C bus (the only master on it) on two GPIO pins, so devices that
+ * upset the bus can be kept away from the TWI one
+ *
+ * the bus is driven from the main loop with interrupts enabled, one START
+ * and address or one data byte per poll (about 100 µs at the default clock),
+ * so both buses make progress at the same time - while a transaction is in
+ * progress or queued this bus wants to be polled right away, so the main loop
+ * busy-polls (never sleeps) until it is idle again
+ *
+ * the lines need external pull-up resistors, like the TWI ones, and their pins
+ * have to be inputs with the PORT bits cleared (they are never driven high)
+ * when i2csoft_setup() is called
+ *
+ * only built with ENABLE_I2CSOFT
+ */
+
+/*
+ * add an i2c transaction made of segs_num segments to this bus transaction
+ * queue
+ *
+ * the same as i2c_transaction_segments_prio() is for the TWI bus, except that
+ * there are no per-class queue statistics and no per-device speeds or
+ * statistics
+ */
+bool i2csoft_transaction_segments_prio(const i2c_segment *segs,
+				       uint8_t segs_num,
+				       i2c_priorities prio,
+				       const timestamp *deadline,
+				       i2c_completion_fun completion,
+				       void *comp_data);
+
+/*
+ * like i2csoft_transaction_segments_prio() with I2C_PRIO_NORMAL and
+ * no deadline
+ */
+bool i2csoft_transaction_segments(const i2c_segment *segs, uint8_t segs_num,
+				  i2c_completion_fun completion,
+				  void *comp_data);
+
+/*
+ * should be called with interrupts enabled from time to time
+ * (at least when the i2csoft scheduler timer deadline comes or the i2csoft
+ * pending work flag gets set)
+ *
+ * completion notifications are called from here
+ */
+void i2csoft_poll(void);
+
+/* returns whether there is no transaction in progress or queued */
+bool i2csoft_is_idle(void);
+
+/*
+ * setup the software i2c bus: must be called before any other i2csoft
+ * function, must be called with interrupts disabled, uses sched functions
+ */
+void i2csoft_setup(void);
+
+#endif
@@ -0,0 +1,255 @@
+/*
+ * AVR Library: LM75 class (LM75, TMP75) temperature sensor driver
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "debug.h"
+#include "i2c.h"
+#include "lm75.h"
+#include "misc.h"
+
+#ifdef ENABLE_LM75
+
+#ifdef LM75_DEBUG_LOG_DISABLE
+#undef dprintf
+#undef dprintf_P
+#define dprintf(...)
+#define dprintf_P(...)
+#endif
+
+#define LM75_REG_TEMP 0
+#define LM75_REG_CONFIG 1
+
+/* TMP75 R1:R0 = 10 - 11 bits */
+#define TMP75_REG_CONFIG_RES_11BIT ((uint8_t)_BV(6))
+
+/*
+ * TEMP is left-aligned, no part we support (at the resolutions we use) has
+ * more than 11 bits in it
+ */
+#define LM75_REG_TEMP_ZERO_MASK ((uint16_t)0x1f)
+
+/* maximum conversion times (LM75: 9 bits, TMP75: 11 bits) */
+#define LM75_CONVERSION_TIME 300
+#define TMP75_CONVERSION_TIME 150
+
+static uint8_t lm75_temp_read_wr[] = { LM75_REG_TEMP };
+/* no shutdown, comparator mode, the power-on defaults otherwise */
+static uint8_t lm75_config_write_wr[] = { LM75_REG_CONFIG, 0 };
+static uint8_t tmp75_config_write_wr[] = { LM75_REG_CONFIG,
+					   TMP75_REG_CONFIG_RES_11BIT };
+
+static void lm75_i2c_complete(void *data_v, bool success, uint8_t rdlen_actual)
+{
+	lm75_data *data = data_v;
+
+	data->i2c_trans_complete = true;
+	data->i2c_trans_success = success;
+	data->i2c_rdlen_actual = rdlen_actual;
+
+	coro_wake(&data->coro);
+}
+
+/* the completion is called from the main loop (i2c_poll()), not from an ISR */
+static bool lm75_i2c_trans_is_complete(lm75_data *data)
+{
+	return data->i2c_trans_complete;
+}
+
+static bool lm75_i2c_transaction(lm75_data *data,
+				 const i2c_segment *segs, uint8_t segs_num)
+{
+	data->i2c_trans_complete = false;
+
+	return data->i2c_transaction(segs, segs_num, data->i2c_prio, NULL,
+				     lm75_i2c_complete, data);
+}
+
+static bool lm75_i2c_config_write(lm75_data *data)
+{
+	return lm75_i2c_transaction(data, &data->config_write_seg, 1);
+}
+
+static bool lm75_i2c_temp_read(lm75_data *data)
+{
+	return lm75_i2c_transaction(data, data->temp_read_segs,
+				    LM75_TEMP_READ_SEGS);
+}
+
+bool lm75_get_temperature(lm75_data *data)
+{
+	if (lm75_is_busy(data))
+		return false;
+
+	coro_start(&data->coro);
+
+	return true;
+}
+
+bool lm75_get_temperature_result(lm75_data *data, tempsensor_temp *temperature)
+{
+	if (!data->get_temp_result)
+		return false;
+
+	if (temperature != NULL)
+		*temperature = data->temp;
+
+	return true;
+}
+
+/* checks a completed TEMP register read, sets temp if it is fine */
+static bool lm75_temp_read_is_ok(lm75_data *data)
+{
+	uint16_t temp;
+
+	if (!data->i2c_trans_success ||
+	    data->i2c_rdlen_actual != sizeof(data->temp_buf))
+		return false;
+
+	temp = ((uint16_t)data->temp_buf[0] << 8) | data->temp_buf[1];
+	if ((temp & LM75_REG_TEMP_ZERO_MASK) != 0) {
+		dprintf_P(PSTR("lm75: unused bits set (%"PRIx16") in TEMP\n"),
+			  temp);
+
+		return false;
+	}
+
+	data->temp = (tempsensor_temp)temp;
+
+	return true;
+}
+
+static void lm75_conversion_wait_start(lm75_data *data)
+{
+	const timestamp_interval lm75_conversion_time =
+		TIMESTAMPI_FROM_MS(LM75_CONVERSION_TIME);
+	const timestamp_interval tmp75_conversion_time =
+		TIMESTAMPI_FROM_MS(TMP75_CONVERSION_TIME);
+	const timestamp_interval *conversion_time;
+	timestamp now;
+
+	if (data->type == LM75_TYPE_TMP75)
+		conversion_time = &tmp75_conversion_time;
+	else
+		conversion_time = &lm75_conversion_time;
+
+	timekeeping_now_timestamp(&now);
+	timestamp_add(&now, conversion_time, &data->conversion_done);
+}
+
+void lm75_poll(lm75_data *data)
+{
+	CORO_BEGIN(&data->coro);
+
+	data->get_temp_result = false;
+
+	if (!data->configured) {
+		if (!lm75_i2c_config_write(data))
+			CORO_EXIT(&data->coro);
+
+		CORO_WAIT_FOR(&data->coro, lm75_i2c_trans_is_complete(data));
+
+		if (!data->i2c_trans_success)
+			CORO_EXIT(&data->coro);
+
+		/* TEMP is only valid (at the new resolution) after that */
+		lm75_conversion_wait_start(data);
+		CORO_WAIT_UNTIL(&data->coro, &data->conversion_done);
+
+		data->configured = true;
+	}
+
+	if (!lm75_i2c_temp_read(data)) {
+		data->configured = false;
+		CORO_EXIT(&data->coro);
+	}
+
+	CORO_WAIT_FOR(&data->coro, lm75_i2c_trans_is_complete(data));
+
+	/* any failure means writing CONFIG again, it might have been reset */
+	if (!lm75_temp_read_is_ok(data)) {
+		data->configured = false;
+		CORO_EXIT(&data->coro);
+	}
+
+	data->get_temp_result = true;
+
+	dprintf_P(PSTR("lm75: temperature %"PRId16"/256 dC\n"), data->temp);
+
+	CORO_END(&data->coro);
+}
+
+void lm75_init(lm75_data *data, i2c_transaction_fun i2c_transaction,
+	       uint8_t addr, lm75_types type, i2c_priorities i2c_prio,
+	       uint8_t pending_flag)
+{
+	data->i2c_transaction = i2c_transaction;
+	data->addr = addr;
+	data->i2c_prio = i2c_prio;
+	data->type = type;
+
+	data->configured = false;
+	data->get_temp_result = false;
+
+	for (uint8_t ctr = 0; ctr < LM75_TEMP_READ_SEGS; ctr++)
+		data->temp_read_segs[ctr].addr = addr;
+
+	data->temp_read_segs[0].read = false;
+	data->temp_read_segs[0].buf = lm75_temp_read_wr;
+	data->temp_read_segs[0].len = sizeof(lm75_temp_read_wr);
+
+	data->temp_read_segs[1].read = true;
+	data->temp_read_segs[1].buf = data->temp_buf;
+	data->temp_read_segs[1].len = sizeof(data->temp_buf);
+
+	data->config_write_seg.addr = addr;
+	data->config_write_seg.read = false;
+	if (type == LM75_TYPE_TMP75) {
+		data->config_write_seg.buf = tmp75_config_write_wr;
+		data->config_write_seg.len = sizeof(tmp75_config_write_wr);
+	} else {
+		data->config_write_seg.buf = lm75_config_write_wr;
+		data->config_write_seg.len = sizeof(lm75_config_write_wr);
+	}
+
+	coro_init(&data->coro, pending_flag);
+}
+
+static bool lm75_ops_get_temperature(void *data)
+{
+	return lm75_get_temperature(data);
+}
+
+static bool lm75_ops_is_busy(void *data)
+{
+	return lm75_is_busy(data);
+}
+
+static bool lm75_ops_get_temperature_result(void *data,
+					    tempsensor_temp *temperature)
+{
+	return lm75_get_temperature_result(data, temperature);
+}
+
+static void lm75_ops_poll(void *data)
+{
+	lm75_poll(data);
+}
+
+const tempsensor_ops lm75_ops = {
+	.get_temperature = lm75_ops_get_temperature,
+	.is_busy = lm75_ops_is_busy,
+	.get_temperature_result = lm75_ops_get_temperature_result,
+	.poll = lm75_ops_poll,
+};
+
+#endif
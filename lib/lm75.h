@@ -0,0 +1,113 @@
+/*
+ * AVR Library: LM75 class (LM75, TMP75) temperature sensor driver
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _LIB_LM75_H_
+#define _LIB_LM75_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "coro.h"
+#include "i2c.h"
+#include "tempsensor.h"
+#include "timekeeping.h"
+
+/*
+ * the driver is only built with ENABLE_LM75
+ *
+ * LM75_TYPE_LM75 - an LM75 or a compatible part, read at the resolution
+ * it has (0.5 °C for the original LM75, 0.125 °C for LM75A / LM75B)
+ * LM75_TYPE_TMP75 - a TMP75 / TMP275 / TMP175, set to 0.125 °C
+ */
+typedef enum { LM75_TYPE_LM75, LM75_TYPE_TMP75 } lm75_types;
+
+/* TEMP register pointer write + read */
+#define LM75_TEMP_READ_SEGS 2
+
+typedef struct {
+	i2c_transaction_fun i2c_transaction;
+	uint8_t addr;
+	/* i2c_priorities */ uint8_t i2c_prio;
+	/* lm75_types */ uint8_t type;
+
+	coro coro;
+
+	bool i2c_trans_complete;
+	bool i2c_trans_success;
+	uint8_t i2c_rdlen_actual;
+
+	/* CONFIG was written (and a conversion since then has finished) */
+	bool configured;
+	timestamp conversion_done;
+
+	bool get_temp_result;
+
+	uint8_t temp_buf[2];
+	tempsensor_temp temp;
+
+	i2c_segment config_write_seg;
+	i2c_segment temp_read_segs[LM75_TEMP_READ_SEGS];
+} lm75_data;
+
+/*
+ * check if given lm75 instance is busy
+ * busy status won't change if interrupts are disabled and no other
+ * functions on this instance are called
+ */
+static inline bool lm75_is_busy(lm75_data *data)
+{
+	return coro_is_running(&data->coro);
+}
+
+/*
+ * start a temperature read on given lm75 instance
+ * can only be called successfully if this instance isn't busy
+ * (will return false otherwise)
+ *
+ * if the function returned true then the caller should wait until
+ * this instance is no longer busy, then could get the result of
+ * the read via lm75_get_temperature_result()
+ *
+ * the first read (and the first one after a failed one) writes CONFIG and
+ * waits for a conversion to finish first, so it takes up to a few hundred ms
+ */
+bool lm75_get_temperature(lm75_data *data);
+
+/*
+ * returned temperature is only valid if this function returned true
+ * (which means that the last temperature read was successful)
+ */
+bool lm75_get_temperature_result(lm75_data *data, tempsensor_temp *temperature);
+
+/*
+ * should be called from time to time on each instance
+ * (at least when this instance scheduler timer deadline comes)
+ */
+void lm75_poll(lm75_data *data);
+
+/*
+ * init an lm75 instance: must be called before any other lm75 function
+ * on this instance, must be called with interrupts disabled.
+ * data is a caller-allocated variable, i2c_transaction queues transactions on
+ * the bus this instance is on (like i2c_transaction_segments_prio()),
+ * addr is an i2c address of this instance,
+ * type is what sensor it is,
+ * i2c_prio is the i2c transaction class of its bus traffic,
+ * pending_flag is the pending work flag of the module polling this instance
+ */
+void lm75_init(lm75_data *data, i2c_transaction_fun i2c_transaction,
+	       uint8_t addr, lm75_types type, i2c_priorities i2c_prio,
+	       uint8_t pending_flag);
+
+/* the lm75 functions above as a tempsensor driver, data is an lm75_data */
+extern const tempsensor_ops lm75_ops;
+
+#endif
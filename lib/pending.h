@@ -0,0 +1,84 @@
+/*
+ * AVR Library: pending work flags
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _LIB_PENDING_H_
+#define _LIB_PENDING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/cpufunc.h>
+#include <avr/io.h>
+
+#include "critprof.h"
+
+/*
+ * one flag per main loop module, telling that the module has some work to do
+ * and so needs to be polled
+ *
+ * flags are set by interrupt handlers (or by the module itself), a module
+ * scheduler timer deadline coming has the same effect (see
+ * sched_get_due_work())
+ *
+ * they live in GPIOR0, so setting one is a single sbi instruction, atomic
+ * with regard to interrupts
+ */
+#define PENDING_SERIAL 0
+#define PENDING_I2C 1
+#define PENDING_CRITPROF 2
+#define PENDING_I2CSOFT 3
+
+/* the first flag free for the application use, up to 7 */
+#define PENDING_APP_FIRST 4
+
+#define PENDING_ALL UINT8_MAX
+
+/* mark a module as having some work to do */
+#define pending_set(flag) (GPIOR0 |= _BV(flag))
+
+/* returns the set flags (as a bitmask) and clears them */
+static inline uint8_t pending_take(void)
+{
+	uint8_t flags;
+
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_MemoryBarrier();
+
+		flags = GPIOR0;
+		GPIOR0 = 0;
+
+		_MemoryBarrier();
+	}
+
+	return flags;
+}
+
+/*
+ * returns whether any flag is set, must be called with interrupts disabled
+ *
+ * for the last check before sleeping: a flag set by an interrupt handler
+ * after pending_take() would otherwise wait for something else to wake
+ * the µC up
+ */
+static inline bool pending_any_atomic(void)
+{
+	return GPIOR0 != 0;
+}
+
+/*
+ * setup pending work flags: must be called before any other pending
+ * function, must be called with interrupts disabled
+ */
+static inline void pending_setup(void)
+{
+	GPIOR0 = 0;
+}
+
+#endif
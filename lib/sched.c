@@ -0,0 +1,226 @@
+/*
+ * AVR Library: deadline scheduler
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <stddef.h>
+
+#include "debug.h"
+#include "misc.h"
+#include "sched.h"
+
+/* max count of registered timers */
+#ifndef SCHED_MAX_TIMERS
+#define SCHED_MAX_TIMERS 16
+#endif
+
+/* heap_idx values of timers that aren't currently in the heap */
+#define SCHED_IDX_NONE UINT8_MAX
+#define SCHED_IDX_UNREGISTERED (UINT8_MAX - 1)
+
+_Static_assert(SCHED_MAX_TIMERS < SCHED_IDX_UNREGISTERED,
+	       "too many scheduler timers");
+_Static_assert(SCHED_MAX_TIMERS <= 16,
+	       "too many scheduler timers for sched_get_due_work()");
+
+/*
+ * a binary min-heap of armed timers, ordered by their deadlines, so
+ * the earliest one is always at index 0
+ */
+static sched_timer *sched_heap[SCHED_MAX_TIMERS];
+static uint8_t sched_heap_len;
+
+static uint8_t sched_timers_registered;
+
+/*
+ * set when there were more timers registered than fit in the heap, we then
+ * fall back to always polling immediately
+ */
+static bool sched_overflow;
+
+static bool sched_timer_is_before(const sched_timer *timer1,
+				  const sched_timer *timer2)
+{
+	return timestamp_temporal_cmp(&timer1->deadline, &timer2->deadline,
+				      <);
+}
+
+static void sched_heap_place(uint8_t idx, sched_timer *timer)
+{
+	sched_heap[idx] = timer;
+	timer->heap_idx = idx;
+}
+
+static void sched_heap_sift_up(uint8_t idx)
+{
+	sched_timer *timer = sched_heap[idx];
+
+	while (idx > 0) {
+		uint8_t parent = (idx - 1) / 2;
+
+		if (!sched_timer_is_before(timer, sched_heap[parent]))
+			break;
+
+		sched_heap_place(idx, sched_heap[parent]);
+		idx = parent;
+	}
+
+	sched_heap_place(idx, timer);
+}
+
+static void sched_heap_sift_down(uint8_t idx)
+{
+	sched_timer *timer = sched_heap[idx];
+
+	while (1) {
+		uint8_t child = 2 * idx + 1;
+
+		if (child >= sched_heap_len)
+			break;
+
+		if (child + 1 < sched_heap_len &&
+		    sched_timer_is_before(sched_heap[child + 1],
+					  sched_heap[child]))
+			child++;
+
+		if (!sched_timer_is_before(sched_heap[child], timer))
+			break;
+
+		sched_heap_place(idx, sched_heap[child]);
+		idx = child;
+	}
+
+	sched_heap_place(idx, timer);
+}
+
+void sched_timer_register(sched_timer *timer, uint8_t pending_flag)
+{
+	timer->pending_flag = pending_flag;
+
+	if (sched_timers_registered >= SCHED_MAX_TIMERS) {
+		dprintf_P(PSTR_M("sched: too many timers\n"));
+
+		timer->heap_idx = SCHED_IDX_UNREGISTERED;
+		sched_overflow = true;
+		return;
+	}
+
+	sched_timers_registered++;
+	timer->heap_idx = SCHED_IDX_NONE;
+}
+
+void sched_timer_set(sched_timer *timer, const timestamp *deadline)
+{
+	if (timer->heap_idx == SCHED_IDX_UNREGISTERED)
+		return;
+
+	if (timer->heap_idx == SCHED_IDX_NONE) {
+		/* can't overflow: heap has a slot for every registered timer */
+		timer->deadline = *deadline;
+		sched_heap_place(sched_heap_len, timer);
+		sched_heap_len++;
+
+		sched_heap_sift_up(timer->heap_idx);
+		return;
+	}
+
+	bool earlier = timestamp_temporal_cmp(deadline, &timer->deadline, <);
+
+	timer->deadline = *deadline;
+
+	if (earlier)
+		sched_heap_sift_up(timer->heap_idx);
+	else
+		sched_heap_sift_down(timer->heap_idx);
+}
+
+void sched_timer_set_now(sched_timer *timer)
+{
+	timestamp now;
+
+	timekeeping_now_timestamp(&now);
+	sched_timer_set(timer, &now);
+}
+
+void sched_timer_clear(sched_timer *timer)
+{
+	if (timer->heap_idx >= SCHED_MAX_TIMERS)
+		return;
+
+	uint8_t idx = timer->heap_idx;
+	timer->heap_idx = SCHED_IDX_NONE;
+
+	sched_heap_len--;
+	if (idx == sched_heap_len)
+		return;
+
+	/* move the last heap element into the hole */
+	sched_timer *last = sched_heap[sched_heap_len];
+	sched_heap_place(idx, last);
+
+	if (idx > 0 && sched_timer_is_before(last, sched_heap[(idx - 1) / 2]))
+		sched_heap_sift_up(idx);
+	else
+		sched_heap_sift_down(idx);
+}
+
+void sched_get_next_poll_time(timestamp *next_poll)
+{
+	if (sched_overflow)
+		timekeeping_now_timestamp(next_poll);
+	else if (sched_heap_len > 0)
+		*next_poll = sched_heap[0]->deadline;
+	else
+		timekeeping_timestamp_max_future(next_poll);
+}
+
+uint8_t sched_get_due_work(void)
+{
+	/* some modules don't have their timers in the heap */
+	if (sched_overflow)
+		return PENDING_ALL;
+
+	if (sched_heap_len == 0)
+		return 0;
+
+	timestamp now;
+	timekeeping_now_timestamp(&now);
+
+	uint8_t work = 0;
+	/*
+	 * heap indices of expired timers, children of a timer that hasn't
+	 * expired have later deadlines so they can be skipped
+	 */
+	uint16_t expired = 0;
+	for (uint8_t idx = 0; idx < sched_heap_len; idx++) {
+		if (idx > 0 && !(expired & ((uint16_t)1 << ((idx - 1) / 2))))
+			continue;
+
+		const sched_timer *timer = sched_heap[idx];
+		if (timestamp_temporal_cmp(&timer->deadline, &now, >)) {
+			/* the earliest one hasn't expired */
+			if (idx == 0)
+				break;
+
+			continue;
+		}
+
+		expired |= (uint16_t)1 << idx;
+		work |= _BV(timer->pending_flag);
+	}
+
+	return work;
+}
+
+void sched_setup(void)
+{
+	sched_heap_len = 0;
+	sched_timers_registered = 0;
+	sched_overflow = false;
+}
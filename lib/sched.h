@@ -0,0 +1,76 @@
+/*
+ * AVR Library: deadline scheduler
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _LIB_SCHED_H_
+#define _LIB_SCHED_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pending.h"
+#include "timekeeping.h"
+
+/*
+ * a timer with a deadline (the time when its module wants to be polled next)
+ * caller-allocated, don't access its members directly
+ */
+typedef struct {
+	timestamp deadline;
+	uint8_t heap_idx;
+	uint8_t pending_flag;
+} sched_timer;
+
+/*
+ * register a timer: must be called before any other function on this timer,
+ * must be called with interrupts disabled
+ *
+ * pending_flag is the pending work flag (PENDING_*) of the module this timer
+ * belongs to, see sched_get_due_work()
+ *
+ * a new timer is not armed
+ */
+void sched_timer_register(sched_timer *timer, uint8_t pending_flag);
+
+/* arm (or rearm) a timer to expire at deadline or now, respectively */
+void sched_timer_set(sched_timer *timer, const timestamp *deadline);
+void sched_timer_set_now(sched_timer *timer);
+
+/* disarm a timer */
+void sched_timer_clear(sched_timer *timer);
+
+/*
+ * returns the earliest deadline of all armed timers (or a time in the far
+ * future if there are none)
+ *
+ * unlike other functions above (which can't be called from an interrupt
+ * handler but otherwise don't care) this one should be called with
+ * interrupts disabled, after polling all modules - enabling them at any time
+ * later invalidates the returned value
+ *
+ * this function doesn't change any internal state (it is purely read-only)
+ */
+void sched_get_next_poll_time(timestamp *next_poll);
+
+/*
+ * returns pending work flags (as a bitmask) of modules whose timers have
+ * expired
+ *
+ * only looks at the expired timers, so it is cheap when there are none
+ */
+uint8_t sched_get_due_work(void);
+
+/*
+ * setup the scheduler: must be called before any other sched function,
+ * must be called with interrupts disabled
+ */
+void sched_setup(void);
+
+#endif
@@ -18,7 +18,10 @@
 #include <avr/wdt.h>
 #include <util/atomic.h>
 
+#include "critprof.h"
 #include "debug.h"
+#include "pending.h"
+#include "timekeeping.h"
 
 /*
  * if defined then this serial port at (zero-based) index will be a debug port:
@@ -111,6 +114,8 @@ extern bool serial_app_mode;
 	{								\
 		while (bit_is_set(UCSR ## num ## A, RXC ## num))	\
 			serial ## num ## _buf_rx_put(UDR ## num);	\
+									\
+		pending_set(PENDING_SERIAL);				\
 	}								\
 									\
 	ISR(USART ## num ## _UDRE_vect)				\
@@ -123,6 +128,8 @@ extern bool serial_app_mode;
 		if (!debug_data_present && serial ## num ##		\
 		    _buf_tx_is_empty()) {				\
 			UCSR ## num ## B &= ~_BV(UDRIE ## num);	\
+			/* someone might be waiting for tx to drain */	\
+			pending_set(PENDING_SERIAL);			\
 			return;					\
 		}							\
 									\
@@ -198,7 +205,7 @@ extern bool serial_app_mode;
 	{								\
 		bool ret;						\
 									\
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {			\
+		CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {		\
 			_MemoryBarrier();				\
 			ret = serial ## num ## _buf_rx_is_empty();	\
 			_MemoryBarrier();				\
@@ -211,7 +218,7 @@ extern bool serial_app_mode;
 	{								\
 		uint8_t ret;						\
 									\
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {			\
+		CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {		\
 			_MemoryBarrier();				\
 			ret = serial ## num ## _buf_rx_valid_length;	\
 			_MemoryBarrier();				\
@@ -224,7 +231,7 @@ extern bool serial_app_mode;
 	{								\
 		bool ret;						\
 									\
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {			\
+		CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {		\
 			_MemoryBarrier();				\
 									\
 			if (!serial ## num ## _buf_rx_is_empty()) {	\
@@ -242,7 +249,7 @@ extern bool serial_app_mode;
 	void serial ## num ##_rx_peek(uint8_t *out, uint8_t count,	\
 				      uint8_t *act_count)		\
 	{								\
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {			\
+		CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {		\
 			_MemoryBarrier();				\
 									\
 			if (count > serial ## num ##			\
@@ -261,7 +268,7 @@ extern bool serial_app_mode;
 					 uint8_t count,		\
 					 uint8_t *act_count)		\
 	{								\
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {			\
+		CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {		\
 			_MemoryBarrier();				\
 									\
 			if (idx >= serial ## num ##			\
@@ -292,7 +299,7 @@ extern bool serial_app_mode;
 	{								\
 		bool ret;						\
 									\
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {			\
+		CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {		\
 			_MemoryBarrier();				\
 			ret = serial ## num ## _buf_tx_is_empty();	\
 			_MemoryBarrier();				\
@@ -303,10 +310,12 @@ extern bool serial_app_mode;
 									\
 	void serial ## num ##_tx_put(uint8_t in)			\
 	{								\
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {			\
+		CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {		\
 			_MemoryBarrier();				\
 									\
 			serial ## num ## _buf_tx_put(in);		\
+			/* TXC flag is cleared by writing one */	\
+			UCSR ## num ## A |= _BV(TXC ## num);		\
 			UCSR ## num ## B |= _BV(UDRIE ## num) |	\
 				_BV(TXEN ## num);			\
 									\
@@ -320,7 +329,7 @@ extern bool serial_app_mode;
 		if (!debug_port)					\
 			return;					\
 									\
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {			\
+		CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {		\
 			_MemoryBarrier();				\
 									\
 			if (!debug_buf_is_empty_atomic())		\
@@ -331,6 +340,49 @@ extern bool serial_app_mode;
 		}							\
 	}
 
+#ifdef TIMEKEEPING_CLOCK_SCALING
+/*
+ * the baud rate stays the same with the system clock divided only if UBRR + 1
+ * is divisible by the clock divider
+ *
+ * the UBRR update is done right after the clock switch, so at most
+ * a fraction of a bit time is lost - well within the USART tolerance
+ */
+#define SERIAL_CLOCK_SCALING(num)					\
+	bool serial ## num ##_can_clock_scale(void)			\
+	{								\
+		return (serial ## num ##_get_ubrr() + 1) %		\
+			TIMEKEEPING_CLOCK_SCALING_DIV == 0;		\
+	}								\
+									\
+	void serial ## num ##_clock_scale_atomic(bool scaled)		\
+	{								\
+		uint16_t ubrr = serial ## num ##_get_ubrr();		\
+									\
+		if (scaled)						\
+			ubrr = (ubrr + 1) /				\
+				TIMEKEEPING_CLOCK_SCALING_DIV - 1;	\
+									\
+		UBRR ## num = ubrr;					\
+	}								\
+									\
+	bool serial ## num ##_is_idle_atomic(void)			\
+	{								\
+		if (!serial ## num ## _buf_rx_is_empty() ||		\
+		    !serial ## num ## _buf_tx_is_empty())		\
+			return false;					\
+									\
+		if (bit_is_set(UCSR ## num ## B, UDRIE ## num))	\
+			return false;					\
+									\
+		/* the last byte might be still shifted out */		\
+		return bit_is_clear(UCSR ## num ## B, TXEN ## num) ||	\
+			bit_is_set(UCSR ## num ## A, TXC ## num);	\
+	}
+#else
+#define SERIAL_CLOCK_SCALING(num)
+#endif
+
 /*
  * expand this macro to implement a serial port with (zero-based) index
  * of num and with given RX, TX buffer sizes (in bytes)
@@ -346,4 +398,6 @@ extern bool serial_app_mode;
 							\
 	SERIAL_METHODS(num)				\
 							\
+	SERIAL_CLOCK_SCALING(num)			\
+							\
 	SERIAL_SETUP(num)
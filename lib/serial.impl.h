@@ -12,6 +12,25 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "timekeeping.h"
+
+#ifdef TIMEKEEPING_CLOCK_SCALING
+#define SERIAL_IMPL_HEADER_CLOCK_SCALING(num)			\
+	/* whether this port baud rate can be kept with */	\
+	/* the system clock divided */				\
+	bool serial ## num ##_can_clock_scale(void);		\
+								\
+	/* adjust the baud rate generator to the system */	\
+	/* clock divided or not (see */			\
+	/* timekeeping_clock_scale_atomic()) */		\
+	void serial ## num ##_clock_scale_atomic(bool scaled);	\
+								\
+	/* whether there is nothing to receive or transmit */	\
+	bool serial ## num ##_is_idle_atomic(void);
+#else
+#define SERIAL_IMPL_HEADER_CLOCK_SCALING(num)
+#endif
+
 /*
  * expand this macro to generate header file declarations for a serial port
  * with (zero-based) index of num
@@ -51,4 +70,6 @@
 	bool serial ## num ##_tx_is_empty(void);		\
 								\
 	/* add a byte to the serial TX buffer */		\
-	void serial ## num ##_tx_put(uint8_t in);
+	void serial ## num ##_tx_put(uint8_t in);		\
+								\
+	SERIAL_IMPL_HEADER_CLOCK_SCALING(num)
@@ -11,7 +11,6 @@
 
 #include <inttypes.h>
 #include <stddef.h>
-#include <util/atomic.h>
 
 #include "debug.h"
 #include "i2c.h"
@@ -21,6 +20,14 @@
 #define TC74_DATA_READY_POLL_PERIOD (250 / 2)
 #define TC74_DATA_READY_POLL_COUNT 3
 
+/*
+ * how many reads after a full (CONFIG and TEMP) one only read TEMP,
+ * about 10 seconds worth at the temp.c poll period
+ */
+#ifndef TC74_FAST_READS
+#define TC74_FAST_READS 16
+#endif
+
 #ifdef TC74_DEBUG_LOG_DISABLE
 #undef dprintf
 #undef dprintf_P
@@ -39,49 +46,11 @@ static uint8_t tc74_temp_read_wr[] = { TC74_REG_TEMP };
 static uint8_t tc74_config_read_wr[] = { TC74_REG_CONFIG };
 static uint8_t tc74_config_write_wr[] = { TC74_REG_CONFIG, 0 };
 
-#define TC74_SETSTATE(data, state_new)					\
-	do								\
-		if (data->state != state_new) {			\
-			dprintf_P(PSTR_M("%S: *%S\n"), PSTR_M("tc74"),	\
-				  PSTR_M(#state_new));			\
-			data->state_changed = true;			\
-			tc74_set_state_do(data, state_new);		\
-		}							\
-	while (0)
-
-static bool tc74_is_i2c_transfer_state(tc74_data *data)
-{
-	return data->state == TC74_CONFIG_READ ||
-		data->state == TC74_CONFIG_WRITE ||
-		data->state == TC74_CONFIG_WRITE_CONFIG_READ ||
-		data->state == TC74_DATA_READY_CONFIG_READ ||
-		data->state == TC74_TEMP_READ;
-}
-
-static void tc74_set_state_do(tc74_data *data, tc74_states state_new)
-{
-	data->state = state_new;
-
-	if (data->state == TC74_CONFIG_READ_DO)
-		data->get_temp_result = false;
-	else if (data->state == TC74_DATA_READY_WAIT_INIT) {
-		const timestamp_interval poll_period =
-			TIMESTAMPI_FROM_MS(TC74_DATA_READY_POLL_PERIOD);
-
-		timestamp now;
-
-		timekeeping_now_timestamp(&now);
-		timestamp_add(&now, &poll_period, &data->next_data_ready_poll);
-
-		/* already did check once before we arrived in this state */
-		data->data_ready_polls = 1;
-	} else if (data->state == TC74_TEMP_READ_OK) {
-		data->get_temp_result = true;
-
-		dprintf_P(PSTR("tc74: temperature %"PRId8" dC\n"),
-			  data->temp);
-	}
-}
+/*
+ * the CONFIG and TEMP registers are read in one bus job, TEMP is only used
+ * if CONFIG (which is read first) says the data is ready
+ */
+#define TC74_CONFIG_TEMP_READ_LEN 2
 
 static void tc74_i2c_complete(void *data_v, bool success, uint8_t rdlen_actual)
 {
@@ -90,18 +59,40 @@ static void tc74_i2c_complete(void *data_v, bool success, uint8_t rdlen_actual)
 	data->i2c_trans_complete = true;
 	data->i2c_trans_success = success;
 	data->i2c_rdlen_actual = rdlen_actual;
+
+	coro_wake(&data->coro);
+}
+
+/* the completion is called from the main loop (i2c_poll()), not from an ISR */
+static bool tc74_i2c_trans_is_complete(tc74_data *data)
+{
+	return data->i2c_trans_complete;
 }
 
 static bool tc74_i2c_transaction(tc74_data *data,
-				 const uint8_t *wrbuf, uint8_t wrlen,
-				 uint8_t *rdbuf, uint8_t rdlen)
+				 const i2c_segment *segs, uint8_t segs_num)
 {
 	data->i2c_trans_complete = false;
 
-	return i2c_transaction(data->addr,
-			       wrbuf, wrlen,
-			       rdbuf, rdlen,
-			       tc74_i2c_complete, data);
+	return data->i2c_transaction(segs, segs_num, data->i2c_prio, NULL,
+				     tc74_i2c_complete, data);
+}
+
+static bool tc74_i2c_config_write(tc74_data *data)
+{
+	return tc74_i2c_transaction(data, &data->config_write_seg, 1);
+}
+
+static bool tc74_i2c_config_temp_read(tc74_data *data)
+{
+	return tc74_i2c_transaction(data, data->config_temp_read_segs,
+				    TC74_CONFIG_TEMP_READ_SEGS);
+}
+
+/* a receive byte, the register pointer has to be at TEMP already */
+static bool tc74_i2c_temp_read(tc74_data *data)
+{
+	return tc74_i2c_transaction(data, &data->temp_read_seg, 1);
 }
 
 bool tc74_get_temperature(tc74_data *data)
@@ -109,7 +100,7 @@ bool tc74_get_temperature(tc74_data *data)
 	if (tc74_is_busy(data))
 		return false;
 
-	TC74_SETSTATE(data, TC74_CONFIG_READ_DO);
+	coro_start(&data->coro);
 
 	return true;
 }
@@ -125,152 +116,214 @@ bool tc74_get_temperature_result(tc74_data *data, int8_t *temperature)
 	return true;
 }
 
+/* checks a completed CONFIG (and TEMP) registers read */
+static bool tc74_config_read_is_ok(tc74_data *data)
+{
+	if (!data->i2c_trans_success ||
+	    data->i2c_rdlen_actual != TC74_CONFIG_TEMP_READ_LEN)
+		return false;
+
+	if ((data->config & TC74_REG_CONFIG_ZERO_MASK) != 0) {
+		dprintf_P(PSTR("tc74: reserved bits set (%"PRIx8") in CONFIG\n"),
+			  data->config);
+
+		return false;
+	}
+
+	return true;
+}
+
+static bool tc74_config_is_standby(tc74_data *data)
+{
+	if ((data->config & TC74_REG_CONFIG_STANDBY) == 0)
+		return false;
+
+	dprintf_P(PSTR("tc74: STANDBY bit set (%"PRIx8") in CONFIG\n"),
+		  data->config);
+
+	return true;
+}
+
 void tc74_poll(tc74_data *data)
 {
-	data->state_changed = false;
-
-	if (data->state == TC74_CONFIG_READ_DO ||
-	    data->state == TC74_DATA_READY_CONFIG_READ_DO ||
-	    data->state == TC74_CONFIG_WRITE_CONFIG_READ_DO) {
-		if (!tc74_i2c_transaction(data,
-					  tc74_config_read_wr,
-					  sizeof(tc74_config_read_wr),
-					  &data->config, 1))
-			goto idle;
-
-		if (data->state == TC74_CONFIG_READ_DO)
-			TC74_SETSTATE(data, TC74_CONFIG_READ);
-		else if (data->state == TC74_DATA_READY_CONFIG_READ_DO)
-			TC74_SETSTATE(data, TC74_DATA_READY_CONFIG_READ);
-		else /* TC74_CONFIG_WRITE_CONFIG_READ_DO */
-			TC74_SETSTATE(data, TC74_CONFIG_WRITE_CONFIG_READ);
-	} else if (data->state == TC74_CONFIG_READ ||
-		   data->state == TC74_DATA_READY_CONFIG_READ ||
-		   data->state == TC74_CONFIG_WRITE_CONFIG_READ) {
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-			_MemoryBarrier();
-
-			if (!data->i2c_trans_complete)
-				return;
-
-			_MemoryBarrier();
-		}
+	const timestamp_interval poll_period =
+		TIMESTAMPI_FROM_MS(TC74_DATA_READY_POLL_PERIOD);
 
-		if (!data->i2c_trans_success || data->i2c_rdlen_actual != 1)
-			goto idle;
+	CORO_BEGIN(&data->coro);
 
-		if ((data->config & TC74_REG_CONFIG_ZERO_MASK) != 0) {
-			dprintf_P(PSTR("tc74: reserved bits set (%"PRIx8") in CONFIG\n"),
-				  data->config);
+	data->get_temp_result = false;
 
-			goto idle;
+	if (data->fast_reads_left > 0) {
+		/* any failure means a full read next time */
+		data->fast_reads_left--;
+
+		if (!tc74_i2c_temp_read(data)) {
+			data->fast_reads_left = 0;
+			CORO_EXIT(&data->coro);
 		}
 
-		if ((data->config & TC74_REG_CONFIG_STANDBY) != 0) {
-			dprintf_P(PSTR("tc74: STANDBY bit set (%"PRIx8") in CONFIG\n"),
-				  data->config);
+		CORO_WAIT_FOR(&data->coro, tc74_i2c_trans_is_complete(data));
 
-			if (data->state != TC74_CONFIG_READ)
-				goto idle;
+		if (!data->i2c_trans_success || data->i2c_rdlen_actual != 1) {
+			data->fast_reads_left = 0;
+			CORO_EXIT(&data->coro);
+		}
 
-			if (!tc74_i2c_transaction(data,
-						  tc74_config_write_wr,
-						  sizeof(tc74_config_write_wr),
-						  NULL, 0))
-				goto idle;
+		data->get_temp_result = true;
 
-			TC74_SETSTATE(data, TC74_CONFIG_WRITE);
-			return;
-		}
+		dprintf_P(PSTR("tc74: temperature %"PRId8" dC\n"),
+			  data->temp);
 
-		if (!(data->config & TC74_REG_CONFIG_DATA_READY)) {
-			if (data->state == TC74_DATA_READY_CONFIG_READ) {
-				if (++data->data_ready_polls >=
-				    TC74_DATA_READY_POLL_COUNT)
-					goto idle;
+		CORO_EXIT(&data->coro);
+	}
 
-				TC74_SETSTATE(data, TC74_DATA_READY_WAIT);
-			} else
-				TC74_SETSTATE(data, TC74_DATA_READY_WAIT_INIT);
+	if (!tc74_i2c_config_temp_read(data))
+		CORO_EXIT(&data->coro);
 
-			return;
-		}
+	CORO_WAIT_FOR(&data->coro, tc74_i2c_trans_is_complete(data));
+
+	if (!tc74_config_read_is_ok(data))
+		CORO_EXIT(&data->coro);
 
-		if (!tc74_i2c_transaction(data,
-					  tc74_temp_read_wr,
-					  sizeof(tc74_temp_read_wr),
-					  (uint8_t *)&data->temp, 1))
-			goto idle;
+	if (tc74_config_is_standby(data)) {
+		if (!tc74_i2c_config_write(data))
+			CORO_EXIT(&data->coro);
 
-		TC74_SETSTATE(data, TC74_TEMP_READ);
-	} else if (data->state == TC74_DATA_READY_WAIT_INIT)
-		TC74_SETSTATE(data, TC74_DATA_READY_WAIT);
-	else if (data->state == TC74_DATA_READY_WAIT) {
-		const timestamp_interval poll_period =
-			TIMESTAMPI_FROM_MS(TC74_DATA_READY_POLL_PERIOD);
+		CORO_WAIT_FOR(&data->coro, tc74_i2c_trans_is_complete(data));
 
+		if (!data->i2c_trans_success)
+			CORO_EXIT(&data->coro);
+
+		if (!tc74_i2c_config_temp_read(data))
+			CORO_EXIT(&data->coro);
+
+		CORO_WAIT_FOR(&data->coro, tc74_i2c_trans_is_complete(data));
+
+		if (!tc74_config_read_is_ok(data) ||
+		    tc74_config_is_standby(data))
+			CORO_EXIT(&data->coro);
+	}
+
+	if (!(data->config & TC74_REG_CONFIG_DATA_READY)) {
 		timestamp now;
 
 		timekeeping_now_timestamp(&now);
-		if (timestamp_temporal_cmp(&now, &data->next_data_ready_poll,
-					   <))
-			return;
-
 		timestamp_add(&now, &poll_period, &data->next_data_ready_poll);
 
-		TC74_SETSTATE(data, TC74_DATA_READY_CONFIG_READ_DO);
-	} else if (data->state == TC74_CONFIG_WRITE) {
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-			_MemoryBarrier();
+		/* already did check once before we arrived here */
+		data->data_ready_polls = 1;
 
-			if (!data->i2c_trans_complete)
-				return;
+		do {
+			CORO_WAIT_UNTIL(&data->coro, &data->next_data_ready_poll);
 
-			_MemoryBarrier();
-		}
+			timekeeping_now_timestamp(&now);
+			timestamp_add(&now, &poll_period,
+				      &data->next_data_ready_poll);
 
-		if (!data->i2c_trans_success)
-			goto idle;
+			if (!tc74_i2c_config_temp_read(data))
+				CORO_EXIT(&data->coro);
 
-		TC74_SETSTATE(data, TC74_CONFIG_WRITE_CONFIG_READ_DO);
-	} else if (data->state == TC74_TEMP_READ) {
-		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-			_MemoryBarrier();
+			CORO_WAIT_FOR(&data->coro,
+				      tc74_i2c_trans_is_complete(data));
 
-			if (!data->i2c_trans_complete)
-				return;
+			if (!tc74_config_read_is_ok(data) ||
+			    tc74_config_is_standby(data))
+				CORO_EXIT(&data->coro);
 
-			_MemoryBarrier();
-		}
+			if (data->config & TC74_REG_CONFIG_DATA_READY)
+				break;
+		} while (++data->data_ready_polls < TC74_DATA_READY_POLL_COUNT);
 
-		if (!data->i2c_trans_success || data->i2c_rdlen_actual != 1)
-			goto idle;
+		if (!(data->config & TC74_REG_CONFIG_DATA_READY))
+			CORO_EXIT(&data->coro);
+	}
 
-		TC74_SETSTATE(data, TC74_TEMP_READ_OK);
-	} else if (data->state == TC74_TEMP_READ_OK)
-		goto idle;
+	/*
+	 * TEMP was read right after a CONFIG with the data ready bit set,
+	 * the register pointer stays at TEMP for the fast reads
+	 */
+	data->get_temp_result = true;
+	data->fast_reads_left = TC74_FAST_READS;
 
-	return;
+	dprintf_P(PSTR("tc74: temperature %"PRId8" dC\n"), data->temp);
 
-idle:
-	TC74_SETSTATE(data, TC74_IDLE);
+	CORO_END(&data->coro);
 }
 
-void tc74_get_next_poll_time(tc74_data *data, timestamp *next_poll)
+void tc74_init(tc74_data *data, i2c_transaction_fun i2c_transaction,
+	       uint8_t addr, i2c_priorities i2c_prio, uint8_t pending_flag)
 {
-	if (data->state_changed || (tc74_is_i2c_transfer_state(data) &&
-				    data->i2c_trans_complete))
-		timekeeping_now_timestamp(next_poll);
-	else if (data->state == TC74_DATA_READY_WAIT)
-		*next_poll = data->next_data_ready_poll;
-	else
-		timekeeping_timestamp_max_future(next_poll);
+	data->i2c_transaction = i2c_transaction;
+	data->addr = addr;
+	data->i2c_prio = i2c_prio;
+
+	data->get_temp_result = false;
+	data->fast_reads_left = 0;
+
+	for (uint8_t ctr = 0; ctr < TC74_CONFIG_TEMP_READ_SEGS; ctr++)
+		data->config_temp_read_segs[ctr].addr = addr;
+
+	data->config_temp_read_segs[0].read = false;
+	data->config_temp_read_segs[0].buf = tc74_config_read_wr;
+	data->config_temp_read_segs[0].len = sizeof(tc74_config_read_wr);
+
+	data->config_temp_read_segs[1].read = true;
+	data->config_temp_read_segs[1].buf = &data->config;
+	data->config_temp_read_segs[1].len = 1;
+
+	data->config_temp_read_segs[2].read = false;
+	data->config_temp_read_segs[2].buf = tc74_temp_read_wr;
+	data->config_temp_read_segs[2].len = sizeof(tc74_temp_read_wr);
+
+	data->config_temp_read_segs[3].read = true;
+	data->config_temp_read_segs[3].buf = (uint8_t *)&data->temp;
+	data->config_temp_read_segs[3].len = 1;
+
+	data->temp_read_seg.addr = addr;
+	data->temp_read_seg.read = true;
+	data->temp_read_seg.buf = (uint8_t *)&data->temp;
+	data->temp_read_seg.len = 1;
+
+	data->config_write_seg.addr = addr;
+	data->config_write_seg.read = false;
+	data->config_write_seg.buf = tc74_config_write_wr;
+	data->config_write_seg.len = sizeof(tc74_config_write_wr);
+
+	coro_init(&data->coro, pending_flag);
 }
 
-void tc74_init(tc74_data *data, uint8_t addr)
+static bool tc74_ops_get_temperature(void *data)
 {
-	data->addr = addr;
+	return tc74_get_temperature(data);
+}
 
-	data->state = TC74_IDLE;
-	data->state_changed = false;
+static bool tc74_ops_is_busy(void *data)
+{
+	return tc74_is_busy(data);
 }
+
+static bool tc74_ops_get_temperature_result(void *data,
+					    tempsensor_temp *temperature)
+{
+	int8_t temp;
+
+	if (!tc74_get_temperature_result(data, &temp))
+		return false;
+
+	if (temperature != NULL)
+		*temperature = TEMPSENSOR_FROM_DEG(temp);
+
+	return true;
+}
+
+static void tc74_ops_poll(void *data)
+{
+	tc74_poll(data);
+}
+
+const tempsensor_ops tc74_ops = {
+	.get_temperature = tc74_ops_get_temperature,
+	.is_busy = tc74_ops_is_busy,
+	.get_temperature_result = tc74_ops_get_temperature_result,
+	.poll = tc74_ops_poll,
+};
@@ -15,20 +15,20 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "coro.h"
+#include "i2c.h"
+#include "tempsensor.h"
 #include "timekeeping.h"
 
-typedef enum { TC74_IDLE, TC74_CONFIG_READ_DO, TC74_CONFIG_READ,
-	       TC74_CONFIG_WRITE,
-	       TC74_CONFIG_WRITE_CONFIG_READ_DO, TC74_CONFIG_WRITE_CONFIG_READ,
-	       TC74_DATA_READY_WAIT_INIT, TC74_DATA_READY_WAIT,
-	       TC74_DATA_READY_CONFIG_READ_DO, TC74_DATA_READY_CONFIG_READ,
-	       TC74_TEMP_READ, TC74_TEMP_READ_OK } tc74_states;
+/* CONFIG register write + read, TEMP register write + read */
+#define TC74_CONFIG_TEMP_READ_SEGS 4
 
 typedef struct {
+	i2c_transaction_fun i2c_transaction;
 	uint8_t addr;
+	/* i2c_priorities */ uint8_t i2c_prio;
 
-	/* tc74_states */ uint8_t state;
-	bool state_changed;
+	coro coro;
 
 	bool i2c_trans_complete;
 	bool i2c_trans_success;
@@ -39,19 +39,25 @@ typedef struct {
 
 	bool get_temp_result;
 
+	/* reads left that can skip CONFIG (the register pointer is at TEMP) */
+	uint8_t fast_reads_left;
+
 	uint8_t config;
 	int8_t temp;
+
+	i2c_segment config_temp_read_segs[TC74_CONFIG_TEMP_READ_SEGS];
+	i2c_segment temp_read_seg;
+	i2c_segment config_write_seg;
 } tc74_data;
 
 /*
  * check if given tc74 instance is busy
  * busy status won't change if interrupts are disabled and no other
- * functions on this instance are called (other than read-only ones like
- * tc74_get_next_poll_time())
+ * functions on this instance are called
  */
 static inline bool tc74_is_busy(tc74_data *data)
 {
-	return data->state != TC74_IDLE;
+	return coro_is_running(&data->coro);
 }
 
 /*
@@ -62,6 +68,10 @@ static inline bool tc74_is_busy(tc74_data *data)
  * if the function returned true then the caller should wait until
  * this instance is no longer busy, then could get the result of
  * the read via tc74_get_temperature_result()
+ *
+ * a read checks CONFIG (and wakes the sensor up from standby or waits for
+ * its data if needed) before reading TEMP, but after a successful one
+ * the next few reads only read TEMP, a single byte, until a read fails
  */
 bool tc74_get_temperature(tc74_data *data);
 
@@ -73,24 +83,24 @@ bool tc74_get_temperature_result(tc74_data *data, int8_t *temperature);
 
 /*
  * should be called from time to time on each instance
- * (at least when the time returned by tc74_get_next_poll_time() comes)
+ * (at least when this instance scheduler timer deadline comes)
  */
 void tc74_poll(tc74_data *data);
 
-/*
- * should be called with interrupts disabled because enabling interrupts at any
- * time later invalidates the returned value
- *
- * this function doesn't change any internal state (it is purely read-only)
- */
-void tc74_get_next_poll_time(tc74_data *data, timestamp *next_poll);
-
 /*
  * init an tc74 instance: must be called before any other tc74 function
- * on this instance.
- * data is a caller-allocated variable, addr is an i2c address of this instance
+ * on this instance, must be called with interrupts disabled.
+ * data is a caller-allocated variable, i2c_transaction queues transactions on
+ * the bus this instance is on (like i2c_transaction_segments_prio()),
+ * addr is an i2c address of this instance,
+ * i2c_prio is the i2c transaction class of its bus traffic,
+ * pending_flag is the pending work flag of the module polling this instance
  */
 
-void tc74_init(tc74_data *data, uint8_t addr);
+void tc74_init(tc74_data *data, i2c_transaction_fun i2c_transaction,
+	       uint8_t addr, i2c_priorities i2c_prio, uint8_t pending_flag);
+
+/* the tc74 functions above as a tempsensor driver, data is a tc74_data */
+extern const tempsensor_ops tc74_ops;
 
 #endif
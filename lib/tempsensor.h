@@ -0,0 +1,97 @@
+/*
+ * AVR Library: temperature sensor driver interface
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _LIB_TEMPSENSOR_H_
+#define _LIB_TEMPSENSOR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * a temperature in 1/256 °C (two's complement, so from -128 °C to almost
+ * +128 °C), the LM75 TEMP register format
+ */
+typedef int16_t tempsensor_temp;
+
+#define TEMPSENSOR_FRAC_BITS 8
+
+#define TEMPSENSOR_FROM_DEG(deg)				\
+	((tempsensor_temp)((int16_t)(deg) * (1 << TEMPSENSOR_FRAC_BITS)))
+
+/* rounded to the nearest whole degree */
+static inline int8_t tempsensor_to_deg(tempsensor_temp temp)
+{
+	if (temp >= TEMPSENSOR_FROM_DEG(INT8_MAX))
+		return INT8_MAX;
+
+	return (temp + (1 << (TEMPSENSOR_FRAC_BITS - 1))) >>
+		TEMPSENSOR_FRAC_BITS;
+}
+
+/*
+ * what a sensor driver provides, each function gets the driver instance data
+ * given with the ops (see tempsensor)
+ *
+ * get_temperature - start a temperature read, returns false if the instance
+ * is busy (or the read couldn't be started)
+ * is_busy - whether a read is in progress
+ * get_temperature_result - the result of the last finished read, returns
+ * false if it failed
+ * poll - should be called from time to time on each instance (at least when
+ * its scheduler timer deadline comes), drives the read
+ *
+ * a driver schedules its own polls (so it needs no "next poll time" function):
+ * it arms scheduler timers registered with the pending work flag of
+ * the module polling it, given to the driver init function, which keeps
+ * sched_get_next_poll_time() up to date
+ */
+typedef struct {
+	bool (*get_temperature)(void *data);
+	bool (*is_busy)(void *data);
+	bool (*get_temperature_result)(void *data, tempsensor_temp *temp);
+	void (*poll)(void *data);
+} tempsensor_ops;
+
+/* a sensor: a driver instance, caller-allocated */
+typedef struct {
+	const tempsensor_ops *ops;
+	void *data;
+} tempsensor;
+
+static inline void tempsensor_init(tempsensor *sensor,
+				   const tempsensor_ops *ops, void *data)
+{
+	sensor->ops = ops;
+	sensor->data = data;
+}
+
+static inline bool tempsensor_get_temperature(const tempsensor *sensor)
+{
+	return sensor->ops->get_temperature(sensor->data);
+}
+
+static inline bool tempsensor_is_busy(const tempsensor *sensor)
+{
+	return sensor->ops->is_busy(sensor->data);
+}
+
+static inline bool tempsensor_get_temperature_result(const tempsensor *sensor,
+						     tempsensor_temp *temp)
+{
+	return sensor->ops->get_temperature_result(sensor->data, temp);
+}
+
+static inline void tempsensor_poll(const tempsensor *sensor)
+{
+	sensor->ops->poll(sensor->data);
+}
+
+#endif
@@ -12,41 +12,379 @@
 #include <avr/interrupt.h>
 #include <avr/power.h>
 
+#include "critprof.h"
 #include "timekeeping.h"
 
+/*
+ * how many timer counts in advance the timer period end or the alarm need to
+ * be programmed (needs to cover the time it takes to do that)
+ */
+#ifndef TIMEKEEPING_CLOCK_SCALING
+#define TIMEKEEPING_REPROGRAM_MARGIN (512 / TIMEKEEPING_DIV + 2)
+#else
+/* programming takes TIMEKEEPING_CLOCK_SCALING_DIV times longer when scaled */
+#define TIMEKEEPING_REPROGRAM_MARGIN					\
+	(timekeeping_clock_scaled ?					\
+	 512 * TIMEKEEPING_CLOCK_SCALING_DIV / TIMEKEEPING_DIV + 2 :	\
+	 512 / TIMEKEEPING_DIV + 2)
+#endif
+
+#define TIMEKEEPING_TIMER_CS_MASK (_BV(CS30) | _BV(CS31) | _BV(CS32))
+
+#if TIMEKEEPING_DIV == 1
+#define TIMEKEEPING_TIMER_CS _BV(CS30)
+#elif TIMEKEEPING_DIV == 8
+#define TIMEKEEPING_TIMER_CS _BV(CS31)
+#elif TIMEKEEPING_DIV == 64
+#define TIMEKEEPING_TIMER_CS (_BV(CS30) | _BV(CS31))
+#elif TIMEKEEPING_DIV == 256
+#define TIMEKEEPING_TIMER_CS _BV(CS32)
+#elif TIMEKEEPING_DIV == 1024
+#define TIMEKEEPING_TIMER_CS (_BV(CS32) | _BV(CS30))
+#else
+#error unknown TIMEKEEPING_DIV value
+#endif
+
+#ifdef TIMEKEEPING_CLOCK_SCALING
+#if TIMEKEEPING_DIV % TIMEKEEPING_CLOCK_SCALING_DIV != 0
+#error TIMEKEEPING_DIV not divisible by TIMEKEEPING_CLOCK_SCALING_DIV
+#endif
+
+/* the timer prescaler value when the system clock is divided */
+#define TIMEKEEPING_SCALED_DIV (TIMEKEEPING_DIV / TIMEKEEPING_CLOCK_SCALING_DIV)
+
+#if TIMEKEEPING_SCALED_DIV == 1
+#define TIMEKEEPING_SCALED_TIMER_CS _BV(CS30)
+#elif TIMEKEEPING_SCALED_DIV == 8
+#define TIMEKEEPING_SCALED_TIMER_CS _BV(CS31)
+#elif TIMEKEEPING_SCALED_DIV == 64
+#define TIMEKEEPING_SCALED_TIMER_CS (_BV(CS30) | _BV(CS31))
+#elif TIMEKEEPING_SCALED_DIV == 256
+#define TIMEKEEPING_SCALED_TIMER_CS _BV(CS32)
+#else
+#error TIMEKEEPING_DIV / TIMEKEEPING_CLOCK_SCALING_DIV is not a timer prescaler value
+#endif
+
+#if TIMEKEEPING_CLOCK_SCALING_DIV == 2
+#define TIMEKEEPING_SCALED_CLOCK_DIV clock_div_2
+#elif TIMEKEEPING_CLOCK_SCALING_DIV == 4
+#define TIMEKEEPING_SCALED_CLOCK_DIV clock_div_4
+#elif TIMEKEEPING_CLOCK_SCALING_DIV == 8
+#define TIMEKEEPING_SCALED_CLOCK_DIV clock_div_8
+#elif TIMEKEEPING_CLOCK_SCALING_DIV == 16
+#define TIMEKEEPING_SCALED_CLOCK_DIV clock_div_16
+#elif TIMEKEEPING_CLOCK_SCALING_DIV == 32
+#define TIMEKEEPING_SCALED_CLOCK_DIV clock_div_32
+#elif TIMEKEEPING_CLOCK_SCALING_DIV == 64
+#define TIMEKEEPING_SCALED_CLOCK_DIV clock_div_64
+#elif TIMEKEEPING_CLOCK_SCALING_DIV == 128
+#define TIMEKEEPING_SCALED_CLOCK_DIV clock_div_128
+#else
+#error unknown TIMEKEEPING_CLOCK_SCALING_DIV value
+#endif
+
+static bool timekeeping_clock_scaled;
+#endif
+
 uint32_t timekeeping_ticks;
 
-ISR(TIMER3_COMPA_vect)
+#ifdef TIMEKEEPING_FLAT_TIMESTAMPS
+/* timer counts at the current timer period start */
+uint32_t timekeeping_counts_base;
+#endif
+
+#ifdef TIMEKEEPING_TICKLESS
+/* how many ticks the current timer period spans */
+static uint8_t timekeeping_period_ticks;
+#endif
+
+/*
+ * bumped at every timer period end so timekeeping_now_timestamp() can notice
+ * that the variables above changed while it was reading them
+ */
+static volatile uint8_t timekeeping_generation;
+
+static void timekeeping_period_end_atomic(void)
 {
+	timekeeping_generation++;
+
+#ifndef TIMEKEEPING_TICKLESS
 	timekeeping_ticks++;
+#ifdef TIMEKEEPING_FLAT_TIMESTAMPS
+	timekeeping_counts_base += timekeeping_counts_per_tick();
+#endif
+#else
+	timekeeping_ticks += timekeeping_period_ticks;
+#ifdef TIMEKEEPING_FLAT_TIMESTAMPS
+	timekeeping_counts_base += (uint32_t)OCR3A + 1;
+#endif
+#endif
 }
 
-void timekeeping_now_timestamp(timestamp *out)
+ISR(TIMER3_COMPA_vect)
 {
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		_MemoryBarrier();
+	timekeeping_period_end_atomic();
+}
 
-		while (1) {
-			if (bit_is_set(TIFR3, OCF3A)) {
-				timekeeping_ticks++;
+/* the alarm is one-shot, it just wakes the µC up */
+ISR(TIMER3_COMPB_vect)
+{
+	TIMSK3 &= ~_BV(OCIE3B);
+}
 
-				TIFR3 = _BV(OCF3A);
-			}
+static void timekeeping_make_timestamp(uint32_t base, uint16_t counts,
+				       timestamp *out)
+{
+#ifndef TIMEKEEPING_FLAT_TIMESTAMPS
+#ifdef TIMEKEEPING_TICKLESS
+	/* a timer period can span many ticks */
+	base += counts / timekeeping_counts_per_tick();
+	counts %= timekeeping_counts_per_tick();
+#endif
 
-			out->counts = TCNT3;
+	out->ticks = base;
+	out->counts = counts;
+#else
+	out->counts = base + counts;
+#endif
+}
 
-			if (bit_is_set(TIFR3, OCF3A))
-				continue;
+static uint32_t timekeeping_period_base(void)
+{
+#ifndef TIMEKEEPING_FLAT_TIMESTAMPS
+	return timekeeping_ticks;
+#else
+	return timekeeping_counts_base;
+#endif
+}
 
-			out->ticks = timekeeping_ticks;
+void timekeeping_now_timestamp_atomic(timestamp *out)
+{
+	/* ticks or timer counts at the current timer period start */
+	uint32_t base;
+	uint16_t counts;
 
-			break;
+	_MemoryBarrier();
+
+	while (1) {
+		if (bit_is_set(TIFR3, OCF3A)) {
+			timekeeping_period_end_atomic();
+
+			TIFR3 = _BV(OCF3A);
 		}
 
+		counts = TCNT3;
+
+		if (bit_is_set(TIFR3, OCF3A))
+			continue;
+
+		base = timekeeping_period_base();
+
+		break;
+	}
+
+	_MemoryBarrier();
+
+	timekeeping_make_timestamp(base, counts, out);
+}
+
+void timekeeping_now_timestamp(timestamp *out)
+{
+	uint32_t base;
+	uint16_t counts;
+
+	/* the retry loop below needs the period interrupt to be serviced */
+	if (bit_is_clear(SREG, SREG_I)) {
+		timekeeping_now_timestamp_atomic(out);
+		return;
+	}
+
+	while (1) {
+		uint8_t generation = timekeeping_generation;
+
 		_MemoryBarrier();
+		base = timekeeping_period_base();
+		_MemoryBarrier();
+
+		/*
+		 * ISRs can read the timer too, which would overwrite
+		 * the shared high byte temp register in the middle of our
+		 * read
+		 */
+		CRITPROF_ATOMIC_BLOCK(ATOMIC_FORCEON) {
+			counts = TCNT3;
+		}
+
+		/*
+		 * the period has just ended, but its interrupt hasn't been
+		 * serviced yet - it will be in a moment
+		 */
+		if (bit_is_set(TIFR3, OCF3A))
+			continue;
+
+		if (generation == timekeeping_generation)
+			break;
 	}
+
+	timekeeping_make_timestamp(base, counts, out);
 }
 
+#ifdef TIMEKEEPING_TICKLESS
+#define TIMEKEEPING_TICKLESS_PERIOD_MAX_TICKS			\
+	((uint32_t)TIMEKEEPING_TICKLESS_PERIOD_MAX * TIMEKEEPING_HZ / 1000)
+
+static uint8_t timekeeping_max_period_ticks(void)
+{
+	uint32_t ticks = ((uint32_t)UINT16_MAX + 1) /
+		timekeeping_counts_per_tick();
+
+	_Static_assert(TIMEKEEPING_TICKLESS_PERIOD_MAX_TICKS >= 1 &&
+		       TIMEKEEPING_TICKLESS_PERIOD_MAX_TICKS <= UINT8_MAX,
+		       "TIMEKEEPING_TICKLESS_PERIOD_MAX out of range");
+
+	if (ticks > TIMEKEEPING_TICKLESS_PERIOD_MAX_TICKS)
+		ticks = TIMEKEEPING_TICKLESS_PERIOD_MAX_TICKS;
+
+	return ticks;
+}
+#endif
+
+#ifdef TIMEKEEPING_TICKLESS
+static void timekeeping_set_period_atomic(uint8_t wakeup_ticks,
+					  uint16_t counts)
+{
+	uint16_t top = OCR3A;
+
+	/*
+	 * the current period is about to end anyway, its interrupt will
+	 * wake us up and we will get called again then
+	 */
+	if (top - counts < TIMEKEEPING_REPROGRAM_MARGIN)
+		return;
+
+	/* the earliest tick boundary that can still be safely programmed */
+	uint8_t period_min = (counts + TIMEKEEPING_REPROGRAM_MARGIN) /
+		timekeeping_counts_per_tick() + 1;
+	uint8_t period_max = timekeeping_max_period_ticks();
+	uint8_t period;
+
+	if (wakeup_ticks >= period_max)
+		period = period_max;
+	else if (wakeup_ticks < period_min)
+		period = period_min;
+	else
+		period = wakeup_ticks;
+
+	timekeeping_period_ticks = period;
+	OCR3A = (uint16_t)((uint32_t)period * timekeeping_counts_per_tick() -
+			   1);
+}
+#endif
+
+/*
+ * returns when next_wakeup comes relative to the current timer period start
+ * (in whole ticks, saturated at UINT8_MAX, and counts within the last tick),
+ * or false if it is in the past
+ */
+static bool timekeeping_wakeup_rel_atomic(const timestamp *next_wakeup,
+					  uint8_t *wakeup_ticks,
+					  uint16_t *wakeup_counts)
+{
+#ifndef TIMEKEEPING_FLAT_TIMESTAMPS
+	uint32_t ticks = next_wakeup->ticks - timekeeping_ticks;
+	if (ticks > UINT32_MAX / 2)
+		return false;
+
+	*wakeup_ticks = ticks <= UINT8_MAX ? ticks : UINT8_MAX;
+	*wakeup_counts = next_wakeup->counts;
+#else
+	uint32_t counts = next_wakeup->counts - timekeeping_counts_base;
+	if (counts > UINT32_MAX / 2)
+		return false;
+
+	if (counts >= (uint32_t)UINT8_MAX * timekeeping_counts_per_tick()) {
+		*wakeup_ticks = UINT8_MAX;
+		*wakeup_counts = 0;
+	} else {
+		*wakeup_ticks = counts / timekeeping_counts_per_tick();
+		*wakeup_counts = counts % timekeeping_counts_per_tick();
+	}
+#endif
+
+	return true;
+}
+
+bool timekeeping_set_next_wakeup_atomic(const timestamp *next_wakeup)
+{
+	uint8_t period_ticks;
+
+	if (bit_is_set(TIFR3, OCF3A)) {
+		timekeeping_period_end_atomic();
+
+		TIFR3 = _BV(OCF3A);
+	}
+
+	TIMSK3 &= ~_BV(OCIE3B);
+
+	uint16_t counts = TCNT3;
+
+	uint8_t wakeup_ticks;
+	uint16_t wakeup_counts;
+	if (!timekeeping_wakeup_rel_atomic(next_wakeup, &wakeup_ticks,
+					   &wakeup_counts))
+		return false;
+
+#ifndef TIMEKEEPING_TICKLESS
+	period_ticks = 1;
+#else
+	timekeeping_set_period_atomic(wakeup_ticks, counts);
+	period_ticks = timekeeping_period_ticks;
+#endif
+
+	/* the end of the current period comes first and will wake us up */
+	if (wakeup_ticks >= period_ticks)
+		return true;
+
+	wakeup_counts += wakeup_ticks * timekeeping_counts_per_tick();
+	if ((uint32_t)wakeup_counts < (uint32_t)counts +
+	    TIMEKEEPING_REPROGRAM_MARGIN)
+		return false;
+
+	OCR3B = wakeup_counts;
+	TIFR3 = _BV(OCF3B);
+	TIMSK3 |= _BV(OCIE3B);
+
+	return true;
+}
+
+#ifdef TIMEKEEPING_CLOCK_SCALING
+bool timekeeping_clock_is_scaled(void)
+{
+	return timekeeping_clock_scaled;
+}
+
+void timekeeping_clock_scale_atomic(bool scaled)
+{
+	if (scaled == timekeeping_clock_scaled)
+		return;
+
+	uint8_t tccr3b = TCCR3B & ~TIMEKEEPING_TIMER_CS_MASK;
+	if (scaled)
+		tccr3b |= TIMEKEEPING_SCALED_TIMER_CS;
+	else
+		tccr3b |= TIMEKEEPING_TIMER_CS;
+
+	/*
+	 * back to back, so the timer runs at a wrong rate for as few cycles
+	 * as possible
+	 */
+	clock_prescale_set(scaled ? TIMEKEEPING_SCALED_CLOCK_DIV : clock_div_1);
+	TCCR3B = tccr3b;
+
+	timekeeping_clock_scaled = scaled;
+}
+#endif
+
 static uint16_t timekeeping_calc_timer_top(void)
 {
 	uint16_t top;
@@ -60,7 +398,7 @@ void timekeeping_setup(void)
 {
 	power_timer3_enable();
 
-	TCCR3B &= ~(_BV(CS30) | _BV(CS31) | _BV(CS32));
+	TCCR3B &= ~TIMEKEEPING_TIMER_CS_MASK;
 	TIMSK3 &= ~(_BV(ICIE3) | _BV(OCIE3B) | _BV(OCIE3A) | _BV(TOIE3));
 	TCCR3A &= ~(_BV(COM3A1) | _BV(COM3A0) | _BV(COM3B1) | _BV(COM3B0) |
 		    _BV(WGM31) | _BV(WGM30));
@@ -73,23 +411,22 @@ void timekeeping_setup(void)
 	 */
 	timekeeping_ticks = UINT32_MAX - (3 * 60 * TIMEKEEPING_HZ -
 					  3 * TIMEKEEPING_HZ);
+#ifdef TIMEKEEPING_FLAT_TIMESTAMPS
+	timekeeping_counts_base = (uint32_t)0 -
+		(uint32_t)(3 * 60 - 3) * TIMEKEEPING_HZ *
+		timekeeping_counts_per_tick();
+#endif
 	TCNT3 = 0;
 	OCR3A = timekeeping_calc_timer_top();
+#ifdef TIMEKEEPING_TICKLESS
+	timekeeping_period_ticks = 1;
+#endif
+#ifdef TIMEKEEPING_CLOCK_SCALING
+	timekeeping_clock_scaled = false;
+#endif
 
 	TIFR3 = _BV(OCF3A);
 	TIMSK3 |= _BV(OCIE3A);
 
-#if TIMEKEEPING_DIV == 1
-	TCCR3B |= _BV(CS30);
-#elif TIMEKEEPING_DIV == 8
-	TCCR3B |= _BV(CS31);
-#elif TIMEKEEPING_DIV == 64
-	TCCR3B |= _BV(CS30) | _BV(CS31);
-#elif TIMEKEEPING_DIV == 256
-	TCCR3B |= _BV(CS32);
-#elif TIMEKEEPING_DIV == 1024
-	TCCR3B |= _BV(CS32) | _BV(CS30);
-#else
-#error unknown TIMEKEEPING_DIV value
-#endif
+	TCCR3B |= TIMEKEEPING_TIMER_CS;
 }
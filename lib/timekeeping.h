@@ -19,6 +19,8 @@
 #include <avr/io.h>
 #include <util/atomic.h>
 
+#include "critprof.h"
+
 /*
  * HZ, that is, ticks per second
  * must be <= 1000
@@ -35,6 +37,60 @@
 /* define to allow inexact timer frequency */
 /* #define TIMEKEEPING_ALLOW_INEXACT_FREQ */
 
+/*
+ * define to enable the tickless mode: the timekeeping timer period interrupt
+ * then doesn't fire on every tick but only at the tick boundary programmed by
+ * timekeeping_set_next_wakeup_atomic() (or when the longest timer period ends,
+ * whichever is earlier)
+ *
+ * the longest timer period is 65536 timer counts, so a high TIMEKEEPING_DIV
+ * value is needed for it to span many ticks
+ */
+/* #define TIMEKEEPING_TICKLESS */
+
+/*
+ * the longest tickless timer period (in ms), the µC can sleep through a whole
+ * one, so it must be well below the watchdog timeout
+ */
+#ifndef TIMEKEEPING_TICKLESS_PERIOD_MAX
+#define TIMEKEEPING_TICKLESS_PERIOD_MAX 2000
+#endif
+
+/*
+ * define to use flat timestamps: a single 32-bit count of timer counts
+ * instead of separate ticks and counts within a tick
+ *
+ * this makes timestamp arithmetic and comparisons much cheaper but
+ * the timestamps wrap around much sooner - at TIMEKEEPING_DIV of 64 every
+ * ~10 hours (every ~7 days at TIMEKEEPING_DIV of 1024), so the longest
+ * interval that can be temporally compared is half of that
+ *
+ * intervals made by TIMESTAMPI_FROM_MS() can only be a quarter of
+ * the wraparound period long (~2.5 hours at TIMEKEEPING_DIV of 64, see
+ * TIMESTAMP_FLAT_INTERVAL_MAX_MS), so a deadline that far away still compares
+ * correctly when it is checked up to the same time late
+ */
+/* #define TIMEKEEPING_FLAT_TIMESTAMPS */
+
+/*
+ * define to support dividing the system clock by
+ * TIMEKEEPING_CLOCK_SCALING_DIV (a power of two) while idle, see
+ * timekeeping_clock_scale_atomic()
+ *
+ * TIMEKEEPING_DIV / TIMEKEEPING_CLOCK_SCALING_DIV must be a valid timer
+ * prescaler value
+ */
+/* #define TIMEKEEPING_CLOCK_SCALING */
+
+#if defined(TIMEKEEPING_CLOCK_SCALING) && !defined(TIMEKEEPING_CLOCK_SCALING_DIV)
+#if TIMEKEEPING_DIV == 1024
+#define TIMEKEEPING_CLOCK_SCALING_DIV 4
+#else
+#define TIMEKEEPING_CLOCK_SCALING_DIV 8
+#endif
+#endif
+
+#ifndef TIMEKEEPING_FLAT_TIMESTAMPS
 /* absolute timestamp */
 typedef struct {
 	uint32_t ticks;
@@ -67,8 +123,63 @@ typedef struct {
 			timekeeping_counts_per_tick()			\
 	}
 
-/* don't directly use this variable */
+/* max input UINT32_MAX timer counts */
+#define TIMESTAMPI_FROM_COUNTS(value)					\
+	{								\
+		.ticks = (uint32_t)(value) /				\
+			timekeeping_counts_per_tick(),			\
+		.counts = (uint32_t)(value) %				\
+			timekeeping_counts_per_tick()			\
+	}
+#else
+/* absolute timestamp */
+typedef struct {
+	uint32_t counts;
+} timestamp;
+
+/* interval (relative timestamp) */
+typedef struct {
+	uint32_t counts;
+} timestamp_interval;
+
+/* the longest interval (in ms) TIMESTAMPI_FROM_MS() accepts */
+#define TIMESTAMP_FLAT_INTERVAL_MAX_MS					\
+	((uint64_t)UINT32_MAX / 4 * 1000 / (F_CPU / TIMEKEEPING_DIV))
+
+/* max input TIMESTAMP_FLAT_INTERVAL_MAX_MS msecs, must be a constant */
+#define TIMESTAMPI_FROM_MS(value)					\
+	{								\
+		.counts = sizeof(struct {				\
+			_Static_assert((value) <=			\
+				       TIMESTAMP_FLAT_INTERVAL_MAX_MS,	\
+				       "interval too long for flat "	\
+				       "timestamps");			\
+			char dummy;					\
+		}) * 0 +						\
+			(uint64_t)(value) * TIMEKEEPING_HZ *		\
+			timekeeping_counts_per_tick() / 1000		\
+	}
+
+/* max input UINT32_MAX usecs = ~1 hour 11 minutes */
+#define TIMESTAMPI_FROM_US(value)					\
+	{								\
+		.counts = (uint64_t)(value) * TIMEKEEPING_HZ *		\
+			timekeeping_counts_per_tick() /		\
+			((uint32_t)1000 * 1000)			\
+	}
+
+/* max input UINT32_MAX timer counts */
+#define TIMESTAMPI_FROM_COUNTS(value)		\
+	{					\
+		.counts = (uint32_t)(value)	\
+	}
+#endif
+
+/* don't directly use these variables */
 extern uint32_t timekeeping_ticks;
+#ifdef TIMEKEEPING_FLAT_TIMESTAMPS
+extern uint32_t timekeeping_counts_base;
+#endif
 
 #define timestamp_check_type(in)				\
 	do {							\
@@ -86,6 +197,7 @@ extern uint32_t timekeeping_ticks;
 #undef timestamp_clear
 #undef timestamp_isset
 
+#ifndef TIMEKEEPING_FLAT_TIMESTAMPS
 #define timestampi_zero(in)			\
 	do {					\
 		timestampi_check_type(in);	\
@@ -105,6 +217,53 @@ extern uint32_t timekeeping_ticks;
 	((in1)->ticks == (in2)->ticks ? (in1)->counts oper (in2)->counts : \
 	 (in1)->ticks oper (in2)->ticks)
 
+/*
+ * split a timestamp or a timestamp interval into whole ticks and counts
+ * within the last tick (mostly useful for debug output)
+ */
+#define timestamp_get_ticks(in) ((in)->ticks)
+#define timestamp_get_counts(in) ((in)->counts)
+
+/* returns a timestamp interval as timer counts, it must fit in uint32_t */
+#define timestampi_to_counts(in)					\
+	({								\
+		timestampi_check_type(in);				\
+									\
+		(uint32_t)((in)->ticks *				\
+			   timekeeping_counts_per_tick() +		\
+			   (in)->counts);				\
+	})
+#else
+#define timestampi_zero(in)			\
+	do {					\
+		timestampi_check_type(in);	\
+						\
+		(in)->counts = 0;		\
+	} while (0)
+
+#define timestampi_iszero(in)			\
+	({					\
+		timestampi_check_type(in);	\
+						\
+		(in)->counts == 0;		\
+	})
+
+#define timestamp_cmp_internal(in1, in2, oper)	\
+	((in1)->counts oper (in2)->counts)
+
+#define timestamp_get_ticks(in)				\
+	((in)->counts / timekeeping_counts_per_tick())
+#define timestamp_get_counts(in)			\
+	((in)->counts % timekeeping_counts_per_tick())
+
+#define timestampi_to_counts(in)		\
+	({					\
+		timestampi_check_type(in);	\
+						\
+		(in)->counts;			\
+	})
+#endif
+
 /*
  * raw compare of timestamp values
  *
@@ -120,6 +279,7 @@ extern uint32_t timekeeping_ticks;
 		timestamp_cmp_internal(in1, in2, oper); \
 	})
 
+#ifndef TIMEKEEPING_FLAT_TIMESTAMPS
 /*
  * computes time elapsed from in2 to in1 taking into
  * consideration a possible wraparound in meantime
@@ -200,6 +360,36 @@ extern uint32_t timekeeping_ticks;
 										\
 		timestamp_temporal_cmp_result;					\
 	})
+#else
+#define timestamp_diff(in1, in2, result)				\
+	do {								\
+		timestamp_check_type(in1);				\
+		timestamp_check_type(in2);				\
+		timestampi_check_type(result);				\
+									\
+		(result)->counts = (in1)->counts - (in2)->counts;	\
+	} while (0)
+
+#define timestamp_opposite(in, result)				\
+	do {							\
+		timestamp_check_type(in);			\
+		timestamp_check_type(result);			\
+								\
+		(result)->counts = (in)->counts + UINT32_MAX / 2;	\
+	} while (0)
+
+/*
+ * in1's that lie forward within UINT32_MAX / 2 counts (inclusive) are in
+ * the future with regard to in2, this is exactly the sign of their difference
+ */
+#define timestamp_temporal_cmp(in1, in2, oper)				\
+	({								\
+		timestamp_check_type(in1);				\
+		timestamp_check_type(in2);				\
+									\
+		(int32_t)((in1)->counts - (in2)->counts) oper 0;	\
+	})
+#endif
 
 /* comparison of timestampi values */
 #define timestampi_cmp(in1, in2, oper)					\
@@ -210,6 +400,7 @@ extern uint32_t timekeeping_ticks;
 		timestamp_cmp_internal(in1, in2, oper);		\
 	})
 
+#ifndef TIMEKEEPING_FLAT_TIMESTAMPS
 /* add an interval (timestampi) to an absolute timestamp */
 #define timestamp_add(in, interval, result)				\
 	do {								\
@@ -232,24 +423,40 @@ extern uint32_t timekeeping_ticks;
 									\
 		(result)->counts = tmp_timestamp_add_counts;		\
 	} while (0)
+#else
+#define timestamp_add(in, interval, result)				\
+	do {								\
+		timestamp_check_type(in);				\
+		timestampi_check_type(interval);			\
+		timestamp_check_type(result);				\
+									\
+		(result)->counts = (in)->counts + (interval)->counts;	\
+	} while (0)
+#endif
 
-/* returns the current time (just ticks) */
-static inline uint32_t timekeeping_now_ticks(void)
-{
-	uint32_t val;
-
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		_MemoryBarrier();
-		val = timekeeping_ticks;
-		_MemoryBarrier();
-	}
-
-	return val;
-}
-
-/* returns the current time (the whole timestamp) */
+/*
+ * returns the current time (the whole timestamp)
+ *
+ * when called with interrupts enabled it doesn't disable them (apart from
+ * the few cycles it takes to read the timer counter), but instead retries if
+ * a timer period has ended in the meantime
+ */
 void timekeeping_now_timestamp(timestamp *out);
 
+/*
+ * like timekeeping_now_timestamp(), but must be called with interrupts
+ * disabled (from an ISR or an atomic section)
+ */
+void timekeeping_now_timestamp_atomic(timestamp *out);
+
+#ifndef TIMEKEEPING_FLAT_TIMESTAMPS
+#define timestamp_quarter_shift_internal(out, oper)	\
+	((out)->ticks oper UINT32_MAX / 4)
+#else
+#define timestamp_quarter_shift_internal(out, oper)	\
+	((out)->counts oper UINT32_MAX / 4)
+#endif
+
 /*
  * returns a timestamp that will be considered "in the past" for as long as
  * possible when compared temporally in the future with then current time
@@ -262,7 +469,7 @@ void timekeeping_now_timestamp(timestamp *out);
 							 \
 		/* see comment in */			 \
 		/* timekeeping_timestamp_max_future() */ \
-		(out)->ticks -= UINT32_MAX / 4;	 \
+		timestamp_quarter_shift_internal(out, -=); \
 	} while (0)
 
 /* like timekeeping_timestamp_max_past(), just in the opposite direction */
@@ -277,7 +484,7 @@ void timekeeping_now_timestamp(timestamp *out);
 		/* until three timestamps: max past, */ \
 		/* now and max future no longer */	\
 		/* correctly compare temporally */	\
-		(out)->ticks += UINT32_MAX / 4;	\
+		timestamp_quarter_shift_internal(out, +=); \
 	} while (0)
 
 static inline uint32_t timekeeping_counts_per_tick_internal(uint16_t *top_out)
@@ -311,6 +518,65 @@ static inline uint32_t timekeeping_counts_per_tick(void)
 	return timekeeping_counts_per_tick_internal(NULL);
 }
 
+/* returns the current time (just ticks) */
+static inline uint32_t timekeeping_now_ticks(void)
+{
+	uint32_t val;
+
+#ifndef TIMEKEEPING_TICKLESS
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_MemoryBarrier();
+		val = timekeeping_ticks;
+		_MemoryBarrier();
+	}
+#else
+	/* timekeeping_ticks only gets updated at the end of a timer period */
+	timestamp now;
+
+	timekeeping_now_timestamp(&now);
+	val = timestamp_get_ticks(&now);
+#endif
+
+	return val;
+}
+
+#ifdef TIMEKEEPING_CLOCK_SCALING
+/* returns whether the system clock is currently divided */
+bool timekeeping_clock_is_scaled(void);
+
+/*
+ * divide the system clock by TIMEKEEPING_CLOCK_SCALING_DIV (scaled = true)
+ * or restore it back to the full speed (scaled = false)
+ *
+ * the timekeeping timer prescaler is switched together with the system
+ * clock, so the timer keeps counting at the same rate (each switch may
+ * shift the time by less than one timer count, though)
+ *
+ * anything else clocked from the system clock (like serial ports baud rate
+ * or the I2C bit rate) has to be adjusted by the caller
+ *
+ * must be called with interrupts disabled
+ */
+void timekeeping_clock_scale_atomic(bool scaled);
+#endif
+
+/*
+ * program the timekeeping timer so its interrupts will wake the µC up not
+ * later than at next_wakeup: either at the end of the current timer period
+ * (in the tickless mode the period is first adjusted to end at the last tick
+ * boundary that isn't later than next_wakeup) or, when next_wakeup comes
+ * before that, by a one-shot alarm at exactly that timestamp
+ *
+ * returns false if next_wakeup is too close (or already in the past) for the
+ * µC to go to sleep safely until then - the caller should then poll again
+ * without sleeping
+ *
+ * must be called with interrupts disabled, enabling them only for the actual
+ * sleep - any time read after that (or a subsequent call to this function)
+ * is fine, however
+ */
+bool timekeeping_set_next_wakeup_atomic(const timestamp *next_wakeup);
+
 /*
  * setup the timekeeping subsystem: must be called before any other timekeeping
  * function and with interrupts disabled
@@ -0,0 +1,415 @@
+/*
+ * Smart UPS Addon: hot path microbenchmarks, run under simavr
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+/*
+ * this is a separate firmware image ("make bench"), each result is printed
+ * to the simavr console as a "bench: <name> <cycles>" line
+ *
+ * results are CPU cycles, measured with the cycle counter, minus the
+ * measurement overhead - the minimum over BENCH_RUNS runs for the short
+ * paths, the sum over all the polls done for the multi-poll ones
+ * (the I2C transaction and the 'y' reply), interrupt handlers excluded
+ *
+ * the "fanin_" results are a baseline: the get_next_poll_time fan-in that
+ * the main loop did before the scheduler, to compare with the "sched_" ones
+ *
+ * modules whose static functions or data are benchmarked are included
+ * directly
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <avr/cpufunc.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+#include "avr_mcu_section.h"
+
+#include "../lib/critprof.h"
+#include "../lib/cycles.h"
+#include "../lib/debug.h"
+#include "../lib/i2c.h"
+#include "../lib/pending.h"
+#include "../lib/sched.h"
+#include "../lib/timekeeping.h"
+#include "load.h"
+#include "temp.h"
+
+#include "fan.c"
+#include "serial-base.c"
+#include "serial.c"
+
+#define BENCH_RUNS 16
+
+/* the UPS CPU reply to a 'y' command */
+#define BENCH_Y_REPLY "(C) APCC\r\n"
+
+/* an address without any device on the simulated bus */
+#define BENCH_I2C_ADDR 0x48
+
+/*
+ * how many modules the old main loop fan-in asked for their next poll time:
+ * fan, temp, serial, i2c and four TC74 sensors
+ */
+#define BENCH_SCHED_MODULES 8
+
+/* the pending work flag of the benchmark scheduler timers */
+#define BENCH_SCHED_PENDING (PENDING_APP_FIRST + 1)
+
+/* fan pulse period (in ms) for the RPM calculation, 1500 RPM */
+#define BENCH_FAN_PULSE_PERIOD 10
+
+AVR_MCU(F_CPU, "atmega1284");
+AVR_MCU_SIMAVR_CONSOLE(&GPIOR1);
+
+static uint16_t bench_overhead;
+
+static timestamp bench_ts1, bench_ts2, bench_ts3;
+static timestamp_interval bench_tsi1, bench_tsi2;
+static bool bench_bool;
+static uint8_t bench_buf[2];
+static uint16_t bench_rpm;
+static uint8_t bench_rpm_div;
+
+static bool bench_i2c_done;
+
+/* a module of the old fan-in, shaped like the old fan and tc74 ones */
+typedef struct {
+	bool state_changed;
+	bool waiting;
+	timestamp next_poll;
+} bench_fanin_module;
+
+static bench_fanin_module bench_fanin_modules[BENCH_SCHED_MODULES];
+static sched_timer bench_sched_timers[BENCH_SCHED_MODULES];
+
+static int bench_putc(char c, FILE *stream)
+{
+	GPIOR1 = c;
+
+	return 0;
+}
+
+static FILE bench_out = FDEV_SETUP_STREAM(bench_putc, NULL, _FDEV_SETUP_WRITE);
+
+/* lets pending interrupts run, needs interrupts disabled */
+static void bench_interrupts_window(void)
+{
+	sei();
+	/* the instruction after sei is always executed first */
+	_NOP();
+	cli();
+}
+
+static void bench_report(PGM_P name, uint32_t cycles)
+{
+	printf_P(PSTR("bench: %S %"PRIu32"\n"), name, cycles);
+}
+
+/*
+ * runs prep and then measures stmt, BENCH_RUNS times,
+ * needs interrupts disabled
+ */
+#define BENCH_RUN(prep, stmt)						\
+	({								\
+		uint16_t tmp_bench_min = UINT16_MAX;			\
+									\
+		for (uint8_t tmp_bench_ctr = 0;			\
+		     tmp_bench_ctr < BENCH_RUNS; tmp_bench_ctr++) {	\
+			prep;						\
+									\
+			_MemoryBarrier();				\
+			uint16_t tmp_bench_start = cycles_now_atomic();\
+			_MemoryBarrier();				\
+			stmt;						\
+			_MemoryBarrier();				\
+			uint16_t tmp_bench_cycles =			\
+				cycles_now_atomic() - tmp_bench_start;	\
+			_MemoryBarrier();				\
+									\
+			if (tmp_bench_cycles < tmp_bench_min)		\
+				tmp_bench_min = tmp_bench_cycles;	\
+		}							\
+									\
+		tmp_bench_min;						\
+	})
+
+#define BENCH(name, prep, stmt)					\
+	bench_report(PSTR(name), BENCH_RUN(prep, stmt) - bench_overhead)
+
+/* measures one call, needs interrupts disabled */
+#define BENCH_ONCE(stmt)						\
+	({								\
+		_MemoryBarrier();					\
+		uint16_t tmp_bench_start = cycles_now_atomic();	\
+		_MemoryBarrier();					\
+		stmt;							\
+		_MemoryBarrier();					\
+		uint16_t tmp_bench_cycles =				\
+			cycles_now_atomic() - tmp_bench_start;		\
+		_MemoryBarrier();					\
+									\
+		(uint16_t)(tmp_bench_cycles - bench_overhead);		\
+	})
+
+static void bench_timestamps(void)
+{
+	const timestamp_interval interval = TIMESTAMPI_FROM_MS(1234);
+
+	bench_tsi1 = interval;
+	timekeeping_now_timestamp_atomic(&bench_ts1);
+	timestamp_add(&bench_ts1, &interval, &bench_ts2);
+
+	BENCH("timekeeping_now_timestamp_atomic", ,
+	      timekeeping_now_timestamp_atomic(&bench_ts3));
+	BENCH("timestamp_add", ,
+	      timestamp_add(&bench_ts1, &bench_tsi1, &bench_ts3));
+	BENCH("timestamp_diff", ,
+	      timestamp_diff(&bench_ts2, &bench_ts1, &bench_tsi2));
+	BENCH("timestamp_temporal_cmp", ,
+	      bench_bool = timestamp_temporal_cmp(&bench_ts1, &bench_ts2, <));
+	BENCH("timestampi_cmp", ,
+	      bench_bool = timestampi_cmp(&bench_tsi1, &bench_tsi2, <));
+}
+
+static void bench_fan(void)
+{
+	_Static_assert(BENCH_FAN_PULSE_PERIOD * FAN_PULSES_PER_ROT * 1500 ==
+		       60000, "BENCH_FAN_PULSE_PERIOD isn't 1500 RPM");
+
+	sei();
+	for (uint8_t ctr = 0; ctr < FAN_TIMESTAMPS; ctr++) {
+		timestamp now;
+
+		_delay_ms(BENCH_FAN_PULSE_PERIOD);
+
+		timekeeping_now_timestamp(&now);
+		fan_timestamps[ctr] = now;
+	}
+	cli();
+
+	fan_timestamp_last_element = FAN_TIMESTAMPS - 1;
+
+	BENCH("fan_recalc_rpm", ,
+	      fan_recalc_rpm(fan_timestamps, fan_timestamp_last_element,
+			     &bench_rpm, &bench_rpm_div));
+	BENCH("fan_rpm", fan_timestamps_dirty = true,
+	      bench_rpm = fan_rpm());
+}
+
+static void bench_serial_buf(void)
+{
+	/* port 1 isn't going to receive anything under the simulator */
+	BENCH("serial_buf_put", , serial1_buf_rx_put('x'));
+	BENCH("serial_buf_peek_at", ,
+	      serial1_buf_rx_peek_at(bench_buf, 4, sizeof(bench_buf)));
+	BENCH("serial_buf_get", , bench_buf[0] = serial1_buf_rx_get());
+}
+
+static void bench_i2c_complete(void *data, bool success, uint8_t rdlen_actual)
+{
+	bench_i2c_done = true;
+}
+
+/*
+ * the transaction ends with an address NACK, since there is no device on
+ * the simulated bus
+ *
+ * the i2c_poll_atomic() part (run with interrupts disabled in the main loop)
+ * and the i2c_poll() one, which calls the completion, are reported separately
+ */
+static void bench_i2c(void)
+{
+	static const uint8_t wrbuf[] = { 0 };
+	uint32_t cycles = 0;
+	uint32_t cycles_completion = 0;
+
+	bench_i2c_done = false;
+	cycles += BENCH_ONCE(i2c_transaction(BENCH_I2C_ADDR,
+					     wrbuf, sizeof(wrbuf),
+					     bench_buf, 1,
+					     bench_i2c_complete, NULL));
+	bench_report(PSTR("i2c_transaction_enqueue"), cycles);
+
+	while (!bench_i2c_done) {
+		/* let TWI_vect signal the progress, like the main loop does */
+		bench_interrupts_window();
+
+		if (!((pending_take() | sched_get_due_work()) &
+		      _BV(PENDING_I2C)))
+			continue;
+
+		cycles_completion += BENCH_ONCE(i2c_poll());
+		cycles += BENCH_ONCE(i2c_poll_atomic());
+	}
+
+	bench_report(PSTR("i2c_transaction_nack"), cycles);
+	bench_report(PSTR("i2c_transaction_completion"), cycles_completion);
+}
+
+/* the old per-module get_next_poll_time, a call into another module */
+static void __attribute__((noinline))
+bench_fanin_get_next_poll_time(const bench_fanin_module *module,
+			       timestamp *next_poll)
+{
+	if (module->state_changed)
+		timekeeping_now_timestamp(next_poll);
+	else if (module->waiting)
+		*next_poll = module->next_poll;
+	else
+		timekeeping_timestamp_max_future(next_poll);
+}
+
+/* the old main loop MAIN_GET_TIMEOUT() comparisons over all modules */
+static void bench_fanin_next_poll_time(timestamp *next_poll)
+{
+	bool next_poll_set = false;
+
+	for (uint8_t ctr = 0; ctr < BENCH_SCHED_MODULES; ctr++) {
+		timestamp module_next_poll;
+
+		bench_fanin_get_next_poll_time(&bench_fanin_modules[ctr],
+					       &module_next_poll);
+		if (!next_poll_set ||
+		    timestamp_temporal_cmp(&module_next_poll, next_poll, <)) {
+			*next_poll = module_next_poll;
+			next_poll_set = true;
+		}
+	}
+}
+
+/*
+ * both the fan-in modules and the scheduler timers wait for the same,
+ * different deadlines, far enough in the future not to become due
+ */
+static void bench_sched(void)
+{
+	const timestamp_interval interval = TIMESTAMPI_FROM_MS(60000);
+	timestamp deadline;
+
+	timekeeping_now_timestamp_atomic(&deadline);
+	for (uint8_t ctr = 0; ctr < BENCH_SCHED_MODULES; ctr++) {
+		bench_fanin_module *module = &bench_fanin_modules[ctr];
+		timestamp prev = deadline;
+
+		timestamp_add(&prev, &interval, &deadline);
+
+		module->state_changed = false;
+		module->waiting = true;
+		module->next_poll = deadline;
+
+		sched_timer_register(&bench_sched_timers[ctr],
+				     BENCH_SCHED_PENDING);
+		sched_timer_set(&bench_sched_timers[ctr], &deadline);
+	}
+
+	/* moves a timer between the earliest and the latest deadline */
+	bench_ts1 = bench_fanin_modules[0].next_poll;
+	bench_ts2 = deadline;
+
+	BENCH("fanin_next_poll_time", ,
+	      bench_fanin_next_poll_time(&bench_ts3));
+	BENCH("sched_get_next_poll_time", ,
+	      sched_get_next_poll_time(&bench_ts3));
+	BENCH("sched_get_due_work", , bench_buf[0] = sched_get_due_work());
+	BENCH("sched_timer_set", bench_bool = !bench_bool,
+	      sched_timer_set(&bench_sched_timers[0],
+			      bench_bool ? &bench_ts1 : &bench_ts2));
+
+	for (uint8_t ctr = 0; ctr < BENCH_SCHED_MODULES; ctr++)
+		sched_timer_clear(&bench_sched_timers[ctr]);
+}
+
+static void bench_serial_y(void)
+{
+	bool reply_sent = false;
+	uint32_t cycles = 0;
+
+	serial0_buf_rx_put('y');
+	pending_set(PENDING_SERIAL);
+
+	do {
+		bench_interrupts_window();
+
+		if (!reply_sent && serial_state == SERIAL_Y_RECV_REPLY_MATCH) {
+			for (const char *p = BENCH_Y_REPLY; *p != '\0'; p++)
+				serial1_buf_rx_put(*p);
+
+			pending_set(PENDING_SERIAL);
+			reply_sent = true;
+		}
+
+		if (!((pending_take() | sched_get_due_work()) &
+		      _BV(PENDING_SERIAL)))
+			continue;
+
+		cycles += BENCH_ONCE(serial_poll());
+		cycles += BENCH_ONCE(serial_poll_atomic());
+
+		if (serial_needs_poll())
+			pending_set(PENDING_SERIAL);
+	} while (serial_state != SERIAL_IDLE);
+
+	bench_report(PSTR("serial_y_reply"), cycles);
+}
+
+static void setup(void)
+{
+	timekeeping_setup();
+
+	debug_setup();
+
+	pending_setup();
+	sched_setup();
+
+	cycles_setup();
+	critprof_setup();
+	load_setup();
+
+	i2c_setup();
+
+	temp_setup();
+
+	serial_setup();
+
+	stdout = &bench_out;
+}
+
+int main(void)
+{
+	cli();
+	setup();
+
+	bench_overhead = BENCH_RUN(, );
+	bench_report(PSTR("overhead"), bench_overhead);
+
+	bench_timestamps();
+	bench_fan();
+	bench_serial_buf();
+	bench_i2c();
+	bench_serial_y();
+	bench_sched();
+
+	printf_P(PSTR("bench: done\n"));
+
+	/* simavr exits when sleeping with interrupts disabled */
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	sleep_enable();
+	sleep_cpu();
+
+	return 0;
+}
@@ -16,8 +16,10 @@
 #include <avr/io.h>
 #include <util/atomic.h>
 
+#include "../lib/critprof.h"
 #include "../lib/debug.h"
 #include "../lib/misc.h"
+#include "../lib/sched.h"
 #include "fan.h"
 
 /* minimum and maximum measurable RPM */
@@ -69,6 +71,8 @@ static /* fan_target_states */ uint8_t fan_target_state;
 static timestamp fan_next_rpm_check;
 static timestamp fan_spinup_deadline;
 
+static sched_timer fan_sched_timer;
+
 static timestamp fan_timestamps[FAN_TIMESTAMPS];
 static bool fan_timestamps_dirty;
 static uint8_t fan_timestamp_last_element;
@@ -112,7 +116,7 @@ ISR(PCINT1_vect)
 	fan_timestamp_last_element++;
 	fan_timestamp_last_element %= FAN_TIMESTAMPS;
 
-	timekeeping_now_timestamp(&now);
+	timekeeping_now_timestamp_atomic(&now);
 	fan_timestamps[fan_timestamp_last_element] = now;
 
 	fan_timestamps_dirty = true;
@@ -144,14 +148,11 @@ static void fan_output_enable_high(void)
 
 static void fan_timediff_max(timestamp_interval *out)
 {
-	const timestamp_interval timediff_max = {
-		.ticks = (uint32_t)TIMEKEEPING_HZ * 60 /
-		((uint32_t)FAN_RPM_MIN * FAN_PULSES_PER_ROT),
-
-		.counts = timekeeping_counts_per_tick() * TIMEKEEPING_HZ * 60 /
-		((uint32_t)FAN_RPM_MIN * FAN_PULSES_PER_ROT) %
-		timekeeping_counts_per_tick()
-	};
+	const timestamp_interval timediff_max =
+		TIMESTAMPI_FROM_COUNTS((uint64_t)timekeeping_counts_per_tick() *
+				       TIMEKEEPING_HZ * 60 /
+				       ((uint32_t)FAN_RPM_MIN *
+					FAN_PULSES_PER_ROT));
 
 	*out = timediff_max;
 }
@@ -160,23 +161,17 @@ static void fan_recalc_rpm(const timestamp timestamps_tmp[],
 			   uint8_t timestamps_tmp_last_element,
 			   uint16_t *rpm, uint8_t *rpm_div)
 {
-	const timestamp_interval timediff_min = {
-		.ticks = (uint32_t)TIMEKEEPING_HZ * 60 /
-		((uint32_t)FAN_RPM_MAX * FAN_PULSES_PER_ROT),
-
-		.counts = timekeeping_counts_per_tick() * TIMEKEEPING_HZ * 60 /
-		((uint32_t)FAN_RPM_MAX * FAN_PULSES_PER_ROT) %
-		timekeeping_counts_per_tick()
-	};
-
-	const timestamp_interval timediff_min_absolute = {
-		.ticks = (uint32_t)TIMEKEEPING_HZ * 60 /
-		((uint32_t)FAN_RPM_MAX_ABSOLUTE * FAN_PULSES_PER_ROT),
-
-		.counts = timekeeping_counts_per_tick() * TIMEKEEPING_HZ * 60 /
-		((uint32_t)FAN_RPM_MAX_ABSOLUTE * FAN_PULSES_PER_ROT) %
-		timekeeping_counts_per_tick()
-	};
+	const timestamp_interval timediff_min =
+		TIMESTAMPI_FROM_COUNTS((uint64_t)timekeeping_counts_per_tick() *
+				       TIMEKEEPING_HZ * 60 /
+				       ((uint32_t)FAN_RPM_MAX *
+					FAN_PULSES_PER_ROT));
+
+	const timestamp_interval timediff_min_absolute =
+		TIMESTAMPI_FROM_COUNTS((uint64_t)timekeeping_counts_per_tick() *
+				       TIMEKEEPING_HZ * 60 /
+				       ((uint32_t)FAN_RPM_MAX_ABSOLUTE *
+					FAN_PULSES_PER_ROT));
 
 	timestamp_interval timediff_max;
 	fan_timediff_max(&timediff_max);
@@ -187,12 +182,12 @@ static void fan_recalc_rpm(const timestamp timestamps_tmp[],
 	/* these checks below should really be static asserts */
 
 	/* need some minimum resolution */
-	if (timediff_min.ticks == 0 && timediff_min.counts < 10)
+	if (timestampi_to_counts(&timediff_min) < 10)
 		return;
 
 	/* make sure we don't overflow countsdiff and co. later */
-	if (((uint64_t)timediff_max.ticks * timekeeping_counts_per_tick() +
-	     timediff_max.counts) * FAN_PULSES_PER_ROT > UINT32_MAX)
+	if ((uint64_t)timestampi_to_counts(&timediff_max) *
+	    FAN_PULSES_PER_ROT > UINT32_MAX)
 		return;
 
 	uint8_t idx = timestamps_tmp_last_element;
@@ -221,10 +216,12 @@ static void fan_recalc_rpm(const timestamp timestamps_tmp[],
 
 		if (fan_debug_log_timediffs()) {
 			dprintf_P(PSTR("fan: t1(%"PRIu32", %"PRIu16"), t2(%"PRIu32", %"PRIu16")\n"),
-				  prev_timestamp->ticks, prev_timestamp->counts,
-				  cur_timestamp->ticks, cur_timestamp->counts);
-			dprintf_P(PSTR("fan: d(%"PRIu32", %"PRIu16")\n"),
-				  timediff.ticks, timediff.counts);
+				  (uint32_t)timestamp_get_ticks(prev_timestamp),
+				  (uint16_t)timestamp_get_counts(prev_timestamp),
+				  (uint32_t)timestamp_get_ticks(cur_timestamp),
+				  (uint16_t)timestamp_get_counts(cur_timestamp));
+			dprintf_P(PSTR("fan: d(%"PRIu32")\n"),
+				  timestampi_to_counts(&timediff));
 		}
 
 		if (timestampi_cmp(&timediff, &timediff_min_absolute, <))
@@ -234,8 +231,7 @@ static void fan_recalc_rpm(const timestamp timestamps_tmp[],
 		else if (timestampi_cmp(&timediff, &timediff_max, >))
 			break;
 
-		uint32_t countsdiff = timediff.ticks *
-			timekeeping_counts_per_tick() + timediff.counts;
+		uint32_t countsdiff = timestampi_to_counts(&timediff);
 
 		_Static_assert(FAN_RPM_MAX * ((uint64_t)FAN_TIMESTAMPS - 1) <=
 			       UINT16_MAX,
@@ -272,7 +268,7 @@ uint16_t fan_rpm(void)
 	_Static_assert(FAN_TIMESTAMPS <= UINT8_MAX,
 		       "too many fan timestamps");
 
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
 		_MemoryBarrier();
 
 		if (fan_timestamps_dirty) {
@@ -387,7 +383,17 @@ static void fan_set_state_do(fan_states state_new)
 		fan_output_enable_high();
 }
 
-void fan_poll(void)
+static void fan_sched_update(void)
+{
+	if (fan_state_changed)
+		sched_timer_set_now(&fan_sched_timer);
+	else if (!fan_is_off_state())
+		sched_timer_set(&fan_sched_timer, &fan_next_rpm_check);
+	else
+		sched_timer_clear(&fan_sched_timer);
+}
+
+static void fan_poll_do(void)
 {
 	fan_state_changed = false;
 
@@ -440,14 +446,10 @@ void fan_poll(void)
 	} while (0);
 }
 
-void fan_get_next_poll_time(timestamp *next_poll)
+void fan_poll(void)
 {
-	if (fan_state_changed)
-		timekeeping_now_timestamp(next_poll);
-	else if (!fan_is_off_state())
-		*next_poll = fan_next_rpm_check;
-	else
-		timekeeping_timestamp_max_future(next_poll);
+	fan_poll_do();
+	fan_sched_update();
 }
 
 static void fan_set_target_state(fan_target_states state_new)
@@ -457,6 +459,7 @@ static void fan_set_target_state(fan_target_states state_new)
 
 	fan_target_state = state_new;
 	fan_state_changed = true;
+	fan_sched_update();
 }
 
 void fan_disable(void)
@@ -479,7 +482,7 @@ bool fan_has_failed(void)
 	return fan_state == FAN_FAIL;
 }
 
-void fan_setup(void)
+void fan_setup(uint8_t pending_flag)
 {
 	timestamp now, now_opposite;
 	timekeeping_now_timestamp(&now);
@@ -509,6 +512,8 @@ void fan_setup(void)
 	fan_target_state = FAN_HIGH;
 	fan_state = FAN_INIT;
 
-	/* so fan_get_next_poll_time() will return now */
+	/* so the fan gets polled right away */
 	fan_state_changed = true;
+	sched_timer_register(&fan_sched_timer, pending_flag);
+	fan_sched_update();
 }
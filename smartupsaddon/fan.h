@@ -33,10 +33,9 @@ bool fan_has_failed(void);
 
 /*
  * should be called from time to time
- * (at least when the time returned by fan_get_next_poll_time() comes)
+ * (at least when the fan scheduler timer deadline comes)
  */
 void fan_poll(void);
-void fan_get_next_poll_time(timestamp *next_poll);
 
 /* request a particular fan mode */
 void fan_disable(void);
@@ -45,8 +44,12 @@ void fan_enable_high(void);
 
 /*
  * setup the fan controller: must be called before any other fan function,
- * must be called with interrupts disabled, uses timekeeping functions
+ * must be called with interrupts disabled, uses timekeeping and sched
+ * functions
+ *
+ * pending_flag is the pending work flag of the module polling the fan
+ * controller
  */
-void fan_setup(void);
+void fan_setup(uint8_t pending_flag);
 
 #endif
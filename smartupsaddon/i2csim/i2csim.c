@@ -0,0 +1,266 @@
+/*
+ * Smart UPS Addon: I2C bus simulation, fault injection scenarios
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+/*
+ * this is a host program ("make i2csim"), it runs the unmodified lib/i2c.c
+ * and lib/tc74.c against the TWI register model in twisim.c, reading two
+ * virtual TC74 sensors back to back, in a main loop like the firmware one
+ *
+ * each scenario injects one fault into a sensor after I2CSIM_FAULT_AT_MS and
+ * prints its results as "i2csim: <scenario>_<name> <value>" lines:
+ * trans_per_s - successful transactions (all sensors) per simulated second,
+ * reads_ok / reads_failed - sensor reads,
+ * fault_us - how long the sensor misbehaved,
+ * recovery_us - from the end of the fault to the next good read of
+ * the sensor (not printed if there wasn't one),
+ * stalls, timeouts, bus_clears, twi_resets - the i2c recovery statistics
+ *
+ * the times are simulated ones, from the model, with a main loop iteration
+ * that has work to do taking I2CSIM_LOOP_CYCLES
+ *
+ * each scenario runs in its own process, so it starts from a clean state
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <avr/interrupt.h>
+
+#include "../../lib/cycles.h"
+#include "../../lib/i2c.h"
+#include "../../lib/pending.h"
+#include "../../lib/sched.h"
+#include "../../lib/tc74.h"
+#include "../../lib/timekeeping.h"
+#include "twisim.h"
+
+#define I2CSIM_PENDING_TC74 PENDING_APP_FIRST
+
+/* the on-board (battery) and the inverter heatsink sensor */
+#define I2CSIM_SENSORS 2
+static const uint8_t i2csim_addrs[I2CSIM_SENSORS] = { 0x48, 0x4b };
+
+/* the faults are injected into the heatsink one */
+#define I2CSIM_FAULT_SENSOR 1
+
+#define I2CSIM_RUN_MS 10000
+#define I2CSIM_FAULT_AT_MS 3000
+
+#define I2CSIM_LOOP_CYCLES 2000
+
+typedef struct {
+	const char *name;
+	twisim_faults fault;
+	uint16_t param;
+} i2csim_scenario;
+
+static const i2csim_scenario i2csim_scenarios[] = {
+	{ "none", TWISIM_FAULT_NONE, 0 },
+	/* lets go after 5 clocks, within one bus clear */
+	{ "stuck_sda", TWISIM_FAULT_STUCK_SDA, 5 },
+	{ "nack_storm", TWISIM_FAULT_ADDR_NACK, 50 },
+	{ "arb_lost", TWISIM_FAULT_ARB_LOST, 10 },
+	/* 50 ms, much longer than a TC74 read timeout */
+	{ "stall", TWISIM_FAULT_STALL, 50 },
+	{ "no_stop", TWISIM_FAULT_NO_STOP, 3 },
+};
+
+static tc74_data i2csim_tc74[I2CSIM_SENSORS];
+static bool i2csim_reading[I2CSIM_SENSORS];
+
+static uint32_t i2csim_reads_ok;
+static uint32_t i2csim_reads_failed;
+static bool i2csim_recovered;
+static uint64_t i2csim_recovery_cycles;
+
+static uint32_t i2csim_cycles_to_us(uint64_t cycles)
+{
+	return cycles * 1000000 / F_CPU;
+}
+
+static uint64_t i2csim_ms_to_cycles(uint32_t ms)
+{
+	return (uint64_t)ms * F_CPU / 1000;
+}
+
+static void i2csim_print(const i2csim_scenario *scenario, const char *name,
+			 uint32_t value)
+{
+	printf("i2csim: %s_%s %" PRIu32 "\n", scenario->name, name, value);
+}
+
+/* collects finished reads and starts the next ones right away */
+static void i2csim_reads_poll(bool fault_injected)
+{
+	for (uint8_t ctr = 0; ctr < I2CSIM_SENSORS; ctr++) {
+		tc74_data *tc74 = &i2csim_tc74[ctr];
+
+		if (tc74_is_busy(tc74))
+			continue;
+
+		if (i2csim_reading[ctr]) {
+			int8_t temp;
+			uint64_t start, end;
+
+			if (!tc74_get_temperature_result(tc74, &temp))
+				i2csim_reads_failed++;
+			else {
+				i2csim_reads_ok++;
+
+				if (fault_injected && !i2csim_recovered &&
+				    ctr == I2CSIM_FAULT_SENSOR &&
+				    twisim_fault_is_over(&start, &end)) {
+					i2csim_recovered = true;
+					i2csim_recovery_cycles =
+						twisim_cycles() - end;
+				}
+			}
+		}
+
+		i2csim_reading[ctr] = tc74_get_temperature(tc74);
+	}
+}
+
+static void i2csim_run(const i2csim_scenario *scenario)
+{
+	const uint64_t fault_at = i2csim_ms_to_cycles(I2CSIM_FAULT_AT_MS);
+	const uint64_t run_end = i2csim_ms_to_cycles(I2CSIM_RUN_MS);
+	bool fault_injected = false;
+
+	twisim_setup();
+	for (uint8_t ctr = 0; ctr < I2CSIM_SENSORS; ctr++)
+		twisim_tc74_add(i2csim_addrs[ctr], 25 + ctr);
+
+	cli();
+
+	timekeeping_setup();
+	pending_setup();
+	sched_setup();
+	cycles_setup();
+	i2c_setup();
+
+	for (uint8_t ctr = 0; ctr < I2CSIM_SENSORS; ctr++) {
+		tc74_init(&i2csim_tc74[ctr], i2c_transaction_segments_prio,
+			  i2csim_addrs[ctr], I2C_PRIO_HIGH,
+			  I2CSIM_PENDING_TC74);
+		i2csim_reading[ctr] = false;
+	}
+
+	sei();
+
+	const uint8_t fault_addr = i2csim_addrs[I2CSIM_FAULT_SENSOR];
+
+	while (twisim_cycles() < run_end) {
+		if (!fault_injected && twisim_cycles() >= fault_at) {
+			fault_injected = true;
+
+			if (scenario->fault != TWISIM_FAULT_NONE &&
+			    !twisim_fault_inject(scenario->fault, fault_addr,
+						 scenario->param)) {
+				fprintf(stderr, "i2csim: %s: cannot inject\n",
+					scenario->name);
+				exit(1);
+			}
+		}
+
+		uint8_t work = pending_take() | sched_get_due_work();
+
+		if (work & _BV(I2CSIM_PENDING_TC74))
+			for (uint8_t ctr = 0; ctr < I2CSIM_SENSORS; ctr++)
+				tc74_poll(&i2csim_tc74[ctr]);
+
+		i2csim_reads_poll(fault_injected);
+
+		if (work & _BV(PENDING_I2C))
+			i2c_poll();
+
+		/* the time all of the above took */
+		if (work != 0)
+			twisim_run(I2CSIM_LOOP_CYCLES);
+
+		cli();
+
+		if (work & _BV(PENDING_I2C))
+			i2c_poll_atomic();
+
+		timestamp next_poll_time;
+		sched_get_next_poll_time(&next_poll_time);
+
+		if (!pending_any_atomic() &&
+		    timekeeping_set_next_wakeup_atomic(&next_poll_time))
+			twisim_sleep();
+		else
+			sei();
+	}
+
+	cli();
+
+	uint32_t ok = 0;
+	i2c_device_stats stats;
+	for (uint8_t ctr = 0; i2c_get_device_stats(ctr, &stats); ctr++)
+		ok += stats.ok;
+
+	i2csim_print(scenario, "trans_per_s",
+		     (uint64_t)ok * 1000 / I2CSIM_RUN_MS);
+	i2csim_print(scenario, "reads_ok", i2csim_reads_ok);
+	i2csim_print(scenario, "reads_failed", i2csim_reads_failed);
+
+	uint64_t start, end;
+	if (twisim_fault_is_over(&start, &end))
+		i2csim_print(scenario, "fault_us",
+			     i2csim_cycles_to_us(end - start));
+
+	if (i2csim_recovered)
+		i2csim_print(scenario, "recovery_us",
+			     i2csim_cycles_to_us(i2csim_recovery_cycles));
+
+	i2c_recovery_stats rstats;
+	i2c_get_recovery_stats(&rstats);
+	i2csim_print(scenario, "stalls", rstats.stalls);
+	i2csim_print(scenario, "timeouts", rstats.timeouts);
+	i2csim_print(scenario, "bus_clears", rstats.bus_clears);
+	i2csim_print(scenario, "twi_resets", rstats.twi_resets);
+}
+
+int main(void)
+{
+	for (size_t ctr = 0;
+	     ctr < sizeof(i2csim_scenarios) / sizeof(i2csim_scenarios[0]);
+	     ctr++) {
+		fflush(stdout);
+
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+
+		if (pid == 0) {
+			i2csim_run(&i2csim_scenarios[ctr]);
+			fflush(stdout);
+			_exit(0);
+		}
+
+		int status;
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "i2csim: %s failed\n",
+				i2csim_scenarios[ctr].name);
+			return 1;
+		}
+	}
+
+	return 0;
+}
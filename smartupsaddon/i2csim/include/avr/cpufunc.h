@@ -0,0 +1,18 @@
+/*
+ * Smart UPS Addon: I2C bus simulation, host stand-in for <avr/cpufunc.h>
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _I2CSIM_AVR_CPUFUNC_H_
+#define _I2CSIM_AVR_CPUFUNC_H_
+
+#define _NOP() do { } while (0)
+#define _MemoryBarrier() __asm__ __volatile__("" ::: "memory")
+
+#endif
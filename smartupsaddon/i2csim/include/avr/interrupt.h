@@ -0,0 +1,30 @@
+/*
+ * Smart UPS Addon: I2C bus simulation, host stand-in for <avr/interrupt.h>
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _I2CSIM_AVR_INTERRUPT_H_
+#define _I2CSIM_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+/* enabling interrupts services the pending ones right away */
+void twisim_sei(void);
+
+#define sei() twisim_sei()
+#define cli() (SREG &= (uint8_t)~_BV(SREG_I))
+
+/* the handlers are called by the model, see twisim.c */
+#define TWI_vect twisim_twi_vect
+#define TIMER3_COMPA_vect twisim_timer3_compa_vect
+#define TIMER3_COMPB_vect twisim_timer3_compb_vect
+
+#define ISR(vector, ...) void vector(void)
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Smart UPS Addon: I2C bus simulation, host stand-in for <avr/io.h>
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _I2CSIM_AVR_IO_H_
+#define _I2CSIM_AVR_IO_H_
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+
+/* the registers lib/i2c.c and its dependencies use, see twisim.c */
+extern volatile uint8_t SREG;
+extern volatile uint8_t GPIOR0;
+
+extern volatile uint8_t TWBR;
+extern volatile uint8_t TWSR;
+extern volatile uint8_t TWDR;
+
+extern volatile uint8_t PORTC;
+extern volatile uint8_t DDRC;
+
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint8_t TIMSK1;
+extern volatile uint8_t TIFR1;
+extern volatile uint16_t TCNT1;
+
+extern volatile uint8_t TCCR3A;
+extern volatile uint8_t TCCR3B;
+extern volatile uint8_t TIMSK3;
+extern volatile uint16_t TCNT3;
+extern volatile uint16_t OCR3A;
+extern volatile uint16_t OCR3B;
+
+/*
+ * the model needs to see every TWCR and TIFR3 write (and PINC is computed
+ * from the bus state), see twisim.c
+ */
+volatile uint8_t *twisim_twcr(void);
+volatile uint8_t *twisim_tifr3(void);
+uint8_t twisim_pinc(void);
+
+#define TWCR (*twisim_twcr())
+#define TIFR3 (*twisim_tifr3())
+#define PINC (twisim_pinc())
+
+/* SREG */
+#define SREG_I 7
+
+/* TWCR */
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+
+/* TWSR */
+#define TWPS1 1
+#define TWPS0 0
+
+/* TCCR1B, TCCR3A, TCCR3B */
+#define ICNC1 7
+#define CS12 2
+#define CS11 1
+#define CS10 0
+#define COM3A1 7
+#define COM3A0 6
+#define COM3B1 5
+#define COM3B0 4
+#define WGM31 1
+#define WGM30 0
+#define WGM33 4
+#define WGM32 3
+#define CS32 2
+#define CS31 1
+#define CS30 0
+
+/* TIFR1, TIMSK3, TIFR3 */
+#define ICF1 5
+#define OCF1B 2
+#define OCF1A 1
+#define TOV1 0
+#define ICIE3 5
+#define OCIE3B 2
+#define OCIE3A 1
+#define TOIE3 0
+#define ICF3 5
+#define OCF3B 2
+#define OCF3A 1
+#define TOV3 0
+
+#endif
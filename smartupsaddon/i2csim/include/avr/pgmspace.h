@@ -0,0 +1,32 @@
+/*
+ * Smart UPS Addon: I2C bus simulation, host stand-in for <avr/pgmspace.h>
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _I2CSIM_AVR_PGMSPACE_H_
+#define _I2CSIM_AVR_PGMSPACE_H_
+
+#include <stdio.h>
+#include <string.h>
+
+/* there is only one address space */
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(str) (str)
+
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_ptr(addr) (*(const void * const *)(addr))
+
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define printf_P printf
+#define fprintf_P fprintf
+
+#endif
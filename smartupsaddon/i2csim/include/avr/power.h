@@ -0,0 +1,20 @@
+/*
+ * Smart UPS Addon: I2C bus simulation, host stand-in for <avr/power.h>
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _I2CSIM_AVR_POWER_H_
+#define _I2CSIM_AVR_POWER_H_
+
+/* every modelled peripheral is always powered */
+#define power_twi_enable() do { } while (0)
+#define power_timer1_enable() do { } while (0)
+#define power_timer3_enable() do { } while (0)
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Smart UPS Addon: I2C bus simulation, host stand-in for <util/atomic.h>
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _I2CSIM_UTIL_ATOMIC_H_
+#define _I2CSIM_UTIL_ATOMIC_H_
+
+#include <stdint.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+/* the avr-libc implementation, with the model servicing interrupts */
+static inline uint8_t twisim_atomic_cli(void)
+{
+	cli();
+
+	return 1;
+}
+
+static inline void twisim_atomic_restore(const uint8_t *sreg_save)
+{
+	SREG = *sreg_save;
+
+	if (bit_is_set(SREG, SREG_I))
+		sei();
+}
+
+static inline void twisim_atomic_force_on(const uint8_t *sreg_save)
+{
+	(void)sreg_save;
+
+	sei();
+}
+
+#define ATOMIC_RESTORESTATE						\
+	uint8_t sreg_save						\
+	__attribute__((__cleanup__(twisim_atomic_restore))) = SREG
+
+#define ATOMIC_FORCEON							\
+	uint8_t sreg_save						\
+	__attribute__((__cleanup__(twisim_atomic_force_on))) = 0
+
+#define ATOMIC_BLOCK(type)						\
+	for (type, twisim_atomic_todo = twisim_atomic_cli();		\
+	     twisim_atomic_todo; twisim_atomic_todo = 0)
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * Smart UPS Addon: I2C bus simulation, host stand-in for <util/delay.h>
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _I2CSIM_UTIL_DELAY_H_
+#define _I2CSIM_UTIL_DELAY_H_
+
+/* busy waits take simulated time (with interrupts serviced if enabled) */
+void twisim_delay_us(double us);
+
+#define _delay_us(us) twisim_delay_us(us)
+#define _delay_ms(ms) twisim_delay_us((ms) * 1000.0)
+
+#endif
@@ -0,0 +1,723 @@
+/*
+ * Smart UPS Addon: I2C bus simulation, TWI register model
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/delay.h>
+#include <util/twi.h>
+
+#include "twisim.h"
+
+#define TWISIM_TC74_MAX 8
+
+/* the TWI pins, like in lib/i2c.c */
+#define TWISIM_SCL_BIT 0
+#define TWISIM_SDA_BIT 1
+
+#define TWISIM_TC74_REG_TEMP 0
+#define TWISIM_TC74_REG_CONFIG 1
+#define TWISIM_TC74_CONFIG_STANDBY _BV(7)
+#define TWISIM_TC74_CONFIG_DATA_READY _BV(6)
+
+/*
+ * TWCR bit 1 and TIFR3 bit 7 are reserved (always read as zero on the real
+ * chip), the model uses them to tell a write from a read,
+ * see twisim_twcr_refresh()
+ */
+#define TWISIM_TWCR_MARKER _BV(1)
+#define TWISIM_TIFR3_MARKER _BV(7)
+
+/* interrupts serviced in a row without time passing before giving up */
+#define TWISIM_IRQ_STORM 1000
+
+typedef enum { TWISIM_OP_NONE, TWISIM_OP_START, TWISIM_OP_BYTE,
+	       TWISIM_OP_STOP } twisim_ops;
+
+/* what the byte after a START is */
+typedef enum { TWISIM_PHASE_IDLE, TWISIM_PHASE_ADDR, TWISIM_PHASE_WRITE,
+	       TWISIM_PHASE_READ } twisim_phases;
+
+typedef struct {
+	uint8_t addr;
+	int8_t temp;
+	uint8_t config;
+	uint8_t reg;
+	/* bytes written since it was addressed */
+	uint8_t written;
+} twisim_tc74;
+
+volatile uint8_t SREG;
+volatile uint8_t GPIOR0;
+
+volatile uint8_t TWBR;
+volatile uint8_t TWSR;
+volatile uint8_t TWDR;
+
+volatile uint8_t PORTC;
+volatile uint8_t DDRC;
+
+volatile uint8_t TCCR1A;
+volatile uint8_t TCCR1B;
+volatile uint8_t TIMSK1;
+volatile uint8_t TIFR1;
+volatile uint16_t TCNT1;
+
+volatile uint8_t TCCR3A;
+volatile uint8_t TCCR3B;
+volatile uint8_t TIMSK3;
+volatile uint16_t TCNT3;
+volatile uint16_t OCR3A;
+volatile uint16_t OCR3B;
+
+void twisim_twi_vect(void);
+void twisim_timer3_compa_vect(void);
+void twisim_timer3_compb_vect(void);
+
+static uint64_t twisim_now;
+
+/* how many interrupts were serviced so far */
+static uint32_t twisim_irqs;
+static bool twisim_in_isr;
+
+/* Timer3: the prescaler it runs at now and when it counts next */
+static uint16_t twisim_t3_div;
+static uint64_t twisim_t3_next;
+static uint8_t twisim_tifr3_flags;
+static uint8_t twisim_tifr3_io;
+
+/*
+ * TWCR as it is, without TWINT (kept separately, since it is set by
+ * the hardware and cleared by writing one to it), and the value the last
+ * TWCR access was given
+ */
+static uint8_t twisim_twcr_val;
+static bool twisim_twint;
+static uint8_t twisim_twcr_io;
+static uint8_t twisim_twcr_io_given;
+
+static /* twisim_ops */ uint8_t twisim_op;
+static uint64_t twisim_op_end;
+static bool twisim_master;
+static /* twisim_phases */ uint8_t twisim_phase;
+static twisim_tc74 *twisim_addressed;
+
+static twisim_tc74 twisim_tc74s[TWISIM_TC74_MAX];
+static uint8_t twisim_tc74s_num;
+
+/* the fault: armed, in progress (started) or over */
+static /* twisim_faults */ uint8_t twisim_fault;
+static twisim_tc74 *twisim_fault_dev;
+static uint16_t twisim_fault_param;
+static bool twisim_fault_started;
+static bool twisim_fault_over;
+static uint64_t twisim_fault_start;
+static uint64_t twisim_fault_end;
+
+/* the sensor side of the bus lines */
+static bool twisim_sda_held;
+static uint64_t twisim_scl_held_until;
+static bool twisim_scl_was_high;
+
+static void twisim_fault_begin(void)
+{
+	if (twisim_fault_started)
+		return;
+
+	twisim_fault_started = true;
+	twisim_fault_start = twisim_now;
+}
+
+static void twisim_fault_finish(void)
+{
+	twisim_fault_begin();
+
+	twisim_fault = TWISIM_FAULT_NONE;
+	twisim_fault_over = true;
+	twisim_fault_end = twisim_now;
+}
+
+static bool twisim_fault_applies(twisim_faults fault,
+				 const twisim_tc74 *dev)
+{
+	return twisim_fault == fault && dev != NULL && dev == twisim_fault_dev;
+}
+
+static twisim_tc74 *twisim_tc74_find(uint8_t addr)
+{
+	for (uint8_t ctr = 0; ctr < twisim_tc74s_num; ctr++)
+		if (twisim_tc74s[ctr].addr == addr)
+			return &twisim_tc74s[ctr];
+
+	return NULL;
+}
+
+static uint8_t twisim_tc74_read(twisim_tc74 *dev)
+{
+	if (dev->reg == TWISIM_TC74_REG_TEMP)
+		return (uint8_t)dev->temp;
+	else if (dev->reg == TWISIM_TC74_REG_CONFIG)
+		return dev->config;
+
+	return 0xff;
+}
+
+static void twisim_tc74_write(twisim_tc74 *dev, uint8_t byte)
+{
+	if (dev->written == 0)
+		dev->reg = byte;
+	else if (dev->written == 1 && dev->reg == TWISIM_TC74_REG_CONFIG) {
+		/* conversions are instant */
+		dev->config = byte & TWISIM_TC74_CONFIG_STANDBY;
+		if (!(dev->config & TWISIM_TC74_CONFIG_STANDBY))
+			dev->config |= TWISIM_TC74_CONFIG_DATA_READY;
+	}
+
+	if (dev->written < UINT8_MAX)
+		dev->written++;
+}
+
+static bool twisim_scl_is_high(void)
+{
+	if (DDRC & _BV(TWISIM_SCL_BIT))
+		return false;
+
+	if (twisim_scl_held_until > twisim_now)
+		return false;
+
+	/* the TWI holds SCL low while it waits for the software */
+	if ((twisim_twcr_val & _BV(TWEN)) && twisim_master &&
+	    (twisim_twint || twisim_op == TWISIM_OP_STOP))
+		return false;
+
+	return true;
+}
+
+static bool twisim_sda_is_high(void)
+{
+	return !(DDRC & _BV(TWISIM_SDA_BIT)) && !twisim_sda_held;
+}
+
+/* a sensor lost in a byte it was sending counts SCL clocks to get out */
+static void twisim_scl_edges(void)
+{
+	bool high = twisim_scl_is_high();
+
+	if (high && !twisim_scl_was_high && twisim_sda_held &&
+	    --twisim_fault_param == 0) {
+		twisim_sda_held = false;
+		twisim_fault_finish();
+	}
+
+	twisim_scl_was_high = high;
+}
+
+static uint32_t twisim_bit_cycles(void)
+{
+	return 16 + 2 * (uint32_t)TWBR * (1 << (2 * (TWSR & 3)));
+}
+
+static void twisim_status(uint8_t status)
+{
+	TWSR = (TWSR & ~TW_STATUS_MASK) | status;
+	twisim_twint = true;
+}
+
+static void twisim_twi_abort(void)
+{
+	if (twisim_op == TWISIM_OP_STOP && twisim_op_end == UINT64_MAX &&
+	    twisim_fault == TWISIM_FAULT_NO_STOP && twisim_fault_param == 0)
+		twisim_fault_finish();
+
+	twisim_op = TWISIM_OP_NONE;
+	twisim_master = false;
+	twisim_phase = TWISIM_PHASE_IDLE;
+	twisim_addressed = NULL;
+	twisim_twint = false;
+}
+
+static void twisim_op_begin(twisim_ops op, uint32_t bits)
+{
+	twisim_op = op;
+	twisim_op_end = twisim_now + bits * twisim_bit_cycles();
+}
+
+/* a write to TWCR with TWINT set */
+static void twisim_twi_command(void)
+{
+	twisim_twint = false;
+
+	if (twisim_twcr_val & _BV(TWSTA))
+		twisim_op_begin(TWISIM_OP_START, 1);
+	else if (twisim_twcr_val & _BV(TWSTO)) {
+		if (!twisim_master) {
+			/* just recovers from a bus error */
+			twisim_twcr_val &= ~_BV(TWSTO);
+			return;
+		}
+
+		twisim_op_begin(TWISIM_OP_STOP, 1);
+
+		if (twisim_fault_applies(TWISIM_FAULT_NO_STOP,
+					 twisim_addressed) &&
+		    twisim_fault_param > 0) {
+			twisim_fault_begin();
+			twisim_fault_param--;
+
+			/* until the TWI is reset */
+			twisim_op_end = UINT64_MAX;
+		}
+	} else if (twisim_master && twisim_phase != TWISIM_PHASE_IDLE) {
+		twisim_op_begin(TWISIM_OP_BYTE, 9);
+
+		if (twisim_phase != TWISIM_PHASE_ADDR &&
+		    twisim_fault_applies(TWISIM_FAULT_STALL,
+					 twisim_addressed) &&
+		    !twisim_fault_started) {
+			twisim_fault_begin();
+
+			twisim_scl_held_until = twisim_now +
+				(uint64_t)twisim_fault_param * F_CPU / 1000;
+			twisim_op_end += twisim_scl_held_until - twisim_now;
+		}
+	}
+}
+
+static void twisim_op_addr_done(void)
+{
+	uint8_t addr = TWDR >> 1;
+	bool read = TWDR & TW_READ;
+	twisim_tc74 *dev = twisim_tc74_find(addr);
+
+	if (twisim_fault_applies(TWISIM_FAULT_ARB_LOST, dev)) {
+		twisim_fault_begin();
+		if (--twisim_fault_param == 0)
+			twisim_fault_finish();
+
+		twisim_master = false;
+		twisim_phase = TWISIM_PHASE_IDLE;
+		twisim_addressed = NULL;
+		twisim_status(TW_MT_ARB_LOST);
+		return;
+	}
+
+	if (twisim_fault_applies(TWISIM_FAULT_ADDR_NACK, dev)) {
+		twisim_fault_begin();
+		if (--twisim_fault_param == 0)
+			twisim_fault_finish();
+
+		dev = NULL;
+	}
+
+	twisim_addressed = dev;
+	twisim_phase = read ? TWISIM_PHASE_READ : TWISIM_PHASE_WRITE;
+
+	if (dev == NULL) {
+		twisim_status(read ? TW_MR_SLA_NACK : TW_MT_SLA_NACK);
+		return;
+	}
+
+	dev->written = 0;
+	twisim_status(read ? TW_MR_SLA_ACK : TW_MT_SLA_ACK);
+}
+
+static void twisim_op_byte_done(void)
+{
+	twisim_tc74 *dev = twisim_addressed;
+
+	if (twisim_phase == TWISIM_PHASE_ADDR)
+		twisim_op_addr_done();
+	else if (twisim_phase == TWISIM_PHASE_WRITE) {
+		if (dev == NULL) {
+			twisim_status(TW_MT_DATA_NACK);
+			return;
+		}
+
+		twisim_tc74_write(dev, TWDR);
+		twisim_status(TW_MT_DATA_ACK);
+	} else { /* TWISIM_PHASE_READ */
+		if (dev == NULL)
+			TWDR = 0xff;
+		else if (twisim_fault_applies(TWISIM_FAULT_STUCK_SDA, dev) &&
+			 !twisim_fault_started) {
+			/* it missed some clocks and is still in the byte */
+			twisim_fault_begin();
+			twisim_sda_held = true;
+			TWDR = 0xff;
+		} else
+			TWDR = twisim_tc74_read(dev);
+
+		twisim_status(twisim_twcr_val & _BV(TWEA) ?
+			      TW_MR_DATA_ACK : TW_MR_DATA_NACK);
+	}
+}
+
+static void twisim_op_done(void)
+{
+	twisim_ops op = twisim_op;
+
+	if (op == TWISIM_OP_START) {
+		/* a START waits for a busy bus to become free */
+		if (twisim_sda_held || twisim_scl_held_until > twisim_now) {
+			twisim_op_end = twisim_now + twisim_bit_cycles();
+			return;
+		}
+
+		twisim_op = TWISIM_OP_NONE;
+		twisim_status(twisim_master ? TW_REP_START : TW_START);
+		twisim_master = true;
+		twisim_phase = TWISIM_PHASE_ADDR;
+		twisim_addressed = NULL;
+	} else if (op == TWISIM_OP_BYTE) {
+		twisim_op = TWISIM_OP_NONE;
+		twisim_op_byte_done();
+	} else if (op == TWISIM_OP_STOP) {
+		/* there is no TWINT after a STOP */
+		twisim_op = TWISIM_OP_NONE;
+		twisim_twcr_val &= ~_BV(TWSTO);
+		twisim_master = false;
+		twisim_phase = TWISIM_PHASE_IDLE;
+		twisim_addressed = NULL;
+	}
+}
+
+/* handle the last TWCR access if it was a write */
+static void twisim_twcr_commit(void)
+{
+	uint8_t val = twisim_twcr_io;
+
+	if (val == twisim_twcr_io_given)
+		return;
+
+	bool was_enabled = twisim_twcr_val & _BV(TWEN);
+
+	twisim_twcr_val = val & ~(_BV(TWINT) | TWISIM_TWCR_MARKER);
+	twisim_twcr_io_given = val;
+
+	if (!(val & _BV(TWEN))) {
+		if (was_enabled)
+			twisim_twi_abort();
+
+		return;
+	}
+
+	if (val & _BV(TWINT))
+		twisim_twi_command();
+}
+
+/*
+ * the marker bit flips at every access, so writing back a value read
+ * earlier is always noticed, even if it is the same otherwise
+ */
+static void twisim_twcr_refresh(void)
+{
+	uint8_t marker = (twisim_twcr_io_given & TWISIM_TWCR_MARKER) ^
+		TWISIM_TWCR_MARKER;
+
+	twisim_twcr_io = twisim_twcr_val | marker;
+	if (twisim_twint)
+		twisim_twcr_io |= _BV(TWINT);
+
+	twisim_twcr_io_given = twisim_twcr_io;
+}
+
+/* the marker bit is always set here, so any direct write is noticed */
+static void twisim_tifr3_commit(void)
+{
+	uint8_t val = twisim_tifr3_io;
+
+	if (val & TWISIM_TIFR3_MARKER)
+		return;
+
+	/* flags are cleared by writing one to them */
+	twisim_tifr3_flags &= ~val;
+}
+
+static void twisim_tifr3_refresh(void)
+{
+	twisim_tifr3_io = twisim_tifr3_flags | TWISIM_TIFR3_MARKER;
+}
+
+/* bring the model up to date with what the code did since the last time */
+static void twisim_sync(void)
+{
+	twisim_twcr_commit();
+	twisim_tifr3_commit();
+
+	if (twisim_op != TWISIM_OP_NONE && twisim_op_end <= twisim_now)
+		twisim_op_done();
+
+	if (twisim_fault_applies(TWISIM_FAULT_STALL, twisim_fault_dev) &&
+	    twisim_fault_started && twisim_scl_held_until <= twisim_now)
+		twisim_fault_finish();
+
+	twisim_scl_edges();
+
+	twisim_twcr_refresh();
+	twisim_tifr3_refresh();
+}
+
+volatile uint8_t *twisim_twcr(void)
+{
+	twisim_sync();
+
+	return &twisim_twcr_io;
+}
+
+volatile uint8_t *twisim_tifr3(void)
+{
+	twisim_sync();
+
+	return &twisim_tifr3_io;
+}
+
+uint8_t twisim_pinc(void)
+{
+	twisim_sync();
+
+	uint8_t val = 0;
+	if (twisim_scl_is_high())
+		val |= _BV(TWISIM_SCL_BIT);
+	if (twisim_sda_is_high())
+		val |= _BV(TWISIM_SDA_BIT);
+
+	return val;
+}
+
+static void twisim_isr(void (*isr)(void))
+{
+	SREG &= ~_BV(SREG_I);
+	twisim_in_isr = true;
+
+	isr();
+
+	twisim_in_isr = false;
+	SREG |= _BV(SREG_I);
+
+	twisim_irqs++;
+}
+
+/* services pending interrupts (in the vector order) while they are enabled */
+static void twisim_irq_dispatch(void)
+{
+	for (uint16_t ctr = 0; ; ctr++) {
+		if (twisim_in_isr || bit_is_clear(SREG, SREG_I))
+			return;
+
+		if (ctr >= TWISIM_IRQ_STORM) {
+			fprintf(stderr, "twisim: interrupt storm\n");
+			exit(1);
+		}
+
+		twisim_sync();
+
+		if ((TIMSK3 & _BV(OCIE3A)) &&
+		    (twisim_tifr3_flags & _BV(OCF3A))) {
+			twisim_tifr3_flags &= ~_BV(OCF3A);
+			twisim_isr(twisim_timer3_compa_vect);
+		} else if ((TIMSK3 & _BV(OCIE3B)) &&
+			   (twisim_tifr3_flags & _BV(OCF3B))) {
+			twisim_tifr3_flags &= ~_BV(OCF3B);
+			twisim_isr(twisim_timer3_compb_vect);
+		} else if ((twisim_twcr_val & (_BV(TWEN) | _BV(TWIE))) ==
+			   (_BV(TWEN) | _BV(TWIE)) && twisim_twint)
+			twisim_isr(twisim_twi_vect);
+		else
+			return;
+
+		twisim_sync();
+	}
+}
+
+void twisim_sei(void)
+{
+	SREG |= _BV(SREG_I);
+
+	twisim_irq_dispatch();
+}
+
+static uint16_t twisim_t3_prescaler(void)
+{
+	static const uint16_t divs[] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+	return divs[TCCR3B & (_BV(CS30) | _BV(CS31) | _BV(CS32))];
+}
+
+/* Timer3 counts once, CTC mode with OCR3A as the TOP */
+static void twisim_t3_count(void)
+{
+	if (TCNT3 == OCR3A) {
+		TCNT3 = 0;
+		twisim_tifr3_flags |= _BV(OCF3A);
+	} else
+		TCNT3++;
+
+	if (TCNT3 == OCR3B)
+		twisim_tifr3_flags |= _BV(OCF3B);
+}
+
+static void twisim_time_pass(uint64_t to)
+{
+	/* Timer1 runs without prescaling */
+	if (TCCR1B & (_BV(CS10) | _BV(CS11) | _BV(CS12)))
+		TCNT1 += (uint16_t)(to - twisim_now);
+
+	twisim_now = to;
+
+	if (twisim_t3_div != 0 && twisim_t3_next <= twisim_now) {
+		twisim_t3_count();
+		twisim_t3_next += twisim_t3_div;
+	}
+}
+
+/* lets the time pass to target, or only until an interrupt with until_irq */
+static void twisim_advance(uint64_t target, bool until_irq)
+{
+	uint32_t irqs = twisim_irqs;
+
+	twisim_sync();
+	twisim_irq_dispatch();
+
+	while (twisim_now < target) {
+		if (until_irq && twisim_irqs != irqs)
+			return;
+
+		uint16_t div = twisim_t3_prescaler();
+		if (div != twisim_t3_div) {
+			twisim_t3_div = div;
+			twisim_t3_next = twisim_now + div;
+		}
+
+		uint64_t next = target;
+
+		if (twisim_t3_div != 0 && twisim_t3_next < next)
+			next = twisim_t3_next;
+
+		if (twisim_op != TWISIM_OP_NONE && twisim_op_end < next)
+			next = twisim_op_end;
+
+		if (twisim_scl_held_until > twisim_now &&
+		    twisim_scl_held_until < next)
+			next = twisim_scl_held_until;
+
+		twisim_time_pass(next);
+
+		twisim_sync();
+		twisim_irq_dispatch();
+	}
+}
+
+uint64_t twisim_cycles(void)
+{
+	return twisim_now;
+}
+
+void twisim_run(uint32_t cycles)
+{
+	twisim_advance(twisim_now + cycles, false);
+}
+
+void twisim_sleep(void)
+{
+	uint32_t irqs = twisim_irqs;
+
+	SREG |= _BV(SREG_I);
+
+	while (twisim_irqs == irqs)
+		twisim_advance(UINT64_MAX, true);
+}
+
+void twisim_delay_us(double us)
+{
+	twisim_run((uint32_t)(us * (F_CPU / 1000000.0)));
+}
+
+bool twisim_tc74_add(uint8_t addr, int8_t temp)
+{
+	if (twisim_tc74s_num >= TWISIM_TC74_MAX)
+		return false;
+
+	twisim_tc74 *dev = &twisim_tc74s[twisim_tc74s_num++];
+
+	dev->addr = addr;
+	dev->temp = temp;
+	dev->config = TWISIM_TC74_CONFIG_DATA_READY;
+	dev->reg = TWISIM_TC74_REG_TEMP;
+	dev->written = 0;
+
+	return true;
+}
+
+bool twisim_fault_inject(twisim_faults fault, uint8_t addr, uint16_t param)
+{
+	if (twisim_fault != TWISIM_FAULT_NONE)
+		return false;
+
+	twisim_tc74 *dev = twisim_tc74_find(addr);
+	if (dev == NULL || param == 0)
+		return false;
+
+	twisim_fault = fault;
+	twisim_fault_dev = dev;
+	twisim_fault_param = param;
+	twisim_fault_started = false;
+	twisim_fault_over = false;
+
+	return true;
+}
+
+bool twisim_fault_is_over(uint64_t *start, uint64_t *end)
+{
+	if (!twisim_fault_over)
+		return false;
+
+	*start = twisim_fault_start;
+	*end = twisim_fault_end;
+
+	return true;
+}
+
+void twisim_setup(void)
+{
+	twisim_now = 0;
+	twisim_irqs = 0;
+	twisim_in_isr = false;
+
+	/* interrupts are disabled after a reset */
+	SREG = 0;
+
+	twisim_t3_div = 0;
+	twisim_tifr3_flags = 0;
+	twisim_tifr3_refresh();
+
+	twisim_twcr_val = 0;
+	twisim_twint = false;
+	twisim_twcr_io_given = 0;
+	twisim_twcr_refresh();
+
+	twisim_op = TWISIM_OP_NONE;
+	twisim_master = false;
+	twisim_phase = TWISIM_PHASE_IDLE;
+	twisim_addressed = NULL;
+
+	twisim_tc74s_num = 0;
+
+	twisim_fault = TWISIM_FAULT_NONE;
+	twisim_fault_dev = NULL;
+	twisim_fault_started = false;
+	twisim_fault_over = false;
+
+	twisim_sda_held = false;
+	twisim_scl_held_until = 0;
+	twisim_scl_was_high = true;
+}
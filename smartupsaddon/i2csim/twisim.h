@@ -0,0 +1,80 @@
+/*
+ * Smart UPS Addon: I2C bus simulation, TWI register model
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _I2CSIM_TWISIM_H_
+#define _I2CSIM_TWISIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * an ATmega1284 model just detailed enough to run the unmodified lib/i2c.c
+ * (and what it uses) on the host: the TWI, its pins, Timer1 as a cycle
+ * counter, Timer3 as the timekeeping timer, SREG and the three interrupts
+ * of these, all against a simulated cycle clock at F_CPU
+ *
+ * time only moves when the code under test waits (busy waits, sleeping) or
+ * when twisim_run() is called for the time the code would have taken, so
+ * the results depend on the model, not on how fast the host is
+ *
+ * the bus has virtual TC74 sensors on it, faults can be injected into them
+ */
+
+/*
+ * the fault classes, param is:
+ * TWISIM_FAULT_STUCK_SDA - how many SCL clocks the sensor needs to let go of
+ * SDA after it got lost in the middle of a byte it was sending
+ * TWISIM_FAULT_ADDR_NACK - how many address phases in a row it NACKs
+ * TWISIM_FAULT_ARB_LOST - how many address phases in a row lose arbitration
+ * (to a phantom master)
+ * TWISIM_FAULT_STALL - for how many ms it holds SCL low in the middle of
+ * a byte
+ * TWISIM_FAULT_NO_STOP - how many STOPs in a row never get onto the bus
+ * (the TWI keeps TWSTO set until it is reset)
+ */
+typedef enum { TWISIM_FAULT_NONE, TWISIM_FAULT_STUCK_SDA,
+	       TWISIM_FAULT_ADDR_NACK, TWISIM_FAULT_ARB_LOST,
+	       TWISIM_FAULT_STALL, TWISIM_FAULT_NO_STOP } twisim_faults;
+
+/* the simulated time in CPU cycles */
+uint64_t twisim_cycles(void);
+
+/* lets cycles pass, servicing interrupts if they are enabled */
+void twisim_run(uint32_t cycles);
+
+/*
+ * sleep_cpu() (the idle mode): enables interrupts and lets the time pass
+ * until one is serviced
+ */
+void twisim_sleep(void);
+
+/*
+ * add a virtual TC74 at addr reporting temp °C, returns false if there is
+ * no room for another one
+ */
+bool twisim_tc74_add(uint8_t addr, int8_t temp);
+
+/*
+ * arm a fault of the sensor at addr, it starts with the next bus operation
+ * it applies to, returns false if another one is still in progress
+ */
+bool twisim_fault_inject(twisim_faults fault, uint8_t addr, uint16_t param);
+
+/*
+ * returns whether the last injected fault is over, then start and end are set
+ * to the times (in cycles) the sensor first and last misbehaved
+ */
+bool twisim_fault_is_over(uint64_t *start, uint64_t *end);
+
+/* reset the model: must be called before anything else */
+void twisim_setup(void);
+
+#endif
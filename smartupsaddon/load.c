@@ -0,0 +1,227 @@
+/*
+ * Smart UPS Addon: CPU load accounting
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "../lib/cycles.h"
+#include "../lib/debug.h"
+#include "../lib/timekeeping.h"
+#include "load.h"
+
+/* length (in ms) of an accounting period */
+#define LOAD_PERIOD 10000
+
+/* period (in ms) over which the wakeups and busy loops are counted */
+#define LOAD_WAKEUPS_PERIOD ((uint32_t)60 * 60 * 1000)
+
+static const char load_name_temp[] PROGMEM = "temp";
+static const char load_name_serial[] PROGMEM = "serial";
+static const char load_name_i2c[] PROGMEM = "i2c";
+static const char load_name_i2csoft[] PROGMEM = "i2c soft";
+static const char load_name_i2c_atomic[] PROGMEM = "i2c atomic";
+static const char load_name_serial_atomic[] PROGMEM = "serial atomic";
+
+static PGM_P const load_names[LOAD_MODULES_NUM] PROGMEM = {
+	[LOAD_TEMP] = load_name_temp,
+	[LOAD_SERIAL] = load_name_serial,
+	[LOAD_I2C] = load_name_i2c,
+	[LOAD_I2CSOFT] = load_name_i2csoft,
+	[LOAD_I2C_ATOMIC] = load_name_i2c_atomic,
+	[LOAD_SERIAL_ATOMIC] = load_name_serial_atomic
+};
+
+/* the current accounting period */
+static timestamp load_period_start;
+static uint32_t load_loops;
+static uint32_t load_cycles[LOAD_MODULES_NUM];
+static uint32_t load_sleep_counts;
+static timestamp load_sleep_start;
+
+/* results of the last finished accounting period */
+static uint16_t load_last_loops_per_sec;
+static uint16_t load_last_sleep_permille;
+static uint16_t load_last_module_permille[LOAD_MODULES_NUM];
+
+/* the current wakeups period and the results of the last finished one */
+static timestamp load_wakeups_period_end;
+static uint32_t load_wakeups;
+static uint32_t load_busy_loops;
+static uint32_t load_last_wakeups;
+static uint32_t load_last_busy_loops;
+
+static uint16_t load_calc_permille(uint64_t part, uint64_t whole)
+{
+	uint64_t val;
+
+	if (whole == 0)
+		return 0;
+
+	val = part * 1000 / whole;
+
+	return val <= 1000 ? val : 1000;
+}
+
+static void load_reset_period(const timestamp *now)
+{
+	load_period_start = *now;
+	load_loops = 0;
+	load_sleep_counts = 0;
+
+	for (uint8_t ctr = 0; ctr < LOAD_MODULES_NUM; ctr++)
+		load_cycles[ctr] = 0;
+}
+
+static void load_end_period(const timestamp *now)
+{
+	timestamp_interval period;
+	timestamp_diff(now, &load_period_start, &period);
+
+	/* each timer count is TIMEKEEPING_DIV CPU cycles */
+	uint32_t period_counts = timestampi_to_counts(&period);
+	uint64_t loops_per_sec = (uint64_t)load_loops * TIMEKEEPING_HZ *
+		timekeeping_counts_per_tick() / period_counts;
+
+	load_last_loops_per_sec = loops_per_sec <= UINT16_MAX ?
+		loops_per_sec : UINT16_MAX;
+	load_last_sleep_permille = load_calc_permille(load_sleep_counts,
+						      period_counts);
+
+	for (uint8_t ctr = 0; ctr < LOAD_MODULES_NUM; ctr++)
+		load_last_module_permille[ctr] =
+			load_calc_permille(load_cycles[ctr],
+					   (uint64_t)period_counts *
+					   TIMEKEEPING_DIV);
+
+	load_reset_period(now);
+}
+
+static void load_wakeups_update(const timestamp *now)
+{
+	const timestamp_interval wakeups_period =
+		TIMESTAMPI_FROM_MS(LOAD_WAKEUPS_PERIOD);
+
+	if (timestamp_temporal_cmp(now, &load_wakeups_period_end, <))
+		return;
+
+	load_last_wakeups = load_wakeups;
+	load_wakeups = 0;
+	load_last_busy_loops = load_busy_loops;
+	load_busy_loops = 0;
+
+	dprintf_P(PSTR("load: %"PRIu32" wakeups, %"PRIu32" busy loops "
+		       "in the last hour\n"),
+		  load_last_wakeups, load_last_busy_loops);
+
+	timestamp_add(now, &wakeups_period, &load_wakeups_period_end);
+}
+
+void load_poll(void)
+{
+	const timestamp_interval load_period = TIMESTAMPI_FROM_MS(LOAD_PERIOD);
+
+	load_loops++;
+
+	timestamp now, period_end;
+	timekeeping_now_timestamp(&now);
+
+	load_wakeups_update(&now);
+
+	timestamp_add(&load_period_start, &load_period, &period_end);
+	if (timestamp_temporal_cmp(&now, &period_end, <))
+		return;
+
+	load_end_period(&now);
+}
+
+void load_account(uint8_t module, uint16_t *start)
+{
+	uint16_t now = cycles_now();
+
+	load_cycles[module] += (uint16_t)(now - *start);
+	*start = now;
+}
+
+void load_sleep_begin_atomic(void)
+{
+	timekeeping_now_timestamp_atomic(&load_sleep_start);
+}
+
+void load_sleep_end(void)
+{
+	timestamp now;
+	timestamp_interval sleep_time;
+
+	timekeeping_now_timestamp(&now);
+	timestamp_diff(&now, &load_sleep_start, &sleep_time);
+
+	load_sleep_counts += timestampi_to_counts(&sleep_time);
+
+	load_wakeups++;
+}
+
+void load_no_sleep(void)
+{
+	load_busy_loops++;
+}
+
+uint16_t load_loops_per_sec(void)
+{
+	return load_last_loops_per_sec;
+}
+
+uint16_t load_sleep_permille(void)
+{
+	return load_last_sleep_permille;
+}
+
+uint16_t load_module_permille(uint8_t module)
+{
+	return load_last_module_permille[module];
+}
+
+uint32_t load_wakeups_last_hour(void)
+{
+	return load_last_wakeups;
+}
+
+uint32_t load_busy_loops_last_hour(void)
+{
+	return load_last_busy_loops;
+}
+
+PGM_P load_module_name(uint8_t module)
+{
+	return (PGM_P)pgm_read_word(&load_names[module]);
+}
+
+void load_setup(void)
+{
+	const timestamp_interval wakeups_period =
+		TIMESTAMPI_FROM_MS(LOAD_WAKEUPS_PERIOD);
+
+	timestamp now;
+	timekeeping_now_timestamp(&now);
+
+	load_reset_period(&now);
+
+	load_last_loops_per_sec = 0;
+	load_last_sleep_permille = 0;
+	for (uint8_t ctr = 0; ctr < LOAD_MODULES_NUM; ctr++)
+		load_last_module_permille[ctr] = 0;
+
+	timestamp_add(&now, &wakeups_period, &load_wakeups_period_end);
+	load_wakeups = 0;
+	load_busy_loops = 0;
+	load_last_wakeups = 0;
+	load_last_busy_loops = 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Smart UPS Addon: CPU load accounting
+ *
+ * Copyright (C) 2017 Maciej S. Szmigiero <mail@maciej.szmigiero.name>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef _LOAD_H_
+#define _LOAD_H_
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/* main loop parts whose CPU time is accounted separately */
+typedef enum { LOAD_TEMP, LOAD_SERIAL, LOAD_I2C, LOAD_I2CSOFT,
+	       LOAD_I2C_ATOMIC, LOAD_SERIAL_ATOMIC, LOAD_MODULES_NUM
+} load_modules;
+
+/*
+ * should be called at the start of every main loop iteration, counts these
+ * iterations and finishes the current accounting period when it is due
+ */
+void load_poll(void);
+
+/*
+ * account the CPU cycles from *start to now to module, then set *start to
+ * now, so the next module can be accounted right away
+ *
+ * a single module run must take less than 65536 cycles
+ */
+void load_account(/* load_modules */ uint8_t module, uint16_t *start);
+
+/*
+ * should be called right before the µC goes to sleep (with interrupts
+ * disabled) and right after it wakes up, respectively
+ */
+void load_sleep_begin_atomic(void);
+void load_sleep_end(void);
+
+/* should be called instead of them when a main loop iteration didn't sleep */
+void load_no_sleep(void);
+
+/*
+ * results of the last finished accounting period: main loop iterations per
+ * second and fractions (in ‰) of time spent sleeping or in a module
+ */
+uint16_t load_loops_per_sec(void);
+uint16_t load_sleep_permille(void);
+uint16_t load_module_permille(/* load_modules */ uint8_t module);
+
+/*
+ * µC wakeups and main loop iterations that didn't sleep in the last finished
+ * hour
+ */
+uint32_t load_wakeups_last_hour(void);
+uint32_t load_busy_loops_last_hour(void);
+
+/* returns the (short) name of a module, in program memory */
+PGM_P load_module_name(/* load_modules */ uint8_t module);
+
+/*
+ * setup the load accounting: must be called before any other load function,
+ * must be called with interrupts disabled, uses timekeeping and cycles
+ * functions
+ */
+void load_setup(void);
+
+#endif
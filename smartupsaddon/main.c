@@ -11,20 +11,44 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <avr/cpufunc.h>
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/power.h>
 #include <avr/signature.h>
 #include <avr/sleep.h>
 #include <avr/wdt.h>
+#include <util/atomic.h>
 
+#include "../lib/critprof.h"
+#include "../lib/cycles.h"
 #include "../lib/debug.h"
 #include "../lib/i2c.h"
+#include "../lib/i2csoft.h"
 #include "../lib/misc.h"
+#include "../lib/pending.h"
+#include "../lib/sched.h"
 #include "../lib/timekeeping.h"
+#include "load.h"
 #include "serial.h"
 #include "temp.h"
 
+/*
+ * the longest (in ms) the µC is allowed to sleep, must be well below the
+ * watchdog timeout
+ */
+#define MAIN_SLEEP_MAX 2000
+
+#ifdef TIMEKEEPING_CLOCK_SCALING
+/*
+ * the shortest (in ms) expected idle period for which the system clock gets
+ * divided
+ */
+#define MAIN_CLOCK_SCALING_MIN_IDLE 50
+
+static bool main_clock_can_scale;
+#endif
+
 LOCKBITS = LB_MODE_1 & BLB0_MODE_1 & BLB1_MODE_2;
 
 FUSES = {
@@ -118,6 +142,14 @@ static void i2c_ports_setup(void)
 	PORTC &= ~(_BV(PORTC0) | _BV(PORTC1));
 }
 
+#ifdef ENABLE_I2CSOFT
+static void i2csoft_ports_setup(void)
+{
+	DDRA &= ~(_BV(DD0) | _BV(DD1));
+	PORTA &= ~(_BV(PORTA0) | _BV(PORTA1));
+}
+#endif
+
 static void setup(void)
 {
 	wdt_setup();
@@ -131,6 +163,9 @@ static void setup(void)
 	serial0_ports_setup();
 	serial1_ports_setup();
 	i2c_ports_setup();
+#ifdef ENABLE_I2CSOFT
+	i2csoft_ports_setup();
+#endif
 	ports_pullup_enable();
 
 	serial01_ports_passthrough(true);
@@ -139,36 +174,87 @@ static void setup(void)
 
 	debug_setup();
 
+	pending_setup();
+	sched_setup();
+
+	cycles_setup();
+	critprof_setup();
+	load_setup();
+
 	i2c_setup();
+#ifdef ENABLE_I2CSOFT
+	i2csoft_setup();
+#endif
 
 	temp_setup();
 
 	serial_setup();
 	serial01_ports_passthrough(false);
 
+#ifdef TIMEKEEPING_CLOCK_SCALING
+	main_clock_can_scale = serial_can_clock_scale();
+	if (!main_clock_can_scale)
+		dprintf_P(PSTR("main: serial baud rates prevent clock scaling\n"));
+#endif
+
 	wdt_reset();
 }
 
-#define MAIN_GET_TIMEOUT(funname, ...)					\
-	do {								\
-		timestamp module_next_poll_time;			\
-		funname(__VA_ARGS__ &module_next_poll_time);		\
-		if (!next_poll_time_set ||				\
-		    timestamp_temporal_cmp(&module_next_poll_time,	\
-					   &next_poll_time,		\
-					   <)) {			\
-			next_poll_time = module_next_poll_time;	\
-			next_poll_time_set = true;			\
-		}							\
-	} while (0)
+#ifdef TIMEKEEPING_CLOCK_SCALING
+static void main_clock_scale_atomic(bool scaled)
+{
+	if (timekeeping_clock_is_scaled() == scaled)
+		return;
+
+	timekeeping_clock_scale_atomic(scaled);
+	serial_clock_scale_atomic(scaled);
+}
+
+/* modules are always polled with the system clock at the full speed */
+static void main_clock_unscale(void)
+{
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_MemoryBarrier();
+		main_clock_scale_atomic(false);
+		_MemoryBarrier();
+	}
+}
+
+/*
+ * the I2C bus clock isn't adjusted, so the system clock can only be divided
+ * when there is no I2C transaction in progress
+ */
+static void main_clock_maybe_scale_atomic(const timestamp *next_poll_time)
+{
+	const timestamp_interval min_idle =
+		TIMESTAMPI_FROM_MS(MAIN_CLOCK_SCALING_MIN_IDLE);
+
+	timestamp now, min_idle_end;
+
+	if (!main_clock_can_scale)
+		return;
+
+	if (!i2c_is_idle_atomic() || !serial_is_idle_atomic())
+		return;
+
+#ifdef ENABLE_I2CSOFT
+	/* the bus clock comes from delay loops */
+	if (!i2csoft_is_idle())
+		return;
+#endif
+
+	timekeeping_now_timestamp_atomic(&now);
+	timestamp_add(&now, &min_idle, &min_idle_end);
+	if (timestamp_temporal_cmp(next_poll_time, &min_idle_end, <))
+		return;
+
+	main_clock_scale_atomic(true);
+}
+#endif
 
 int main(void)
 {
-	/* a tick will always wake us up */
-	const timestamp_interval worst_sleep_interval = {
-		.ticks = 1,
-		.counts = 0
-	};
+	const timestamp_interval sleep_max = TIMESTAMPI_FROM_MS(MAIN_SLEEP_MAX);
 
 	cli();
 	setup();
@@ -178,45 +264,107 @@ int main(void)
 
 	set_sleep_mode(SLEEP_MODE_IDLE);
 	while (1) {
-		temp_poll();
-		serial_poll();
+		load_poll();
+
+		/*
+		 * only modules that had some work signalled by their interrupt
+		 * handlers or whose deadlines have come get polled, so for
+		 * example a fan tachometer pulse (which just gets its
+		 * timestamp recorded) doesn't make us poll anything
+		 */
+		uint8_t work = pending_take() | sched_get_due_work();
+
+#ifdef TIMEKEEPING_CLOCK_SCALING
+		if (work != 0)
+			main_clock_unscale();
+#endif
+
+		if (work & _BV(PENDING_CRITPROF))
+			critprof_poll();
+
+		uint16_t load_start = cycles_now();
+		if (work & _BV(TEMP_PENDING)) {
+			temp_poll();
+			load_account(LOAD_TEMP, &load_start);
+		}
+		if (work & _BV(PENDING_SERIAL)) {
+			serial_poll();
+			load_account(LOAD_SERIAL, &load_start);
+		}
+		if (work & _BV(PENDING_I2C)) {
+			i2c_poll();
+			load_account(LOAD_I2C, &load_start);
+		}
+#ifdef ENABLE_I2CSOFT
+		if (work & _BV(PENDING_I2CSOFT)) {
+			i2csoft_poll();
+			load_account(LOAD_I2CSOFT, &load_start);
+		}
+#endif
 
 		cli();
+		uint16_t critprof_start = critprof_enter();
 
-		i2c_poll_atomic();
-		serial_poll_atomic();
-
-		bool can_sleep = true;
+		if (work & _BV(PENDING_I2C)) {
+			i2c_poll_atomic();
+			load_account(LOAD_I2C_ATOMIC, &load_start);
+		}
+		if (work & _BV(PENDING_SERIAL)) {
+			serial_poll_atomic();
+			load_account(LOAD_SERIAL_ATOMIC, &load_start);
+		}
 
 		timestamp next_poll_time;
-		bool next_poll_time_set = false;
-
-		MAIN_GET_TIMEOUT(temp_get_next_poll_time);
-		MAIN_GET_TIMEOUT(serial_get_next_poll_time);
-		MAIN_GET_TIMEOUT(i2c_get_next_poll_time);
-
-		if (next_poll_time_set) {
-			timestamp now, worst_wakeup_time;
-			timekeeping_now_timestamp(&now);
-			timestamp_add(&now, &worst_sleep_interval,
-				      &worst_wakeup_time);
-
-			if (timestamp_temporal_cmp(&next_poll_time,
-						   &worst_wakeup_time,
-						   <))
-				can_sleep = false;
-		}
+
+		if (serial_needs_poll()) {
+			/* serial_poll() handles one character at a time */
+			pending_set(PENDING_SERIAL);
+			timekeeping_now_timestamp_atomic(&next_poll_time);
+		} else
+			sched_get_next_poll_time(&next_poll_time);
+
+		do {
+			/* in the tickless mode no tick will wake us up */
+			timestamp now, sleep_max_time;
+			timekeeping_now_timestamp_atomic(&now);
+			timestamp_add(&now, &sleep_max, &sleep_max_time);
+
+			if (timestamp_temporal_cmp(&sleep_max_time,
+						   &next_poll_time, <))
+				next_poll_time = sleep_max_time;
+		} while (0);
+
+#ifdef TIMEKEEPING_CLOCK_SCALING
+		main_clock_maybe_scale_atomic(&next_poll_time);
+#endif
+
+		/*
+		 * the timer will wake us up at the next poll time, even if it
+		 * is less than a tick away, work flagged by an interrupt
+		 * handler since pending_take() is done right away
+		 */
+		bool can_sleep = !pending_any_atomic() &&
+			timekeeping_set_next_wakeup_atomic(&next_poll_time);
 
 		wdt_reset();
 
+		critprof_exit(CRITPROF_SITE(), critprof_start);
+
 		if (can_sleep) {
+			load_sleep_begin_atomic();
+
 			sleep_enable();
 			sei();
 			sleep_cpu();
 			sleep_disable();
 			wdt_reset();
-		} else
+
+			load_sleep_end();
+		} else {
 			sei();
+
+			load_no_sleep();
+		}
 	}
 
 	return 0;
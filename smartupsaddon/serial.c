@@ -17,14 +17,19 @@
 #include <avr/pgmspace.h>
 
 #include "../lib/debug.h"
+#include "../lib/i2c.h"
 #include "../lib/misc.h"
+#include "../lib/sched.h"
 #include "fan.h"
+#include "load.h"
 #include "serial-base.h"
 #include "serial.h"
 #include "temp.h"
 
 /*
- * how long (in ms) to wait after receiving 'y' command
+ * how long (in ms) to wait after receiving 'y' command (or one of our own
+ * stats commands below, so their replies don't get mixed with the UPS CPU
+ * output)
  *
  * however, we don't wait at all if there was at least that long period of
  * silence from CPU before and after we received that command (taken together)
@@ -38,6 +43,15 @@
 #define SERIAL_Y_REPLY_MATCH_STR "(C) "
 #define SERIAL_Y_REPLY_MATCH_TIMEOUT 1000
 
+/*
+ * command (not used by the UPS-Link protocol) that is answered by the addon
+ * itself with its CPU load stats
+ */
+#define SERIAL_LOAD_CMD '{'
+
+/* the same, but with I2C bus recovery and per device statistics */
+#define SERIAL_I2C_CMD '}'
+
 #ifdef SERIAL_DEBUG_LOG_DISABLE
 #undef dprintf
 #undef dprintf_P
@@ -54,7 +68,17 @@ typedef enum { SERIAL_IDLE,
 	       SERIAL_Y_RECV_REPLY_PRINT_TEMP,
 	       SERIAL_Y_RECV_REPLY_PRINT_TEMP_NEXT,
 	       SERIAL_Y_RECV_REPLY_PRINT_CRLF,
-	       SERIAL_Y_RECV_FAIL_MATCH
+	       SERIAL_Y_RECV_FAIL_MATCH,
+	       SERIAL_LOAD_PRINT_HEADER,
+	       SERIAL_LOAD_PRINT_MODULE,
+	       SERIAL_LOAD_PRINT_MODULE_NEXT,
+	       SERIAL_LOAD_PRINT_WAKEUPS,
+	       SERIAL_LOAD_PRINT_CRLF,
+	       SERIAL_I2C_PRINT_HEADER,
+	       SERIAL_I2C_PRINT_DEVICE,
+	       SERIAL_I2C_PRINT_DEVICE_TAIL,
+	       SERIAL_I2C_PRINT_DEVICE_NEXT,
+	       SERIAL_I2C_PRINT_CRLF
 } serial_states;
 
 static /* serial_states */ uint8_t serial_state;
@@ -81,8 +105,13 @@ static timestamp serialcpu_last_rx;
 static timestamp serialcpu_y_recv_gap_end;
 static timestamp serialcpu_y_reply_deadline;
 
+static sched_timer serial_sched_timer;
+
 static uint8_t serial_tmp_ctr;
 
+/* the command that the silence wait states are for */
+static uint8_t serial_silence_cmd;
+
 #define SERIAL_SETSTATE(state_new)					\
 	do								\
 		if (serial_state != state_new) {			\
@@ -117,15 +146,69 @@ static bool serial_is_y_reply_print_state(void)
 		serial_state == SERIAL_Y_RECV_REPLY_PRINT_CRLF;
 }
 
+static bool serial_is_load_print_state(void)
+{
+	return serial_state == SERIAL_LOAD_PRINT_HEADER ||
+		serial_state == SERIAL_LOAD_PRINT_MODULE ||
+		serial_state == SERIAL_LOAD_PRINT_MODULE_NEXT ||
+		serial_state == SERIAL_LOAD_PRINT_WAKEUPS ||
+		serial_state == SERIAL_LOAD_PRINT_CRLF;
+}
+
+static bool serial_is_i2c_print_state(void)
+{
+	return serial_state == SERIAL_I2C_PRINT_HEADER ||
+		serial_state == SERIAL_I2C_PRINT_DEVICE ||
+		serial_state == SERIAL_I2C_PRINT_DEVICE_TAIL ||
+		serial_state == SERIAL_I2C_PRINT_DEVICE_NEXT ||
+		serial_state == SERIAL_I2C_PRINT_CRLF;
+}
+
+/* states in which neither host nor UPS CPU data is passed through */
+static bool serial_is_conn_busy_state(void)
+{
+	return serial_is_y_recv_state() || serial_is_load_print_state() ||
+		serial_is_i2c_print_state();
+}
+
+static bool serial_is_cpu_busy_state(void)
+{
+	return serial_state == SERIAL_Y_RECV_REPLY_MATCH ||
+		serial_state == SERIAL_Y_RECV_REPLY_WAIT_CRLF ||
+		serial_is_y_reply_print_state() ||
+		serial_is_load_print_state() ||
+		serial_is_i2c_print_state();
+}
+
 static bool serial_is_conn_tx_empty_wait_state(void)
 {
 	return serial_state == SERIAL_Y_RECV_REPLY_PRINT_FAN_HEADER ||
 		serial_state == SERIAL_Y_RECV_REPLY_PRINT_FAN ||
 		serial_state == SERIAL_Y_RECV_REPLY_PRINT_TEMP_HEADER ||
 		serial_state == SERIAL_Y_RECV_REPLY_PRINT_TEMP ||
-		serial_state == SERIAL_Y_RECV_REPLY_PRINT_CRLF;
+		serial_state == SERIAL_Y_RECV_REPLY_PRINT_CRLF ||
+		serial_state == SERIAL_LOAD_PRINT_HEADER ||
+		serial_state == SERIAL_LOAD_PRINT_MODULE ||
+		serial_state == SERIAL_LOAD_PRINT_WAKEUPS ||
+		serial_state == SERIAL_LOAD_PRINT_CRLF ||
+		serial_state == SERIAL_I2C_PRINT_HEADER ||
+		serial_state == SERIAL_I2C_PRINT_DEVICE ||
+		serial_state == SERIAL_I2C_PRINT_DEVICE_TAIL ||
+		serial_state == SERIAL_I2C_PRINT_CRLF;
+}
+
+static bool serial_i2c_device_exists(uint8_t idx)
+{
+	i2c_device_stats stats;
+
+	return i2c_get_device_stats(idx, &stats);
 }
 
+/* prints a ‰ value as a percentage with one decimal digit */
+#define SERIALCONN_PRINT_PERMILLE(value)				\
+	SERIALCONN_PRINTF(sizeof("100.0%"), PSTR("%" PRIu16 ".%" PRIu16 "%%"), \
+			  (uint16_t)((value) / 10), (uint16_t)((value) % 10))
+
 #define SERIALCONN_PRINTF(buflen, format, ...)				\
 	do {								\
 		uint8_t tmp_serialconnf_printf_buf[buflen];		\
@@ -240,22 +323,101 @@ static void serial_set_state_do(serial_states state_new)
 		}
 	} else if (serial_state == SERIAL_Y_RECV_REPLY_PRINT_TEMP_NEXT)
 		serial_tmp_ctr++;
-	else if (serial_state == SERIAL_Y_RECV_REPLY_PRINT_CRLF) {
+	else if (serial_state == SERIAL_Y_RECV_REPLY_PRINT_CRLF ||
+		 serial_state == SERIAL_LOAD_PRINT_CRLF ||
+		 serial_state == SERIAL_I2C_PRINT_CRLF) {
 		serialconn_tx_put('\r');
 		serialconn_tx_put('\n');
-	}
+	} else if (serial_state == SERIAL_LOAD_PRINT_HEADER) {
+		SERIALCONN_PRINTF(sizeof("Loop: 65535/s, Sleep: "),
+				  PSTR("Loop: %" PRIu16 "/s, Sleep: "),
+				  load_loops_per_sec());
+		SERIALCONN_PRINT_PERMILLE(load_sleep_permille());
+
+		serial_tmp_ctr = 0;
+	} else if (serial_state == SERIAL_LOAD_PRINT_MODULE) {
+		serialconn_tx_put(',');
+		serialconn_tx_put(' ');
+
+		SERIALCONN_PRINTF(sizeof("serial atomic: "), PSTR("%S: "),
+				  load_module_name(serial_tmp_ctr));
+		SERIALCONN_PRINT_PERMILLE(load_module_permille(serial_tmp_ctr));
+	} else if (serial_state == SERIAL_LOAD_PRINT_MODULE_NEXT)
+		serial_tmp_ctr++;
+	else if (serial_state == SERIAL_LOAD_PRINT_WAKEUPS)
+		SERIALCONN_PRINTF(sizeof(", Wakeups: 4294967295/h, "
+					 "Busy: 4294967295/h"),
+				  PSTR(", Wakeups: %" PRIu32 "/h, Busy: %"
+				       PRIu32 "/h"),
+				  load_wakeups_last_hour(),
+				  load_busy_loops_last_hour());
+	else if (serial_state == SERIAL_I2C_PRINT_HEADER) {
+		i2c_recovery_stats stats;
+
+		i2c_get_recovery_stats(&stats);
+
+		SERIALCONN_PRINTF(sizeof("I2C: clears 65535 (failed 65535), "
+					 "resets 65535"),
+				  PSTR("I2C: clears %" PRIu16
+				       " (failed %" PRIu16 "), resets %"
+				       PRIu16),
+				  stats.bus_clears, stats.bus_clear_failures,
+				  stats.twi_resets);
+
+		serial_tmp_ctr = 0;
+	} else if (serial_state == SERIAL_I2C_PRINT_DEVICE) {
+		i2c_device_stats stats;
+
+		/* checked before entering this state */
+		i2c_get_device_stats(serial_tmp_ctr, &stats);
+
+		SERIALCONN_PRINTF(sizeof(", 7f: ok 65535 anack 65535 "
+					 "dnack 65535 berr 65535"),
+				  PSTR(", %02x: ok %" PRIu16 " anack %" PRIu16
+				       " dnack %" PRIu16 " berr %" PRIu16),
+				  (unsigned)stats.addr, stats.ok,
+				  stats.addr_nacks, stats.data_nacks,
+				  stats.bus_errors);
+	} else if (serial_state == SERIAL_I2C_PRINT_DEVICE_TAIL) {
+		i2c_device_stats stats;
+
+		i2c_get_device_stats(serial_tmp_ctr, &stats);
+
+		SERIALCONN_PRINTF(sizeof(" arb 65535 tout 65535 rst 65535 "
+					 "lat 65535/65535/65535us"),
+				  PSTR(" arb %" PRIu16 " tout %" PRIu16
+				       " rst %" PRIu16 " lat %" PRIu16 "/%"
+				       PRIu16 "/%" PRIu16 "us"),
+				  stats.arb_losses, stats.timeouts,
+				  stats.resets, stats.latency_min,
+				  stats.latency_avg, stats.latency_max);
+	} else if (serial_state == SERIAL_I2C_PRINT_DEVICE_NEXT)
+		serial_tmp_ctr++;
+}
+
+/* the UPS CPU was silent long enough, go on with the command */
+static void serial_silence_end(void)
+{
+	if (serial_silence_cmd == SERIAL_LOAD_CMD)
+		SERIAL_SETSTATE(SERIAL_LOAD_PRINT_HEADER);
+	else if (serial_silence_cmd == SERIAL_I2C_CMD)
+		SERIAL_SETSTATE(SERIAL_I2C_PRINT_HEADER);
+	else
+		SERIAL_SETSTATE(SERIAL_Y_RECV_REPLY_MATCH);
 }
 
 static void serialconn_rx_service(void)
 {
-	if (serial_is_y_recv_state())
+	if (serial_is_conn_busy_state())
 		return;
 
 	uint8_t rxchar;
 	if (!serialconn_rx_get(&rxchar))
 		return;
 
-	if (rxchar == 'y') {
+	if (rxchar == 'y' || rxchar == SERIAL_LOAD_CMD ||
+	    rxchar == SERIAL_I2C_CMD) {
+		serial_silence_cmd = rxchar;
 		SERIAL_SETSTATE(SERIAL_Y_RECV_SILENCE_WAIT);
 		return;
 	}
@@ -265,9 +427,7 @@ static void serialconn_rx_service(void)
 
 static void serialcpu_rx_service(void)
 {
-	if (serial_state == SERIAL_Y_RECV_REPLY_MATCH ||
-	    serial_state == SERIAL_Y_RECV_REPLY_WAIT_CRLF ||
-	    serial_is_y_reply_print_state())
+	if (serial_is_cpu_busy_state())
 		return;
 
 	uint8_t rxchar;
@@ -282,7 +442,29 @@ static void serialcpu_rx_service(void)
 		SERIAL_SETSTATE(SERIAL_Y_RECV_SILENCE_GAP);
 }
 
-void serial_poll(void)
+static void serial_sched_update(void)
+{
+	if (serial_state_changed)
+		sched_timer_set_now(&serial_sched_timer);
+	else if (serial_state == SERIAL_Y_RECV_SILENCE_WAIT) {
+		const timestamp_interval recv_y_silence =
+			TIMESTAMPI_FROM_MS(SERIAL_Y_RECV_SILENCE);
+		timestamp silence_end;
+
+		timestamp_add(&serialcpu_last_rx, &recv_y_silence,
+			      &silence_end);
+		sched_timer_set(&serial_sched_timer, &silence_end);
+	} else if (serial_state == SERIAL_Y_RECV_SILENCE_GAP)
+		sched_timer_set(&serial_sched_timer, &serialcpu_y_recv_gap_end);
+	else if (serial_state == SERIAL_Y_RECV_REPLY_MATCH ||
+		 serial_state == SERIAL_Y_RECV_REPLY_WAIT_CRLF)
+		sched_timer_set(&serial_sched_timer,
+				&serialcpu_y_reply_deadline);
+	else
+		sched_timer_clear(&serial_sched_timer);
+}
+
+static void serial_poll_do(void)
 {
 	serial_state_changed = false;
 
@@ -306,7 +488,7 @@ void serial_poll(void)
 					   <))
 			return;
 
-		SERIAL_SETSTATE(SERIAL_Y_RECV_REPLY_MATCH);
+		serial_silence_end();
 	} else if (serial_state == SERIAL_Y_RECV_SILENCE_GAP) {
 		timestamp now;
 		timekeeping_now_timestamp(&now);
@@ -314,7 +496,7 @@ void serial_poll(void)
 					   <))
 			return;
 
-		SERIAL_SETSTATE(SERIAL_Y_RECV_REPLY_MATCH);
+		serial_silence_end();
 	} else if (serial_state == SERIAL_Y_RECV_REPLY_MATCH) {
 		uint8_t matchbuf[strlen(SERIAL_Y_REPLY_MATCH_STR)];
 
@@ -363,18 +545,52 @@ void serial_poll(void)
 			SERIAL_SETSTATE(SERIAL_Y_RECV_REPLY_PRINT_TEMP);
 		else if (serial_state == SERIAL_Y_RECV_REPLY_PRINT_TEMP)
 			SERIAL_SETSTATE(SERIAL_Y_RECV_REPLY_PRINT_TEMP_NEXT);
-		else /* SERIAL_Y_RECV_REPLY_PRINT_CRLF */
+		else if (serial_state == SERIAL_LOAD_PRINT_HEADER)
+			SERIAL_SETSTATE(SERIAL_LOAD_PRINT_MODULE);
+		else if (serial_state == SERIAL_LOAD_PRINT_MODULE)
+			SERIAL_SETSTATE(SERIAL_LOAD_PRINT_MODULE_NEXT);
+		else if (serial_state == SERIAL_LOAD_PRINT_WAKEUPS)
+			SERIAL_SETSTATE(SERIAL_LOAD_PRINT_CRLF);
+		else if (serial_state == SERIAL_I2C_PRINT_HEADER) {
+			if (serial_i2c_device_exists(serial_tmp_ctr))
+				SERIAL_SETSTATE(SERIAL_I2C_PRINT_DEVICE);
+			else
+				SERIAL_SETSTATE(SERIAL_I2C_PRINT_CRLF);
+		} else if (serial_state == SERIAL_I2C_PRINT_DEVICE)
+			SERIAL_SETSTATE(SERIAL_I2C_PRINT_DEVICE_TAIL);
+		else if (serial_state == SERIAL_I2C_PRINT_DEVICE_TAIL)
+			SERIAL_SETSTATE(SERIAL_I2C_PRINT_DEVICE_NEXT);
+		else /*
+		      * SERIAL_Y_RECV_REPLY_PRINT_CRLF, SERIAL_LOAD_PRINT_CRLF,
+		      * SERIAL_I2C_PRINT_CRLF
+		      */
 			SERIAL_SETSTATE(SERIAL_IDLE);
 	} else if (serial_state == SERIAL_Y_RECV_REPLY_PRINT_TEMP_NEXT) {
 		if (serial_tmp_ctr >= temp_get_count())
 			SERIAL_SETSTATE(SERIAL_Y_RECV_REPLY_PRINT_CRLF);
 		else
 			SERIAL_SETSTATE(SERIAL_Y_RECV_REPLY_PRINT_TEMP);
+	} else if (serial_state == SERIAL_LOAD_PRINT_MODULE_NEXT) {
+		if (serial_tmp_ctr >= LOAD_MODULES_NUM)
+			SERIAL_SETSTATE(SERIAL_LOAD_PRINT_WAKEUPS);
+		else
+			SERIAL_SETSTATE(SERIAL_LOAD_PRINT_MODULE);
+	} else if (serial_state == SERIAL_I2C_PRINT_DEVICE_NEXT) {
+		if (!serial_i2c_device_exists(serial_tmp_ctr))
+			SERIAL_SETSTATE(SERIAL_I2C_PRINT_CRLF);
+		else
+			SERIAL_SETSTATE(SERIAL_I2C_PRINT_DEVICE);
 	} else if (serial_state == SERIAL_Y_RECV_FAIL_MATCH)
 		SERIAL_SETSTATE(SERIAL_IDLE);
 }
 
-void serial_poll_atomic(void)
+void serial_poll(void)
+{
+	serial_poll_do();
+	serial_sched_update();
+}
+
+static void serial_poll_atomic_do(void)
 {
 	if (serial_state == SERIAL_Y_RECV_REPLY_WAIT_CRLF) {
 		/*
@@ -411,15 +627,18 @@ void serial_poll_atomic(void)
 	}
 }
 
-void serial_get_next_poll_time(timestamp *next_poll)
+void serial_poll_atomic(void)
+{
+	serial_poll_atomic_do();
+	serial_sched_update();
+}
+
+bool serial_needs_poll(void)
 {
 	bool serialconn_needs_service =
-		!serial_is_y_recv_state() && !serialconn_rx_empty();
+		!serial_is_conn_busy_state() && !serialconn_rx_empty();
 	bool serialcpu_needs_service =
-		serial_state != SERIAL_Y_RECV_REPLY_MATCH &&
-		serial_state != SERIAL_Y_RECV_REPLY_WAIT_CRLF &&
-		!serial_is_y_reply_print_state() &&
-		!serialcpu_rx_empty();
+		!serial_is_cpu_busy_state() && !serialcpu_rx_empty();
 	bool serialcpu_needs_match =
 		serial_state == SERIAL_Y_RECV_REPLY_MATCH &&
 		serialcpu_rx_len() > serial_tmp_ctr;
@@ -427,25 +646,29 @@ void serial_get_next_poll_time(timestamp *next_poll)
 		serial_is_conn_tx_empty_wait_state() &&
 		serialconn_tx_empty();
 
-	if (serial_state_changed || serialconn_needs_service ||
-	    serialcpu_needs_service || serialcpu_needs_match ||
-	    serialconn_tx_empty_wait_finished)
-		timekeeping_now_timestamp(next_poll);
-	else if (serial_state == SERIAL_Y_RECV_SILENCE_WAIT) {
-		const timestamp_interval recv_y_silence =
-			TIMESTAMPI_FROM_MS(SERIAL_Y_RECV_SILENCE);
+	return serialconn_needs_service || serialcpu_needs_service ||
+		serialcpu_needs_match || serialconn_tx_empty_wait_finished;
+}
 
-		timestamp_add(&serialcpu_last_rx, &recv_y_silence,
-			      next_poll);
-	} else if (serial_state == SERIAL_Y_RECV_SILENCE_GAP)
-		*next_poll = serialcpu_y_recv_gap_end;
-	else if (serial_state == SERIAL_Y_RECV_REPLY_MATCH ||
-		serial_state == SERIAL_Y_RECV_REPLY_WAIT_CRLF)
-		*next_poll = serialcpu_y_reply_deadline;
-	else
-		timekeeping_timestamp_max_future(next_poll);
+#ifdef TIMEKEEPING_CLOCK_SCALING
+bool serial_can_clock_scale(void)
+{
+	return serial0_can_clock_scale() && serial1_can_clock_scale();
+}
+
+bool serial_is_idle_atomic(void)
+{
+	return serial_state == SERIAL_IDLE && serial0_is_idle_atomic() &&
+		serial1_is_idle_atomic();
 }
 
+void serial_clock_scale_atomic(bool scaled)
+{
+	serial0_clock_scale_atomic(scaled);
+	serial1_clock_scale_atomic(scaled);
+}
+#endif
+
 void serial_setup(void)
 {
 	serial0_setup();
@@ -454,4 +677,6 @@ void serial_setup(void)
 	serial_state = SERIAL_IDLE;
 	serial_state_changed = false;
 	timekeeping_now_timestamp(&serialcpu_last_rx);
+
+	sched_timer_register(&serial_sched_timer, PENDING_SERIAL);
 }
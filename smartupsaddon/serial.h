@@ -12,11 +12,14 @@
 #ifndef _SERIAL_H_
 #define _SERIAL_H_
 
+#include <stdbool.h>
+
 #include "../lib/timekeeping.h"
 
 /*
  * both should be called from time to time
- * (at least when the time returned by serial_get_next_poll_time() comes)
+ * (at least when the serial scheduler timer deadline comes or
+ * serial_needs_poll() returns true)
  *
  * serial_poll_atomic() needs interrupts disabled, serial_poll() does not
  */
@@ -24,8 +27,9 @@ void serial_poll(void);
 void serial_poll_atomic(void);
 
 /*
- * returns the maximum allowed µC sleep period (the sleep needs to have
- * interrupts enabled) with respect to serial ports
+ * returns whether serial ports data (which is changed by interrupt handlers,
+ * so it isn't covered by the serial scheduler timer) needs to be processed
+ * right away
  *
  * before calling this function disable interrupts and call
  * serial_poll_atomic(), then this function, do not enable interrupts between
@@ -36,12 +40,34 @@ void serial_poll_atomic(void);
  *
  * this function doesn't change any internal state (it is purely read-only)
  */
-void serial_get_next_poll_time(timestamp *next_poll);
+bool serial_needs_poll(void);
+
+#ifdef TIMEKEEPING_CLOCK_SCALING
+/*
+ * returns whether the serial ports baud rates can be kept with the system
+ * clock divided
+ */
+bool serial_can_clock_scale(void);
+
+/*
+ * returns whether both serial ports have nothing to receive or transmit
+ * and there is no command in progress, must be called with interrupts
+ * disabled
+ */
+bool serial_is_idle_atomic(void);
+
+/*
+ * adjust serial ports for the system clock divided or not
+ * (see timekeeping_clock_scale_atomic()), must be called with interrupts
+ * disabled
+ */
+void serial_clock_scale_atomic(bool scaled);
+#endif
 
 /*
  * setup serial ports: must be called before any other serial function,
- * must be called with interrupts disabled, uses timekeeping functions,
- * sets up serial ports 0 and 1
+ * must be called with interrupts disabled, uses timekeeping and sched
+ * functions, sets up serial ports 0 and 1
  */
 void serial_setup(void);
 
@@ -10,19 +10,26 @@
  */
 
 #include <stddef.h>
+#include <util/atomic.h>
 
+#include "../lib/critprof.h"
 #include "../lib/debug.h"
 #include "../lib/misc.h"
+#include "../lib/sched.h"
+#include "../lib/i2c.h"
+#include "../lib/i2csoft.h"
+#include "../lib/lm75.h"
 #include "../lib/tc74.h"
+#include "../lib/tempsensor.h"
 #include "fan.h"
 #include "temp.h"
 
-/* temperature limits */
-#define TEMP_FAN_DISABLED_TO_LOW 42
-#define TEMP_FAN_LOW_TO_HIGH 46
+/* temperature limits (as tempsensor_temp) */
+#define TEMP_FAN_DISABLED_TO_LOW TEMPSENSOR_FROM_DEG(42)
+#define TEMP_FAN_LOW_TO_HIGH TEMPSENSOR_FROM_DEG(46)
 #define TEMP_FAN_HIGH_TO_LOW TEMP_FAN_DISABLED_TO_LOW
-#define TEMP_FAN_LOW_TO_DISABLED 38
-#define TEMP_CRITICAL 75
+#define TEMP_FAN_LOW_TO_DISABLED TEMPSENSOR_FROM_DEG(38)
+#define TEMP_CRITICAL TEMPSENSOR_FROM_DEG(75)
 
 /* how often (in ms) sensors should be updated? */
 #ifndef ENABLE_DEBUG_LOG
@@ -38,16 +45,100 @@
  */
 #define TEMP_FAILED_UPDATES_FOR_STALE_DATA 3
 
-/* sensor definitions: count */
-#define TEMP_NUM_SENSORS 3
+/*
+ * sensor definitions: the i2c address range scanned for sensors
+ * (the whole TC74 one by default)
+ */
+#ifndef TEMP_SCAN_ADDR_FIRST
+#define TEMP_SCAN_ADDR_FIRST 0x48
+#define TEMP_SCAN_ADDR_LAST 0x4f
+#endif
+
+#define TEMP_MAX_SENSORS (TEMP_SCAN_ADDR_LAST - TEMP_SCAN_ADDR_FIRST + 1)
+
+/*
+ * sensor definitions: the expected sensors (the on-board / battery one, the
+ * inverter heatsink one and the transformer one by default), in the order
+ * they are reported
+ *
+ * they are in the sensor table from the start, even if they don't answer, so
+ * a dead one counts as stale (sensors that weren't ever found can't) - the
+ * scan only looks for extra ones, less often once all the expected ones have
+ * answered
+ */
+#ifndef TEMP_EXPECTED_ADDRS
+#define TEMP_EXPECTED_ADDRS 0x48, 0x4b, 0x4f
+#endif
+
+/* sensor definitions: the on-board (battery) sensor */
+#define TEMP_ONBOARD_ADDR 0x48
+
+/*
+ * how often (in ms) to scan for new sensors (like a reconnected one), the
+ * slow period is used once all the expected sensors have answered
+ */
+#define TEMP_SCAN_PERIOD 30000
+#define TEMP_SCAN_PERIOD_SLOW ((uint32_t)5 * 60 * 1000)
+
+/*
+ * sensor definitions: i2c bus speeds
+ *
+ * TC74 is only specified up to 100 kHz, so the Fast-mode for the on-board
+ * (battery) sensor, which has the shortest bus run, is opt-in - the speed
+ * gets lowered automatically if the sensor can't keep up
+ */
+#ifdef TEMP_ONBOARD_SENSOR_FAST_I2C
+#define TEMP_ADDR2I2CSPEED(addr)		\
+	(addr == TEMP_ONBOARD_ADDR ? I2C_SPEED_FAST : I2C_SPEED_STANDARD)
+#else
+#define TEMP_ADDR2I2CSPEED(addr) I2C_SPEED_STANDARD
+#endif
+
+/*
+ * sensor definitions: the bus a sensor is on
+ *
+ * with ENABLE_I2CSOFT a sensor that upsets its bus (like the inverter
+ * heatsink one can when the UPS charges at high current) can be moved to the
+ * bit-banged one, so it doesn't hold up the others
+ *
+ * the scan only covers the TWI bus, so software bus sensors (in the scanned
+ * address range) are always in the sensor table
+ */
+typedef enum { TEMP_I2C_BUS_TWI, TEMP_I2C_BUS_SOFT } temp_i2c_buses;
+
+#ifdef ENABLE_I2CSOFT
+#define TEMP_ADDR2I2CBUS(addr)					\
+	(addr == 0x4b ? TEMP_I2C_BUS_SOFT : TEMP_I2C_BUS_TWI)
+#else
+#define TEMP_ADDR2I2CBUS(addr) TEMP_I2C_BUS_TWI
+#endif
 
-/* sensor definitions: i2c addresses */
-#define TEMP_IDX2ADDR(idx)			\
-	(idx == 0 ? 0x48 : idx == 1 ? 0x4b : 0x4f)
+/*
+ * sensor definitions: what sensor is at an address
+ *
+ * TC74 by default, with TEMP_HEATSINK_SENSOR_TMP75 the inverter heatsink one
+ * is a TMP75 (0.125 °C instead of 1 °C, so the fan control sees its
+ * temperature moving sooner) - the LM75 class addresses overlap the TC74 ones
+ *
+ * LM75 class sensors need the ENABLE_LM75 driver
+ */
+typedef enum { TEMP_SENSOR_TC74, TEMP_SENSOR_LM75,
+	       TEMP_SENSOR_TMP75 } temp_sensor_types;
+
+#if defined(TEMP_HEATSINK_SENSOR_TMP75) && !defined(ENABLE_LM75)
+#error TEMP_HEATSINK_SENSOR_TMP75 needs ENABLE_LM75
+#endif
+
+#ifdef TEMP_HEATSINK_SENSOR_TMP75
+#define TEMP_ADDR2SENSOR(addr)					\
+	(addr == 0x4b ? TEMP_SENSOR_TMP75 : TEMP_SENSOR_TC74)
+#else
+#define TEMP_ADDR2SENSOR(addr) TEMP_SENSOR_TC74
+#endif
 
 /* sensor definitions: temperature offsets for limits (excluding Tcritical) */
-#define TEMP_IDX2TOFFSET(idx)			\
-	(idx == 2 ? -20 : 0)
+#define TEMP_ADDR2TOFFSET(addr)			\
+	(addr == 0x4f ? -20 : 0)
 
 #ifdef TEMP_DEBUG_LOG_DISABLE
 #undef dprintf
@@ -63,11 +154,18 @@ typedef enum { TEMP_IDLE,
 
 typedef enum { FAN_DISABLED, FAN_LOW, FAN_HIGH } fan_states;
 
-typedef struct _tc74_temp {
-	int8_t cur;
-	int8_t min;
-	int8_t max;
-} tc74_temp;
+typedef union {
+	tc74_data tc74;
+#ifdef ENABLE_LM75
+	lm75_data lm75;
+#endif
+} temp_sensor_data;
+
+typedef struct _temp_temps {
+	tempsensor_temp cur;
+	tempsensor_temp min;
+	tempsensor_temp max;
+} temp_temps;
 
 static /* temp_states */ uint8_t temp_state;
 static bool temp_state_changed;
@@ -75,12 +173,29 @@ static bool temp_state_changed;
 static /* fan_states */ uint8_t fan_state;
 
 static timestamp temp_next_poll;
+static sched_timer temp_sched_timer;
 
-static tc74_data tc74[TEMP_NUM_SENSORS];
-static tc74_temp tc74_temps[TEMP_NUM_SENSORS];
-static uint8_t tc74_failed_updates[TEMP_NUM_SENSORS];
-static uint8_t tc74_cur_idx;
-static uint8_t tc74_debug_ctr;
+/*
+ * the sensor table: the expected sensors, then the ones in the order they
+ * were found (they are never removed, a disconnected one just goes stale)
+ */
+static uint8_t temp_num_sensors;
+static uint8_t temp_addrs[TEMP_MAX_SENSORS];
+static temp_sensor_data temp_sensors_data[TEMP_MAX_SENSORS];
+static tempsensor temp_sensors[TEMP_MAX_SENSORS];
+static temp_temps temp_sensors_temps[TEMP_MAX_SENSORS];
+static uint8_t temp_failed_updates[TEMP_MAX_SENSORS];
+static uint8_t temp_cur_idx;
+static uint8_t temp_debug_ctr;
+
+static bool temp_scan_started;
+static timestamp temp_next_scan;
+
+static const uint8_t temp_expected_addrs[] = { TEMP_EXPECTED_ADDRS };
+#define TEMP_EXPECTED_NUM					\
+	(sizeof(temp_expected_addrs) / sizeof(temp_expected_addrs[0]))
+_Static_assert(TEMP_EXPECTED_NUM <= TEMP_MAX_SENSORS,
+	       "too many expected sensors");
 
 static bool temp_enable_debug_data(void)
 {
@@ -105,13 +220,13 @@ static bool temp_only_critical_limit(void)
 }
 
 #define TEMP_STALE(idx)		       \
-	(tc74_failed_updates[idx] >=	       \
+	(temp_failed_updates[idx] >=	       \
 	 TEMP_FAILED_UPDATES_FOR_STALE_DATA)
 
 #define TEMP_FAILED_INC(idx)				\
 	do						\
 		if (!TEMP_STALE(idx))			\
-			tc74_failed_updates[idx]++;	\
+			temp_failed_updates[idx]++;	\
 	while (0)
 
 #define TEMP_SETSTATE(state_new)					\
@@ -129,13 +244,13 @@ static void temp_set_state_do(temp_states state_new)
 	temp_state = state_new;
 
 	if (temp_state == TEMP_GET_INIT)
-		tc74_cur_idx = 0;
+		temp_cur_idx = 0;
 	else if (temp_state == TEMP_GET_NEXT)
-		tc74_cur_idx++;
+		temp_cur_idx++;
 	else if (temp_state == TEMP_GET_OK)
-		tc74_failed_updates[tc74_cur_idx] = 0;
+		temp_failed_updates[temp_cur_idx] = 0;
 	else if (temp_state == TEMP_GET_FAILED)
-		TEMP_FAILED_INC(tc74_cur_idx);
+		TEMP_FAILED_INC(temp_cur_idx);
 	else if (temp_state == TEMP_UPDATE_FANS) {
 		const timestamp_interval poll_period =
 			TIMESTAMPI_FROM_MS(TEMP_POLL_PERIOD);
@@ -151,16 +266,13 @@ static void temp_set_state_do(temp_states state_new)
 		if (TEMP_STALE(idx))					\
 			break;						\
 									\
-		int8_t temp_poll_update_fan_temp_cm =			\
-			tc74_temps[idx].cur >= TEMP_CRITICAL ?		\
-			0 : TEMP_CRITICAL - tc74_temps[idx].cur;	\
-									\
-		if (temp_poll_update_fan_temp_cm < temp_critical_margin)\
-			temp_critical_margin =				\
-				temp_poll_update_fan_temp_cm;		\
+		if (temp_sensors_temps[idx].cur > temp_max_raw)		\
+			temp_max_raw = temp_sensors_temps[idx].cur;	\
 									\
-		int8_t temp_poll_update_fan_temp_t =			\
-			tc74_temps[idx].cur + TEMP_IDX2TOFFSET(idx);	\
+		tempsensor_temp temp_poll_update_fan_temp_t =		\
+			temp_sensors_temps[idx].cur +			\
+			TEMPSENSOR_FROM_DEG(				\
+				TEMP_ADDR2TOFFSET(temp_addrs[idx]));	\
 									\
 		if (temp_set && temp >= temp_poll_update_fan_temp_t)	\
 			break;						\
@@ -169,13 +281,135 @@ static void temp_set_state_do(temp_states state_new)
 		temp_set = true;					\
 	} while (0)
 
-void temp_poll(void)
+static bool temp_sensor_exists(uint8_t addr)
+{
+	for (uint8_t ctr = 0; ctr < temp_num_sensors; ctr++)
+		if (temp_addrs[ctr] == addr)
+			return true;
+
+	return false;
+}
+
+static void temp_sensor_add(uint8_t addr)
+{
+	if (temp_num_sensors >= TEMP_MAX_SENSORS)
+		return;
+
+	uint8_t idx = temp_num_sensors;
+
+	dprintf_P(PSTR("temp: sensor %u at %x\n"), (unsigned)idx,
+		  (unsigned)addr);
+
+	temp_addrs[idx] = addr;
+
+	temp_sensor_data *data = &temp_sensors_data[idx];
+	temp_sensor_types type = TEMP_ADDR2SENSOR(addr);
+
+	i2c_transaction_fun i2c_transaction = i2c_transaction_segments_prio;
+#ifdef ENABLE_I2CSOFT
+	if (TEMP_ADDR2I2CBUS(addr) == TEMP_I2C_BUS_SOFT)
+		i2c_transaction = i2csoft_transaction_segments_prio;
+#endif
+
+	CRITPROF_ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_MemoryBarrier();
+		/* the fan control depends on these reads */
+		if (type == TEMP_SENSOR_TC74) {
+			tc74_init(&data->tc74, i2c_transaction, addr,
+				  I2C_PRIO_HIGH, TEMP_PENDING);
+			tempsensor_init(&temp_sensors[idx], &tc74_ops,
+					&data->tc74);
+		}
+#ifdef ENABLE_LM75
+		else {
+			lm75_init(&data->lm75, i2c_transaction, addr,
+				  type == TEMP_SENSOR_TMP75 ?
+				  LM75_TYPE_TMP75 : LM75_TYPE_LM75,
+				  I2C_PRIO_HIGH, TEMP_PENDING);
+			tempsensor_init(&temp_sensors[idx], &lm75_ops,
+					&data->lm75);
+		}
+#endif
+		_MemoryBarrier();
+	}
+
+	if (TEMP_ADDR2I2CBUS(addr) == TEMP_I2C_BUS_TWI)
+		i2c_set_device_speed(addr, TEMP_ADDR2I2CSPEED(addr));
+
+	temp_failed_updates[idx] = TEMP_FAILED_UPDATES_FOR_STALE_DATA;
+	temp_sensors_temps[idx].min = INT16_MAX;
+	temp_sensors_temps[idx].max = INT16_MIN;
+
+	temp_num_sensors++;
+}
+
+/* the expected sensors are the first ones in the sensor table */
+static bool temp_expected_all_present(void)
+{
+	for (uint8_t ctr = 0; ctr < TEMP_EXPECTED_NUM; ctr++)
+		if (TEMP_STALE(ctr))
+			return false;
+
+	return true;
+}
+
+/*
+ * adds extra sensors found by the last scan, starts a new one when it's time
+ * and there is room for more sensors
+ */
+static void temp_scan_poll(const timestamp *now)
+{
+	const timestamp_interval scan_period =
+		TIMESTAMPI_FROM_MS(TEMP_SCAN_PERIOD);
+	const timestamp_interval scan_period_slow =
+		TIMESTAMPI_FROM_MS(TEMP_SCAN_PERIOD_SLOW);
+
+	if (i2c_scan_is_running())
+		return;
+
+	if (temp_scan_started) {
+		temp_scan_started = false;
+
+		for (uint8_t addr = TEMP_SCAN_ADDR_FIRST;
+		     addr <= TEMP_SCAN_ADDR_LAST; addr++)
+			if (TEMP_ADDR2I2CBUS(addr) == TEMP_I2C_BUS_TWI &&
+			    i2c_scan_found(addr) && !temp_sensor_exists(addr))
+				temp_sensor_add(addr);
+	}
+
+	if (temp_num_sensors >= TEMP_MAX_SENSORS)
+		return;
+
+	if (timestamp_temporal_cmp(now, &temp_next_scan, <))
+		return;
+
+	const timestamp_interval *period = temp_expected_all_present() ?
+		&scan_period_slow : &scan_period;
+	timestamp_add(now, period, &temp_next_scan);
+
+	temp_scan_started = i2c_scan_start(TEMP_SCAN_ADDR_FIRST,
+					   TEMP_SCAN_ADDR_LAST);
+}
+
+static void temp_sched_update(void)
+{
+	if (temp_state_changed ||
+	    (temp_state == TEMP_GET &&
+	     !tempsensor_is_busy(&temp_sensors[temp_cur_idx])))
+		sched_timer_set_now(&temp_sched_timer);
+	else if (temp_state == TEMP_IDLE)
+		sched_timer_set(&temp_sched_timer, &temp_next_poll);
+	else
+		sched_timer_clear(&temp_sched_timer);
+}
+
+static void temp_poll_do(void)
 {
 	temp_state_changed = false;
 
 	fan_poll();
-	for (uint8_t ctr = 0; ctr < TEMP_NUM_SENSORS; ctr++)
-		tc74_poll(&tc74[ctr]);
+	for (uint8_t ctr = 0; ctr < temp_num_sensors; ctr++)
+		tempsensor_poll(&temp_sensors[ctr]);
 
 	if (temp_state == TEMP_IDLE) {
 		timestamp now;
@@ -184,76 +418,79 @@ void temp_poll(void)
 					   <))
 			return;
 
+		temp_scan_poll(&now);
+
 		TEMP_SETSTATE(TEMP_GET_INIT);
 	} else if (temp_state == TEMP_GET_INIT ||
 		   temp_state == TEMP_GET_NEXT) {
-		if (tc74_cur_idx >= TEMP_NUM_SENSORS) {
+		if (temp_cur_idx >= temp_num_sensors) {
 			TEMP_SETSTATE(TEMP_UPDATE_FANS);
 			return;
 		}
 
-		if (!tc74_get_temperature(&tc74[tc74_cur_idx])) {
+		if (!tempsensor_get_temperature(&temp_sensors[temp_cur_idx])) {
 			TEMP_SETSTATE(TEMP_GET_FAILED);
 			return;
 		}
 
 		TEMP_SETSTATE(TEMP_GET);
 	} else if (temp_state == TEMP_GET) {
-		if (tc74_is_busy(&tc74[tc74_cur_idx]))
+		if (tempsensor_is_busy(&temp_sensors[temp_cur_idx]))
 			return;
 
-		int8_t temp;
-		if (!tc74_get_temperature_result(&tc74[tc74_cur_idx], &temp)) {
+		tempsensor_temp temp;
+		tempsensor *sensor = &temp_sensors[temp_cur_idx];
+		if (!tempsensor_get_temperature_result(sensor, &temp)) {
 			TEMP_SETSTATE(TEMP_GET_FAILED);
 			return;
 		}
 
 		if (temp_enable_debug_data()) {
-			if (tc74_cur_idx == 0)
-				tc74_debug_ctr++;
+			if (temp_cur_idx == 0)
+				temp_debug_ctr++;
 
-			if (tc74_debug_ctr < 5) {
-				if (tc74_cur_idx == 0 &&
+			if (temp_debug_ctr < 5) {
+				if (temp_cur_idx == 0 &&
 				    temp < TEMP_FAN_LOW_TO_HIGH) {
 					temp = TEMP_FAN_LOW_TO_HIGH;
 					dprintf_P(PSTR_M("temp: faking %S temp at %d\n"),
 						  PSTR_M("high"), 0);
 				}
-			} else if (tc74_debug_ctr < 10) {
-				if (tc74_cur_idx == 1 &&
+			} else if (temp_debug_ctr < 10) {
+				if (temp_cur_idx == 1 &&
 				    temp < TEMP_FAN_LOW_TO_HIGH) {
 					temp = TEMP_FAN_LOW_TO_HIGH;
 					dprintf_P(PSTR_M("temp: faking %S temp at %d\n"),
 						  PSTR_M("high"), 1);
 				}
-			} else if (tc74_debug_ctr < 20) {
-				if (tc74_cur_idx == 1 &&
+			} else if (temp_debug_ctr < 20) {
+				if (temp_cur_idx == 1 &&
 				    temp < TEMP_FAN_DISABLED_TO_LOW) {
 					temp = TEMP_FAN_DISABLED_TO_LOW;
 					dprintf_P(PSTR_M("temp: faking %S temp at %d\n"),
 						  PSTR_M("low"), 1);
 				}
-			} else if (tc74_debug_ctr < 30) {
-				if (tc74_cur_idx == 0 &&
+			} else if (temp_debug_ctr < 30) {
+				if (temp_cur_idx == 0 &&
 				    temp < TEMP_FAN_DISABLED_TO_LOW) {
 					temp = TEMP_FAN_DISABLED_TO_LOW;
 					dprintf_P(PSTR_M("temp: faking %S temp at %d\n"),
 						  PSTR_M("low"), 0);
-				} else if (tc74_cur_idx == 1 &&
+				} else if (temp_cur_idx == 1 &&
 					   temp < TEMP_FAN_LOW_TO_HIGH) {
 					temp = TEMP_FAN_LOW_TO_HIGH;
 					dprintf_P(PSTR_M("temp: faking %S temp at %d\n"),
 						  PSTR_M("high"), 1);
 				}
 			} else
-				tc74_debug_ctr = 0;
+				temp_debug_ctr = 0;
 		}
 
-		tc74_temps[tc74_cur_idx].cur = temp;
-		if (temp < tc74_temps[tc74_cur_idx].min)
-			tc74_temps[tc74_cur_idx].min = temp;
-		if (temp > tc74_temps[tc74_cur_idx].max)
-			tc74_temps[tc74_cur_idx].max = temp;
+		temp_sensors_temps[temp_cur_idx].cur = temp;
+		if (temp < temp_sensors_temps[temp_cur_idx].min)
+			temp_sensors_temps[temp_cur_idx].min = temp;
+		if (temp > temp_sensors_temps[temp_cur_idx].max)
+			temp_sensors_temps[temp_cur_idx].max = temp;
 
 		TEMP_SETSTATE(TEMP_GET_OK);
 	} else if (temp_state == TEMP_GET_OK ||
@@ -261,11 +498,12 @@ void temp_poll(void)
 		TEMP_SETSTATE(TEMP_GET_NEXT);
 	else if (temp_state == TEMP_UPDATE_FANS) {
 		bool temp_set = false;
-		int8_t temp_critical_margin = INT8_MAX;
-		int8_t temp;
+		/* the highest temperature without the offsets */
+		tempsensor_temp temp_max_raw = INT16_MIN;
+		tempsensor_temp temp;
 		typeof(fan_state) fan_state_old = fan_state;
 
-		for (uint8_t ctr = 0; ctr < TEMP_NUM_SENSORS; ctr++)
+		for (uint8_t ctr = 0; ctr < temp_num_sensors; ctr++)
 			TEMP_POLL_UPDATE_FAN_TEMP(ctr);
 
 		if (temp_set) {
@@ -286,11 +524,12 @@ void temp_poll(void)
 					if (temp >= TEMP_FAN_LOW_TO_HIGH)
 						fan_state = FAN_HIGH;
 				}
-			} else if (temp_critical_margin >= 10)
+			} else if (temp_max_raw <=
+				   TEMP_CRITICAL - TEMPSENSOR_FROM_DEG(10))
 				fan_state = FAN_DISABLED;
 
 			bool any_stale = false;
-			for (uint8_t ctr = 0; ctr < TEMP_NUM_SENSORS; ctr++)
+			for (uint8_t ctr = 0; ctr < temp_num_sensors; ctr++)
 				if (TEMP_STALE(ctr)) {
 					any_stale = true;
 					break;
@@ -299,7 +538,7 @@ void temp_poll(void)
 			if (any_stale && fan_state == FAN_DISABLED)
 				fan_state = FAN_LOW;
 
-			if (temp_critical_margin <= 0)
+			if (temp_max_raw >= TEMP_CRITICAL)
 				fan_state = FAN_HIGH;
 		} else
 			fan_state = FAN_HIGH;
@@ -327,105 +566,78 @@ void temp_poll(void)
 	}
 }
 
-#define TEMP_GET_TIMEOUT(funname, ...)					\
-	do {								\
-		timestamp module_next_poll_time;			\
-		funname(__VA_ARGS__ &module_next_poll_time);		\
-		if (!next_poll_time_set ||				\
-		    timestamp_temporal_cmp(&module_next_poll_time,	\
-					   next_poll,			\
-					   <)) {			\
-			*next_poll = module_next_poll_time;		\
-			next_poll_time_set = true;			\
-		}							\
-	} while (0)
-
-#define TEMP_ADD_TIMEOUT(tvar)						\
-	do {								\
-		if (!next_poll_time_set ||				\
-		    timestamp_temporal_cmp(&tvar,			\
-					   next_poll,			\
-					   <)) {			\
-			*next_poll = tvar;				\
-			next_poll_time_set = true;			\
-		}							\
-	} while (0)
-
-void temp_get_next_poll_time(timestamp *next_poll)
+void temp_poll(void)
 {
-	if (temp_state_changed || (temp_state == TEMP_GET &&
-				   !tc74_is_busy(&tc74[tc74_cur_idx])))
-		timekeeping_now_timestamp(next_poll);
-	else {
-		bool next_poll_time_set = false;
-
-		TEMP_GET_TIMEOUT(fan_get_next_poll_time);
-		for (uint8_t ctr = 0; ctr < TEMP_NUM_SENSORS; ctr++)
-			TEMP_GET_TIMEOUT(tc74_get_next_poll_time, &tc74[ctr],);
-
-		if (temp_state == TEMP_IDLE)
-			TEMP_ADD_TIMEOUT(temp_next_poll);
-
-		if (!next_poll_time_set)
-			timekeeping_timestamp_max_future(next_poll);
-	}
+	temp_poll_do();
+	temp_sched_update();
 }
 
 uint8_t temp_get_count(void)
 {
-	return TEMP_NUM_SENSORS;
+	return temp_num_sensors;
 }
 
 bool temp_get(uint8_t idx, int8_t *cur, int8_t *min, int8_t *max)
 {
-	if (idx >= TEMP_NUM_SENSORS)
+	if (idx >= temp_num_sensors)
 		return false;
 
 	if (TEMP_STALE(idx))
 		return false;
 
 	if (cur != NULL)
-		*cur = tc74_temps[idx].cur;
+		*cur = tempsensor_to_deg(temp_sensors_temps[idx].cur);
 
 	if (min != NULL)
-		*min = tc74_temps[idx].min;
+		*min = tempsensor_to_deg(temp_sensors_temps[idx].min);
 
 	if (max != NULL)
-		*max = tc74_temps[idx].max;
+		*max = tempsensor_to_deg(temp_sensors_temps[idx].max);
 
 	return true;
 }
 
 bool temp_reset_minmax(uint8_t idx)
 {
-	if (idx >= TEMP_NUM_SENSORS)
+	if (idx >= temp_num_sensors)
 		return false;
 
 	if (TEMP_STALE(idx)) {
-		tc74_temps[idx].min = INT8_MAX;
-		tc74_temps[idx].max = INT8_MIN;
+		temp_sensors_temps[idx].min = INT16_MAX;
+		temp_sensors_temps[idx].max = INT16_MIN;
 	} else
-		tc74_temps[idx].min = tc74_temps[idx].max = tc74_temps[idx].cur;
+		temp_sensors_temps[idx].min = temp_sensors_temps[idx].max =
+			temp_sensors_temps[idx].cur;
 
 	return true;
 }
 
 void temp_setup(void)
 {
-	for (uint8_t ctr = 0; ctr < TEMP_NUM_SENSORS; ctr++) {
-		tc74_init(&tc74[ctr], TEMP_IDX2ADDR(ctr));
-		tc74_failed_updates[ctr] = TEMP_FAILED_UPDATES_FOR_STALE_DATA;
-		tc74_temps[ctr].min = INT8_MAX;
-		tc74_temps[ctr].max = INT8_MIN;
-	}
+	temp_num_sensors = 0;
+	for (uint8_t ctr = 0; ctr < TEMP_EXPECTED_NUM; ctr++)
+		temp_sensor_add(temp_expected_addrs[ctr]);
 
-	fan_setup();
+	for (uint8_t addr = TEMP_SCAN_ADDR_FIRST;
+	     addr <= TEMP_SCAN_ADDR_LAST; addr++)
+		if (TEMP_ADDR2I2CBUS(addr) == TEMP_I2C_BUS_SOFT &&
+		    !temp_sensor_exists(addr))
+			temp_sensor_add(addr);
+
+	fan_setup(TEMP_PENDING);
 
 	timekeeping_now_timestamp(&temp_next_poll);
 
+	/* the first scan is started on the first poll */
+	temp_scan_started = false;
+	temp_next_scan = temp_next_poll;
+
 	temp_state = TEMP_IDLE;
 	temp_state_changed = false;
 
+	sched_timer_register(&temp_sched_timer, TEMP_PENDING);
+	temp_sched_update();
+
 	fan_state = FAN_HIGH;
 	fan_enable_high();
 }
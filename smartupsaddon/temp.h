@@ -15,28 +15,29 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "../lib/pending.h"
 #include "../lib/timekeeping.h"
 
 /*
- * should be called from time to time
- * (at least when the time returned by temp_get_next_poll_time() comes)
+ * pending work flag of the temperature controller (shared with the fan
+ * controller and the sensors it polls)
  */
-void temp_poll(void);
+#define TEMP_PENDING PENDING_APP_FIRST
 
 /*
- * should be called with interrupts disabled because enabling interrupts at any
- * time later invalidates the returned value
- *
- * this function doesn't change any internal state (it is purely read-only)
+ * should be called from time to time
+ * (at least when the earliest temperature controller, fan controller or sensor
+ * scheduler timer deadline comes, that is, TEMP_PENDING work is due)
  */
-void temp_get_next_poll_time(timestamp *next_poll);
+void temp_poll(void);
 
 /* get temperature sensors count */
 uint8_t temp_get_count(void);
 
 /*
  * get temperature sensor idx temperatures: current, min and max
- * (all output paramaters are optional so any can be NULL if not needed)
+ * (all output paramaters are optional so any can be NULL if not needed),
+ * rounded to whole degrees
  *
  * doesn't reset sensor min / max values
  */
@@ -47,8 +48,8 @@ bool temp_reset_minmax(uint8_t idx);
 
 /*
  * setup the temperature controller: must be called before any other temp
- * function, must be called with interrupts disabled, uses timekeeping and tc74
- * functions, sets up the fan controller
+ * function, must be called with interrupts disabled, uses timekeeping, sched
+ * and sensor driver functions, sets up the fan controller
  */
 void temp_setup(void);
 